@@ -0,0 +1,128 @@
+/**
+  \file G3D-app.lib/include/G3D-app/ATrousDenoiser.h
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#ifndef GLG3D_ATrousDenoiser_h
+#define GLG3D_ATrousDenoiser_h
+
+#include "G3D-base/platform.h"
+#include "G3D-base/ReferenceCount.h"
+#include "G3D-base/Array.h"
+#include "G3D-base/Color3.h"
+
+namespace G3D {
+
+class Image;
+
+/**
+  \brief CPU edge-avoiding &agrave;-trous wavelet denoiser for path-traced images.
+
+  Filters a noisy radiance image with the feature images that PathTracer::traceImage()
+  writes at the first hit of each pixel: albedo, shading normal, and depth. Each of
+  Settings::numPasses passes applies the 5x5 B3-spline kernel with holes, doubling
+  the spacing between taps every pass. Each tap is weighted by how similar its color,
+  normal, and depth are to the center's. Noise averages out across flat regions and
+  edges in the features are preserved.
+
+  When there is an albedo image, the filter runs on radiance divided by albedo and
+  multiplies the albedo back in at the end, so texture detail is not blurred.
+
+  The color and features are stored as one plane per channel. Rows are processed
+  concurrently, and on x86 each group of four adjacent pixels whose taps are all inside
+  the image is filtered at once with SSE. The other pixels near the left and right edges
+  are filtered one at a time.
+
+  \cite Dammertz, Sewtz, Hanika, and Lensch, Edge-Avoiding &Agrave;-Trous Wavelet Transform for fast Global Illumination Filtering, HPG 2010
+
+  \sa PathTracer, UniversalBlurCPU
+*/
+class ATrousDenoiser : public ReferenceCountedObject {
+public:
+
+    class Settings {
+    public:
+        /** Each pass doubles the tap spacing, so the kernel spans 4 * 2^numPasses - 3 pixels */
+        int         numPasses;
+
+        /** Color difference, relative to the center's magnitude, at which the weight of a tap falls to 1/e.
+            Halved after each pass so that later, wider passes only average similar colors. */
+        float       colorSigma;
+
+        /** The dot product of the normals is raised to the power 2^normalPowerLog2,
+            computed by repeated squaring */
+        int         normalPowerLog2;
+
+        /** Depth difference, relative to the center's depth and per pixel of distance, at which
+            the weight of a tap falls to 1/e */
+        float       depthSigma;
+
+        Settings() : numPasses(5), colorSigma(0.5f), normalPowerLog2(6), depthSigma(0.05f) {}
+    };
+
+protected:
+
+    /** Ping-pong buffers of demodulated color, one plane per channel */
+    Array<float>                m_color[2][3];
+
+    /** Clamped away from zero, or empty if there is no albedo image */
+    Array<Color3>               m_albedo;
+
+    /** One plane per axis. Zero at pixels that missed the scene, or empty if there is no normal image. */
+    Array<float>                m_normal[3];
+
+    /** Zero at pixels that missed the scene, or empty if there is no depth image */
+    Array<float>                m_depth;
+
+    /** One at pixels where the first ray hit the scene and zero where it missed,
+        or empty if there is neither a normal nor a depth image */
+    Array<float>                m_hit;
+
+    ATrousDenoiser() {}
+
+    void readInputs
+       (const shared_ptr<Image>&    color,
+        const shared_ptr<Image>&    albedo,
+        const shared_ptr<Image>&    normal,
+        const shared_ptr<Image>&    depth,
+        bool                        singleThreaded);
+
+    /** Filters m_color[src] into m_color[1 - src] with taps \a step pixels apart */
+    void filterPass(int width, int height, int src, int step, float colorSigma, const Settings& settings, bool singleThreaded);
+
+    /** Filters pixel (x, y) for filterPass(), skipping taps outside of the image */
+    void filterPixel(int x, int y, int width, int height, int src, int step, float invColorSigma2, const Settings& settings);
+
+#   ifdef G3D_X86
+    /** Same as filterPixel() for the four pixels from (x, y) to (x + 3, y) at once.
+        Every tap of those pixels must be inside the image horizontally. */
+    void filterFour(int x, int y, int width, int height, int src, int step, float invColorSigma2, const Settings& settings);
+#   endif
+
+public:
+
+    static shared_ptr<ATrousDenoiser> create();
+
+    /**
+        \param color Noisy radiance
+        \param albedo First-hit albedo. May be nullptr.
+        \param normal First-hit world-space shading normal, zero where the ray missed. May be nullptr.
+        \param depth First-hit camera-space depth in the R channel, infinite where the ray missed. May be nullptr.
+        \param result Must have the same dimensions as \a color. May be \a color.
+    */
+    void apply
+       (const shared_ptr<Image>&    color,
+        const shared_ptr<Image>&    albedo,
+        const shared_ptr<Image>&    normal,
+        const shared_ptr<Image>&    depth,
+        const shared_ptr<Image>&    result,
+        const Settings&             settings = Settings(),
+        bool                        singleThreaded = false);
+};
+
+} // namespace G3D
+
+#endif // GLG3D_ATrousDenoiser_h
@@ -117,6 +117,10 @@ public:
     /** \param debugName Used for naming textures. Does not affect which shaders are loaded.*/
     static shared_ptr<DepthOfField> create(const String& debugName = "G3D::DepthOfField");
 
+    /** False if apply() would only copy the color through for \a camera, because depth of field
+        is disabled or replaced by universal blur */
+    static bool enabled(const shared_ptr<Camera>& camera);
+
     /** Applies depth of field blur to supplied images and renders to
         the currently-bound framebuffer.  The current framebuffer may
         have the \a color and \a depth values bound to it.
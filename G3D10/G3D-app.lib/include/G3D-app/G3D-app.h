@@ -19,6 +19,7 @@
 #include "G3D-app/EmbreeTriTree.h"
 #include "G3D-app/OptiXTriTree.h"
 #include "G3D-app/VulkanTriTree.h"
+#include "G3D-app/TriTreeBenchmark.h"
 #include "G3D-app/GFont.h"
 #include "G3D-app/UserInput.h"
 #include "G3D-app/FirstPersonManipulator.h"
@@ -88,6 +89,7 @@
 #include "G3D-app/Scene.h"
 #include "G3D-app/SceneVisualizationSettings.h"
 #include "G3D-app/UniversalSurfel.h"
+#include "G3D-app/SurfelArena.h"
 #include "G3D-app/MotionBlur.h"
 #include "G3D-app/HeightfieldModel.h"
 #include "G3D-app/ArticulatedModelSpecificationEditorDialog.h"
@@ -102,6 +104,9 @@
 #include "G3D-app/AmbientOcclusion.h"
 #include "G3D-app/DepthOfField.h"
 #include "G3D-app/UniversalBlur.h"
+#include "G3D-app/UniversalBlurCPU.h"
+#include "G3D-app/UniversalBlurBenchmark.h"
+#include "G3D-app/PostProcessChain.h"
 #include "G3D-app/Skybox.h"
 #include "G3D-app/SkyboxSurface.h"
 #include "G3D-app/VisibleEntity.h"
@@ -113,6 +118,7 @@
 #include "G3D-app/TemporalFilter.h"
 #include "G3D-app/BilateralFilter.h"
 #include "G3D-app/PathTracer.h"
+#include "G3D-app/ATrousDenoiser.h"
 #include "G3D-app/FogVolumeSurface.h"
 #include "G3D-app/VRApp.h"
 #include "G3D-app/XRWidget.h"
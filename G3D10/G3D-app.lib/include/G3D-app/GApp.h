@@ -39,6 +39,7 @@ class DebugTextWidget;
 class DepthOfField;
 class Log;
 class MotionBlur;
+class PostProcessChain;
 class RenderDevice;
 class Renderer;
 class Scene;
@@ -537,6 +538,10 @@ protected:
 
     shared_ptr<UniversalBlur>          m_universalBlur;
 
+    /** Applies m_depthOfField, m_motionBlur, and m_universalBlur in onPostProcessHDR3DEffects
+        without copying the framebuffer between them */
+    shared_ptr<PostProcessChain>    m_postProcessChain;
+
     /** GBuffer used for the OSWindow. VRApp adds per-eye HMD GBuffers */ 
     shared_ptr<GBuffer>             m_osWindowGBuffer;
 
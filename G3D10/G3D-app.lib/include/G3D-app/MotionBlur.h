@@ -31,7 +31,7 @@ class Camera;
 class MotionBlur : public ReferenceCountedObject {
 protected:
 
-    /** The source color is copied into this if needed. Saved between invocations to avoid reallocating the texture.*/
+    /** The source color is copied into this if it is also the draw target. Saved between invocations to avoid reallocating the texture.*/
     shared_ptr<Texture>         m_cachedSrc;
 
     bool                        m_debugShowTiles;
@@ -72,7 +72,8 @@ protected:
      int                               numSamplesOdd,
      int                               maxBlurRadiusPixels,
      float                             exposureTimeFraction,
-     Vector2int16                      trimBandThickness);
+     Vector2int16                      trimBandThickness,
+     Vector2int16                      colorBufferOffset = Vector2int16(0, 0));
 
     MotionBlur();
 
@@ -100,6 +101,10 @@ public:
     static shared_ptr<MotionBlur> create() {
         return shared_ptr<MotionBlur>(new MotionBlur());
     }
+
+    /** False if apply() would do nothing for \a camera, because motion blur is disabled or
+        replaced by universal blur */
+    static bool enabled(const shared_ptr<Camera>& camera);
     
     /**
         \param trimBandThickness Input texture coordinates are clamped to
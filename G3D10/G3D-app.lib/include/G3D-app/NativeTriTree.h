@@ -10,12 +10,15 @@
 
 #include "G3D-base/platform.h"
 #include <functional>
+#include <mutex>
 #include "G3D-base/Color3.h"
 #include "G3D-base/AABox.h"
 #include "G3D-base/MemoryManager.h"
 #include "G3D-base/SmallArray.h"
+#include "G3D-base/Table.h"
 #include "G3D-base/Triangle.h"
 #include "G3D-base/PrecomputedRay.h"
+#include "G3D-base/CoordinateFrame.h"
 #include "G3D-app/TriTreeBase.h"
 #include "G3D-app/Component.h"
 
@@ -24,6 +27,13 @@
 #endif
 
 namespace G3D {
+class Entity;
+class Material;
+
+namespace _internal {
+class MappedFile;
+}
+
 /**
  \brief Native C++ implementation of a static bounding interval hierarchy
         that is very good for box queries and OK for ray-triangle.
@@ -69,7 +79,14 @@ public:
             Theory indicates that this gives the highest performance
             for ray intersection, although that may not be the case
             for specific scenes and rays.*/
-        SAH};
+        SAH,
+
+        /** Approximate the Surface Area Heuristic by binning polygon
+            centers into Settings::numBins equal intervals along each axis
+            and evaluating only the bin boundaries. Linear time per node
+            without sorting, so it builds nearly as fast as MEAN_EXTENT
+            with tree quality close to SAH. Recommended for large scenes.*/
+        BINNED_SAH};
 
     class Settings {
     public:
@@ -109,11 +126,47 @@ public:
             the fast method.*/
         int                accurateSAHCountThreshold;
 
+        /** Number of intervals along each axis for BINNED_SAH */
+        int                numBins;
+
+        /** Nodes with at least this many polygons build their two
+            children concurrently, and very large nodes also bin and
+            split their polygons concurrently. The tree is identical
+            for every value. Set to <code>std::numeric_limits<int>::max()</code>
+            to build on a single thread.*/
+        int                parallelBuildThreshold;
+
+        /** setContents() with an array of Surfaces refits the existing
+            tree instead of rebuilding it when the same Entitys produce
+            the same numbers of triangles and vertices as in the previous
+            call. Only the surfaces of Entitys that changed after
+            lastBuildTime() are re-extracted. A refit tree traces more
+            slowly as geometry moves away from where the tree was built,
+            so it is rebuilt after this many consecutive refits. Set to
+            zero to always rebuild.*/
+        int                maxRefitsPerRebuild;
+
+        /** If true, setContents() with an array of Surfaces stores geometry
+            that the scene places more than once in a two-level tree. Each
+            unique UniversalSurface geometry (the same source CPUVertexArray,
+            index arrays, and materials) gets one bottom-level tree in object
+            space, and a top-level tree over the instance transforms places
+            it. Rays are transformed into object space to traverse an
+            instance, and Hit::instance identifies it. Geometry placed once
+            stays in the world-space tree, which is all that triArray() and
+            the overlap queries such as intersectBox() see. Instanced contents are
+            always rebuilt rather than refit.*/
+        bool               instancing;
+
         inline Settings() : 
             algorithm(MEAN_EXTENT), 
             maxAreaFraction(1.0f / 11.0f), 
             valuesPerLeaf(4),
-            accurateSAHCountThreshold(125) {}
+            accurateSAHCountThreshold(125),
+            numBins(16),
+            parallelBuildThreshold(2048),
+            maxRefitsPerRebuild(30),
+            instancing(false) {}
     };
 
     static const char* algorithmName(SplitAlgorithm s);
@@ -140,9 +193,19 @@ public:
         /** Max tris per node of any node */
         int largestNode;
 
+        /** Expected cost of tracing a ray through the tree under the
+            Surface Area Heuristic: the sum over nodes of the
+            probability of entering the node, relative to the root,
+            times the cost of its box and triangle tests. Lower is
+            better. Compare across SplitAlgorithm values on the same scene.*/
+        float sahCost;
+
+        /** Seconds taken by the most recent rebuild() */
+        RealTime buildTime;
+
         Stats() : numLeaves(0), numTris(0), numNodes(0), shallowestLeaf(100000),
                   shallowestNodeOverMin(100000), averageValuesPerLeaf(0), 
-                  depth(0), largestNode(0) {}
+                  depth(0), largestNode(0), sahCost(0), buildTime(0) {}
     };
 
 private:
@@ -273,6 +336,153 @@ private:
         AABox            bounds;
     };
     
+    /** A Node of the linearized tree that intersectRay() traverses, occupying
+        one 64-byte cache line. Nodes are stored in depth-first order, so the
+        first child of node i is node i + 1 and only the second child's index
+        is stored. The triangles of a node are contiguous in m_flatTriBlock. */
+    class FlatNode {
+    public:
+        /** Bounds on this node and all of its children */
+        Vector3          low;
+        Vector3          high;
+
+        /** Position along the split axis */
+        float            splitLocation;
+
+        /** Index of the second child in the high bits and the split axis in
+            the low 2 bits, like Node::packedChildAxis. Less than 4 at leaves,
+            because the root is never a child. */
+        uint32           secondChildAxis;
+
+        /** Bounds on this node's triangles. Undefined when numTriBlocks == 0. */
+        Vector3          triLow;
+        Vector3          triHigh;
+
+        /** Range of m_flatTriBlock */
+        uint32           firstTriBlock;
+        uint32           numTriBlocks;
+
+        inline bool isLeaf() const {
+            return secondChildAxis < 4;
+        }
+
+        inline int secondChild() const {
+            return int(secondChildAxis >> 2);
+        }
+
+        inline Vector3::Axis splitAxis() const {
+            return static_cast<Vector3::Axis>(secondChildAxis & 3);
+        }
+
+        /** Called from intersectRay to determine which child the ray hits first.
+
+             There are three cases to consider:
+             
+              1. the ray can start on one side of the splitting plane and never enter the other,
+              2. the ray can start on one side and enter the other, and
+              3. the ray can travel exactly down the splitting plane
+        */
+        inline void computeTraversalOrder(const PrecomputedRay& ray, int& firstChild, int& secondChild) const {
+            const Vector3::Axis axis = splitAxis();
+            const float origin = ray.origin()[axis];
+            const float direction = ray.direction()[axis];
+
+            if (origin < splitLocation) {
+        
+                // The ray starts on the small side
+                firstChild = 0;
+        
+                if (direction > 0) {
+                    // The ray will eventually reach the other side
+                    secondChild = 1;
+                }
+        
+            } else if (origin > splitLocation) {
+        
+                // The ray starts on the large side
+                firstChild = 1;
+        
+                if (direction < 0) {
+                    // The ray will eventually reach the other side
+                    secondChild = 0;
+                }
+            } else {
+
+                // The ray starts *on* the splitting plane
+                if (direction < 0) {
+                    // ...and goes to the small side
+                    firstChild = 0;
+                } else if (direction > 0) {
+                    // ...and goes to the large side
+                    firstChild = 1;
+                } else {
+                    // ...and travels in the splitting plane.  The order is
+                    // arbitrary
+                    firstChild  = 0;
+                    secondChild = 1;
+                }
+            }
+        }
+    };
+
+    /** Four Tris with the data for ray intersection copied out of the Tri
+        and CPUVertexArray, in structure-of-arrays form so that one ray is
+        tested against all of them at once with SSE. A node's triangles are
+        contiguous blocks, the last of which is padded with unused lanes that
+        have zero edges and so are never hit. 160 bytes, or 40 per triangle.
+        Materials are looked up through m_triMaterial, so neither
+        intersection nor the alpha test reads the Tri's shared_ptr. */
+    class FlatTriBlock {
+    public:
+        static const int SIZE = 4;
+
+        enum {TWO_SIDED = 1, HAS_PARTIAL_COVERAGE = 2, FLAG_BITS = 2};
+
+        /** data[] of unused lanes */
+        static const uint32 UNUSED = 0xFFFFFFFF;
+
+        /** Position of vertex 0, by axis and then lane */
+        float            v0[3][SIZE];
+
+        /** Edges from vertex 0 to vertices 1 and 2 */
+        float            e1[3][SIZE];
+        float            e2[3][SIZE];
+
+        /** Index into m_triArray in the high bits and TWO_SIDED and
+            HAS_PARTIAL_COVERAGE in the low FLAG_BITS, or UNUSED */
+        uint32           data[SIZE];
+
+        inline bool used(int lane) const {
+            return data[lane] != UNUSED;
+        }
+
+        inline int triIndex(int lane) const {
+            return int(data[lane] >> FLAG_BITS);
+        }
+
+        inline uint32 flags(int lane) const {
+            return data[lane] & ((1 << FLAG_BITS) - 1);
+        }
+
+        inline Vector3 vertex0(int lane) const {
+            return Vector3(v0[0][lane], v0[1][lane], v0[2][lane]);
+        }
+
+        inline Vector3 edge1(int lane) const {
+            return Vector3(e1[0][lane], e1[1][lane], e1[2][lane]);
+        }
+
+        inline Vector3 edge2(int lane) const {
+            return Vector3(e2[0][lane], e2[1][lane], e2[2][lane]);
+        }
+
+        /** Marks every lane as unused */
+        void clear();
+
+        /** Copies the current data of \a tri = m_triArray[\a index] into \a lane */
+        void set(int lane, const Tri& tri, int index, const CPUVertexArray& vertexArray);
+    };
+
     class Node {
     private:
         
@@ -342,6 +552,21 @@ private:
 
         float chooseSAHSplitLocationFast(Array<Poly>& source, Vector3::Axis axis, const Settings& settings);
 
+        /** Does not reorder \a source */
+        float chooseBinnedSAHSplitLocation(const Array<Poly>& source, Vector3::Axis axis, const Settings& settings);
+
+        /** Calls Poly::split on every element of \a original, concurrently in
+            order-preserving chunks when there are many. */
+        static void splitPolys
+           (const Array<Poly>& original,
+            Vector3::Axis      axis,
+            float              offset,
+            float              minSpanArea,
+            const Settings&    settings,
+            Array<Poly>&       lowArray,
+            Array<Poly>&       highArray,
+            Array<Poly>&       spanArray);
+
         /** The SAHCost of tracing against just this array. */
         static float SAHCost(int size, float area, float containingArea);
 
@@ -356,56 +581,6 @@ private:
                              const Array<Poly>& original, float containingArea, 
                              const Settings& settings);
 
-        /** Called from intersect to determine which child the ray hits first.
-
-             There are three cases to consider:
-             
-              1. the ray can start on one side of the splitting plane and never enter the other,
-              2. the ray can start on one side and enter the other, and
-              3. the ray can travel exactly down the splitting plane
-        */
-        inline void computeTraversalOrder(const PrecomputedRay& ray, int& firstChild, int& secondChild) const {
-            const Vector3::Axis axis = splitAxis();
-            const float origin = ray.origin()[axis];
-            const float direction = ray.direction()[axis];
-
-            if (origin < splitLocation) {
-        
-                // The ray starts on the small side
-                firstChild = 0;
-        
-                if (direction > 0) {
-                    // The ray will eventually reach the other side
-                    secondChild = 1;
-                }
-        
-            } else if (origin > splitLocation) {
-        
-                // The ray starts on the large side
-                firstChild = 1;
-        
-                if (direction < 0) {
-                    // The ray will eventually reach the other side
-                    secondChild = 0;
-                }
-            } else {
-
-                // The ray starts *on* the splitting plane
-                if (direction < 0) {
-                    // ...and goes to the small side
-                    firstChild = 0;
-                } else if (direction > 0) {
-                    // ...and goes to the large side
-                    firstChild = 1;
-                } else {
-                    // ...and travels in the splitting plane.  The order is
-                    // arbitrary
-                    firstChild  = 0;
-                    secondChild = 1;
-                }
-            }
-        }
-
     public:
 
         Node(Array<Poly>& originals, const Settings& settings, 
@@ -417,25 +592,22 @@ private:
 
         void draw(RenderDevice* rd, const CPUVertexArray& vertexArray, int level, bool showBoxes, int minNodeSize) const;
 
-        /** Append all contained triangles that intersect this to triArray. Assumes that this node 
-            does intersect the box. 
-
-            \param alreadyAdded Since nodes do not have unique ownership of triangles, this set is needed
-            to avoid adding duplicates to the triArray.
-          */  
-        void intersectBox(const AABox& box, const CPUVertexArray& vertexArray, Array<Tri>& triArray, Set<Tri*>& alreadyAdded) const;
-        void intersectSphere(const Sphere& sphere, const CPUVertexArray& vertexArray, Array<Tri>& triArray, Set<Tri*>& alreadyAdded) const;
-
         void print(const String& indent) const;
 
-        void getStats(Stats& s, int level, int valuesPerNode) const;
+        /** \param rootArea Surface area of the root bounds, for Stats::sahCost. Ignored at level 0, where it is computed. */
+        void getStats(Stats& s, int level, int valuesPerNode, float rootArea) const;
+
+        /** Recomputes bounds bottom-up from the current vertex positions,
+            keeping the splitting planes. Children are refit concurrently
+            at levels shallower than \a parallelDepth. */
+        void refit(const CPUVertexArray& vertexArray, int parallelDepth);
 
-        bool intersectRay
+        /** Appends this subtree to \a nodeArray in depth-first order and the
+            triangles of each of its nodes to \a blockArray, in whole blocks. */
+        void flatten
         (const NativeTriTree&               triTree,
-         const PrecomputedRay&              ray,
-         float                              maxDistance,
-         Hit&                               hit,
-         IntersectRayOptions                options) const;
+         Array<FlatNode>&                   nodeArray,
+         Array<FlatTriBlock>&               blockArray) const;
     };
 
     /** Memory manager used to allocate Nodes and Tri arrays. */
@@ -443,6 +615,242 @@ private:
 
     /** Allocated with m_memoryManager */
     Node*                m_root;
+
+    /** Linearized copy of the tree under m_root, allocated with
+        System::alignedMalloc on a cache-line boundary. Used for ray
+        intersection; the other queries traverse the Nodes. */
+    FlatNode*            m_flatNode;
+    int                  m_numFlatNodes;
+
+    /** Allocated with System::alignedMalloc */
+    FlatTriBlock*        m_flatTriBlock;
+    int                  m_numFlatTriBlocks;
+
+    /** Distinct materials of m_triArray, resolved from each Tri's data once
+        by updateMaterialTable() so that sampling and alpha testing a hit
+        need no dynamic_cast or reference counting. Null for Tris without a
+        material. */
+    Array<shared_ptr<Material>> m_materialTable;
+
+    /** Index into m_materialTable of each element of m_triArray */
+    Array<int>           m_triMaterial;
+
+    /** Recomputes m_materialTable and m_triMaterial after m_triArray changes */
+    void updateMaterialTable();
+
+    /** The material of m_triArray[\a triIndex], or nullptr */
+    inline const Material* triMaterial(int triIndex) const {
+        return m_materialTable[m_triMaterial[triIndex]].get();
+    }
+
+    /** Returns true if the ray passes through m_triArray[\a triIndex] at
+        barycentric (\a u, \a v) because its coverage there is at most
+        \a threshold. Same as Tri::intersectionAlphaTest, without resolving
+        the material through the Tri. */
+    bool passesAlphaTest(int triIndex, float u, float v, float threshold) const;
+
+    Settings             m_settings;
+
+    /** Duration of the most recent rebuild(), in seconds */
+    RealTime             m_buildDuration;
+
+    /** Rebuilds m_flatNode and m_flatTriBlock from m_root */
+    void flatten();
+
+    /** Recomputes the FlatTriBlocks of the subtree of flat node \a index, whose
+        nodes end before \a end, and then its bounds bottom-up. */
+    void refitFlat(int index, int end);
+
+    /** The triangles and vertices that setContents() extracted from a run of
+        consecutive Surfaces of one Entity, at contiguous indices */
+    class SurfaceGroup {
+    public:
+        /** Null for surfaces without an Entity, which are re-extracted by every update */
+        weak_ptr<Entity>   entity;
+        int                firstSurface;
+        int                numSurfaces;
+        int                firstTri;
+        int                numTris;
+        int                firstVertex;
+        int                numVertices;
+    };
+
+    /** Groups of the most recent setContents() from Surfaces. Empty if the
+        contents came from elsewhere, which forces the next update to rebuild. */
+    Array<SurfaceGroup>  m_surfaceGroup;
+
+    /** Refits since the most recent rebuild() */
+    int                  m_numRefits;
+
+    /** True when refit() has been called since the most recent rebuild(). The
+        splitting planes then no longer separate the contents of the children,
+        so intersectRay() cannot use them to skip a child. */
+    bool                 m_refit;
+
+    /** Splits \a surfaceArray into runs of consecutive Surfaces with the same
+        Entity, which Scene::onPose produces. Sets only the Surface fields. */
+    static void findSurfaceGroups(const Array<shared_ptr<Surface>>& surfaceArray, Array<SurfaceGroup>& groupArray);
+
+    /** Replaces the triangles and vertices of every group whose Entity changed
+        after lastBuildTime() with newly extracted ones and refits the tree.
+        Returns false without refitting if the groups or their sizes differ
+        from m_surfaceGroup, in which case the contents must be rebuilt. */
+    bool updateSurfaces
+       (const Array<shared_ptr<Surface>>&  surfaceArray,
+        const Array<SurfaceGroup>&         groupArray,
+        ImageStorage                       newStorage);
+
+    /** Number of rays that intersectRayPacket() traces together, one per SSE lane */
+    static const int PACKET_SIZE = 4;
+
+    /** Traces \a numRays <= PACKET_SIZE rays through the flattened tree together,
+        testing each node box and triangle against all of them at once with SSE.
+        Used by intersectRays() for COHERENT_RAY_HINT, when neighboring rays
+        visit mostly the same nodes. Falls back to intersectRay() for each ray on
+        platforms without SSE. Writes every element of \a hit.
+        Implemented in NativeTriTree_packet.cpp. */
+    void intersectRayPacket
+       (const PrecomputedRay*              ray,
+        int                                numRays,
+        Hit*                               hit,
+        IntersectRayOptions                options) const;
+
+    /** Batches smaller than this are traced in their original order even
+        with REORDER_RAYS_HINT, because sorting would cost more than it saves */
+    static const int MIN_REORDER_RAYS = 4096;
+
+    /** Computes the permutation that sorts \a rays by the Morton code of their
+        origin within the tree bounds and then by direction octant, using a
+        parallel radix sort. rays[order[i]] is the i'th ray in sorted order.
+        Implemented in NativeTriTree_reorder.cpp. */
+    void computeRayOrder
+       (const Array<PrecomputedRay>&       rays,
+        Array<int>&                        order) const;
+
+    /** A placement of a bottom-level tree when Settings::instancing is enabled */
+    class Instance {
+    public:
+        /** Object to world. Rigid, so distances along a ray are the same in both spaces. */
+        CFrame           frame;
+
+        /** Index into m_prototypeArray */
+        int              prototype;
+
+        /** World-space bounds */
+        AABox            bounds;
+    };
+
+    /** A node of the top-level tree over m_instanceArray. Stored in
+        depth-first order like FlatNode, so the first child of node i is
+        node i + 1. */
+    class InstanceNode {
+    public:
+        Vector3          low;
+        Vector3          high;
+
+        /** 0 at leaves, which the root never is a child */
+        int              secondChild;
+
+        /** Range of m_instanceArray at a leaf */
+        int              firstInstance;
+        int              numInstances;
+    };
+
+    /** Bottom-level trees, in object space */
+    Array<shared_ptr<NativeTriTree>> m_prototypeArray;
+
+    /** Ordered so that each leaf of m_instanceNode is a contiguous range */
+    Array<Instance>      m_instanceArray;
+
+    Array<InstanceNode>  m_instanceNode;
+
+    /** Version of the format written by save(). Increment when FlatNode,
+        FlatTriBlock, CPUVertexArray::Vertex, or the file layout changes. */
+    static const int     FILE_FORMAT_VERSION = 3;
+    /** When the tree was load()ed, m_flatNode and m_flatTriBlock point into this
+        mapping instead of being allocated */
+    shared_ptr<_internal::MappedFile> m_mappedFile;
+
+    /** Hash of the Settings that affect the tree built from given contents */
+    size_t settingsHash() const;
+
+    /** Implements setContents() for Settings::instancing. Implemented in NativeTriTree_instance.cpp. */
+    void setInstancedContents
+       (const Array<shared_ptr<Surface>>&  surfaceArray,
+        ImageStorage                       newStorage);
+
+    /** Appends the subtree over m_instanceArray[first...first + count - 1]
+        to m_instanceNode, reordering that range */
+    void buildInstanceTree(int first, int count);
+
+    /** Traces \a ray against the world-space tree and then all instances. */
+    bool intersectInstances
+       (const PrecomputedRay&              ray,
+        Hit&                               hit,
+        IntersectRayOptions                options) const;
+
+    /** Traces \a ray against the world-space flattened tree only */
+    bool intersectFlatTree
+       (const PrecomputedRay&              ray,
+        Hit&                               hit,
+        IntersectRayOptions                options) const;
+
+    /** Slab test against the box from \a low to \a high, which FlatNode and
+        InstanceNode do not store as AABoxes. Returns false if the box is
+        entirely behind the ray or after \a maxTime.
+
+        The inverse direction is clamped to a finite value so that an
+        axis-aligned ray starting on a face of the box computes 0 * large = 0
+        instead of 0 * inf = NaN for that axis. */
+    static inline bool intersectBounds(const PrecomputedRay& ray, const Vector3& low, const Vector3& high, float maxTime) {
+        static const float maxInvDirection = 1e30f;
+        const Vector3& invDirection = ray.invDirection().clamp(-maxInvDirection, maxInvDirection);
+        const Vector3& t0 = (low  - ray.origin()) * invDirection;
+        const Vector3& t1 = (high - ray.origin()) * invDirection;
+        const Vector3& tNear = t0.min(t1);
+        const Vector3& tFar  = t0.max(t1);
+        const float enter = max(max(tNear.x, tNear.y), tNear.z);
+        const float exit  = min(min(tFar.x, tFar.y), tFar.z);
+        return (exit >= max(enter, 0.0f)) && (enter <= maxTime);
+    }
+
+    /** Stores the closest intersection with the triangles of \a block that
+        is between \a minDistance and \a maxDistance, if any, in \a hit.
+        Tests all lanes at once with SSE where available. Reads the Tris and
+        vertices only for the alpha test. */
+    bool rayTriangleIntersection
+       (const PrecomputedRay&              ray,
+        float                              minDistance,
+        float                              maxDistance,
+        const FlatTriBlock&                block,
+        Hit&                               hit,
+        IntersectRayOptions                options) const;
+
+    void freeFlatTree();
+
+    /** Records which Tris an overlap query has tested, because leaves share
+        Tris that straddle their splitting planes */
+    class OverlapScratch {
+    public:
+        /** One bit per Tri, all zero between queries */
+        Array<uint32>    testedBits;
+
+        /** Tris whose bits are set, so that only those are cleared afterwards
+            and small queries stay cheap in large trees */
+        Array<int>       testedTris;
+    };
+
+    /** OverlapScratch not in use by any query. Concurrent queries each take
+        their own, and they are reused across queries until clear(). */
+    mutable Array<shared_ptr<OverlapScratch>> m_overlapScratch;
+    mutable std::mutex   m_overlapScratchMutex;
+
+    /** Appends to \a results each Tri of the flattened tree with nonzero
+        area, in a node whose bounds overlap \a bounds, that passes
+        \a test(v0, v1, v2). Each Tri is tested at most once even though
+        several leaves may reference it. Implemented in NativeTriTree_overlap.cpp. */
+    template<class Test>
+    void intersectFlatVolume(const AABox& bounds, const Test& test, Array<Tri>& results) const;
     
 public:
 
@@ -456,15 +864,123 @@ public:
 
     virtual const String& className() const override { static const String n = "NativeTriTree"; return n; }
 
+    using TriTreeBase::setContents;
+
     virtual void clear() override;
 
+    /** Extracts the triangles of each Entity separately, so that a later call
+        with the same Entitys can refit the tree instead of rebuilding it.
+        \sa Settings::maxRefitsPerRebuild */
+    virtual void setContents
+        (const Array<shared_ptr<Surface>>&  surfaceArray,
+         ImageStorage                       newStorage = ImageStorage::COPY_TO_CPU) override;
+
+    /** Recomputes the bounds of the tree bottom-up, in parallel, after the
+        positions in vertexArray() have been mutated without changing the
+        triangles or their number. Much faster than rebuild(), but rays
+        trace more slowly through the refit tree as the geometry moves
+        further from where it was when the tree was built. Triangles that
+        had zero area at the last rebuild() remain absent from the tree. */
+    void refit();
+
+    /** Settings for subsequent calls to rebuild() */
+    void setSettings(const Settings& settings) {
+        m_settings = settings;
+    }
+
+    const Settings& settings() const {
+        return m_settings;
+    }
+
     /** Walk the entire tree, computing statistics */
     Stats stats(int valuesPerNode) const;
+
+    /** Writes the built tree to \a filename in a relocatable binary format
+        that load() maps into memory without copying the nodes. Stores the
+        flattened tree, the Tris with their materials by name, and the
+        positions, normals, tangents, and first texture coordinates of the
+        CPUVertexArray.
+
+        \param sourceFilenameArray Files from which the contents were created
+        (e.g., the scene and its models). load() rejects the file if any of
+        them is newer than it.
+
+        \param specificationHash Identifies everything else that the contents
+        depend on, e.g., Any::hash() of the scene specification. Settings are
+        included automatically.
+
+        Returns false without writing if the tree has instances or if a Tri's
+        material is missing or has a name shared by another material. */
+    bool save
+       (const String&                      filename,
+        const Array<String>&               sourceFilenameArray,
+        size_t                             specificationHash) const;
+
+    /** Replaces the contents with a tree written by save(), resolving
+        material names in \a materialTable. The flattened tree is used in
+        place from the memory-mapped file, so only the Tris and vertices are
+        copied. Returns false and leaves this unchanged if the file is
+        missing, has another format version, was written with another
+        specificationHash or Settings, is older than one of its source files,
+        or names a material that is not in \a materialTable.
+
+        A loaded tree has no Node tree, so the next setContents() from
+        Surfaces rebuilds rather than refits. */
+    bool load
+       (const String&                      filename,
+        size_t                             specificationHash,
+        const Table<String, shared_ptr<Material>>& materialTable);
+
+    /** Loads \a cacheFilename if it was saved for the same \a scene
+        specification and Settings and the scene file has not changed since.
+        Otherwise sets the contents from \a scene and saves them to
+        \a cacheFilename. The scene is posed either way, to find its materials.
+        Changes to model files that the scene file references are not
+        detected; pass those to save() and load() directly when that matters. */
+    void setContents
+       (const shared_ptr<class Scene>&     scene,
+        const String&                      cacheFilename,
+        ImageStorage                       newStorage = ImageStorage::COPY_TO_CPU);
+
+    /** Number of placements of instanced geometry. Zero unless Settings::instancing is enabled. */
+    int numInstances() const {
+        return m_instanceArray.size();
+    }
+
+    /** Samples the material found by index in the material table, without
+        the dynamic_cast of Tri::sample. Resolves hits on instances by
+        sampling the bottom-level tree and transforming the surfel to world
+        space. */
+    virtual void sample(const Hit& hit, shared_ptr<Surfel>& surfel) const override;
+
+    virtual void intersectRays
+       (const Array<Ray>&                   rays,
+        Array<shared_ptr<Surfel>>&          results,
+        IntersectRayOptions                 options         = IntersectRayOptions(0),
+        const Array<float>&                 coneBuffer      = Array<float>()) const override;
         
+    /** Traverses the flattened tree. Safe to call from multiple threads. */
     virtual void intersectSphere
         (const Sphere&                      sphere,
          Array<Tri>&                        triArray) const override;
 
+    /** Traverses the flattened tree. Safe to call from multiple threads. */
+    virtual void intersectCapsule
+        (const Capsule&                     capsule,
+         Array<Tri>&                        triArray) const override;
+
+    virtual void intersectBoxes
+        (const Array<AABox>&                boxArray,
+         Array<Array<Tri>>&                 results) const override;
+
+    virtual void intersectSpheres
+        (const Array<Sphere>&               sphereArray,
+         Array<Array<Tri>>&                 results) const override;
+
+    virtual void intersectCapsules
+        (const Array<Capsule>&              capsuleArray,
+         Array<Array<Tri>>&                 results) const override;
+
     virtual void rebuild() override;
 
     virtual bool intersectRay
@@ -472,6 +988,7 @@ public:
          Hit&                               hit,
          IntersectRayOptions                options         = IntersectRayOptions(0)) const override;
 
+    /** Traverses the flattened tree. Safe to call from multiple threads. */
     virtual void intersectBox
         (const AABox&                       box,
          Array<Tri>&                        results) const override;
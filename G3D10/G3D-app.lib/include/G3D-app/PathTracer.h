@@ -13,6 +13,7 @@
 #include "G3D-base/ReferenceCount.h"
 #include "G3D-base/Array.h"
 #include "G3D-base/Ray.h"
+#include "G3D-base/Vector2int32.h"
 #include "G3D-app/TriTree.h"
 
 namespace G3D {
@@ -22,6 +23,8 @@ class Light;
 class Surfel;
 class Image;
 class Scene;
+class SurfelArena;
+class Rect2D;
 
 class PathTracer : public ReferenceCountedObject {
 public:
@@ -75,6 +78,42 @@ public:
         );
         LightSamplingMethod samplingMethod = LightSamplingMethod::LOW_DISCREPANCY_SOLID_ANGLE;
 
+        /** Scenes with at most this many directly sampled lights choose the light for each shadow
+            ray by evaluating every light at the surfel, which accounts for the BSDF and the exact
+            biradiance. Scenes with more lights choose with a light tree in O(log n) time per
+            sample. The tree estimates each light's contribution from its power and distance only,
+            so it is noisier for the same number of samples. */
+        int         maxExhaustiveLights = 12;
+
+        /** If true, traceImage() renders progressively. Each pass traces one more ray per
+            pixel, in tile order, at every pixel that has not yet converged, until it has
+            raysPerPixel rays. A pixel converges once it has minRaysPerPixel rays and the
+            standard error of its mean luminance falls below adaptiveSamplingThreshold.
+            Sky and flat regions stop early, and the remaining rays go to noisy pixels.
+
+            Each pixel is box filtered, rather than splatted to its neighbors, so that its
+            variance estimate only contains its own samples.
+
+            Default = false. */
+        bool        adaptiveSampling = false;
+
+        /** Rays that every pixel receives before adaptiveSampling may stop it */
+        int         minRaysPerPixel = 8;
+
+        /** adaptiveSampling stops a pixel when the standard error of its mean luminance
+            is below this fraction of the mean. Dark pixels are compared against a mean of
+            at least 0.05 so that they can converge. */
+        float       adaptiveSamplingThreshold = 0.02f;
+
+        /** Side length in pixels of the square tiles that adaptiveSampling traces together.
+            Rays from one tile are adjacent in the ray buffers, which keeps traversal coherent. */
+        int         adaptiveTileSize = 32;
+
+        /** If true, traceImage() filters its result with an ATrousDenoiser guided by the
+            first-hit albedo, normal, and depth images, which it creates if the caller did
+            not pass them. Default = false. */
+        bool        denoise = false;
+
         Options()
 #       ifdef G3D_DEBUG
             : raysPerPixel(1),
@@ -92,6 +131,10 @@ protected:
         instead of an array of structures s othat the ray and surfel buffers can be directly
         passed to G3D::TriTree routines. */
     class BufferSet {
+    protected:
+        /** Staging arrays for compact(), allocated on first use */
+        shared_ptr<BufferSet>                   m_compactScratch;
+
     public:
         Array<Ray>                              ray;
 
@@ -140,7 +183,7 @@ protected:
             impulseRay.resize(n);
         }
 
-        /** Removes element \a i from all arrays, including either outputIndex or outputCoord. */
+        /** Removes element \a i from all arrays, including outputIndex and outputCoord if they are in use. */
         void fastRemove(int i) {
             ray.fastRemove(i);
             modulation.fastRemove(i);
@@ -152,13 +195,88 @@ protected:
 
             if (outputIndex.size() > 0) {
                 outputIndex.fastRemove(i);
-            } else {
+            }
+            if (outputCoord.size() > 0) {
                 outputCoord.fastRemove(i);
             }
         }
+
+        /** Keeps only the paths for which \a keep is true, preserving their order so that
+            outputIndex and outputCoord stay in raster order. Finds the survivors with a
+            parallel prefix sum over chunks and then gathers every array concurrently.
+
+            Reordering the paths changes which thread traces each of them. The samplers
+            draw from Random::threadCommon(), so the output is not deterministic in either
+            case and the sampling noise in each pixel varies from run to run. */
+        void compact(const Array<bool>& keep);
+    };
+
+    /** \brief Chooses one of many lights with probability roughly proportional to its contribution
+        at a point.
+
+        A binary tree over the positions of the local lights, where each node stores the total
+        bulb power and the bounding sphere of its lights. Sampling descends from the root,
+        choosing each child with probability proportional to its power divided by its squared
+        distance. DIRECTIONAL lights have no position, so they are kept in a separate list and
+        compete with the root by their biradiance. */
+    class LightTree {
+    protected:
+
+        class Node {
+        public:
+            Point3      center;
+
+            /** Squared radius of the bounding sphere of the lights, including the extent of area lights */
+            float       radiusSquared;
+
+            /** Sum of the lights' bulbPower() */
+            float       power;
+
+            /** Index of the first of two adjacent children, or -1 for a leaf */
+            int         firstChild;
+
+            /** Index into the light array, for a leaf */
+            int         lightIndex;
+        };
+
+        /** Root first */
+        Array<Node>     m_node;
+
+        /** Indices of the DIRECTIONAL lights */
+        Array<int>      m_directional;
+
+        /** Builds the subtree for lightIndex[begin..end) into m_node[n] */
+        void build(const Array<shared_ptr<Light>>& lightArray, Array<int>& lightIndex, int begin, int end, int n);
+
+        /** Estimated biradiance from the lights under \a node at \a X */
+        float importance(const Node& node, const Point3& X) const;
+
+    public:
+
+        void clear() {
+            m_node.fastClear();
+            m_directional.fastClear();
+        }
+
+        bool empty() const {
+            return (m_node.size() == 0) && (m_directional.size() == 0);
+        }
+
+        void build(const Array<shared_ptr<Light>>& lightArray);
+
+        /** Returns the index in \a lightArray of the chosen light and the probability with
+            which it was chosen. \a lightArray must be the array that the tree was built from.
+            \param u Uniform random number on [0, 1) */
+        int sample(const Array<shared_ptr<Light>>& lightArray, const Point3& X, float u, float& probability) const;
     };
 
     mutable shared_ptr<TriTree>                 m_triTree;
+
+    /** Built by prepare() when there are more than Options::maxExhaustiveLights direct lights */
+    mutable LightTree                           m_lightTree;
+
+    /** Storage for BufferSet::surfel, reused at every bounce so that hits do not allocate */
+    shared_ptr<SurfelArena>                     m_surfelArena;
     
     /** For the active trace */
     mutable Options                             m_options;
@@ -187,6 +305,41 @@ protected:
     */
     Point3 sampleOneLight(const shared_ptr<Light>& light, const Point3& X, const Vector3& n, int pixelIndex, int lightIndex, int sampleIndex, int numSamples, float& areaTimesPDFValue) const;
 
+    /** The eye ray through \a P, in pixel coordinates, for ray \a rayIndex of \a raysPerPixel at \a pixel.
+        Samples the lens if \a depthOfField. */
+    Ray eyeRay
+       (const shared_ptr<Camera>&               camera,
+        const Rect2D&                           viewport,
+        const Point2int32&                      pixel,
+        const Point2&                           P,
+        bool                                    depthOfField,
+        int                                     rayIndex,
+        int                                     raysPerPixel) const;
+
+    /** Writes the first-hit feature images for traceImage() from rays through the pixel centers.
+        Any of the images may be nullptr. At pixels where the ray misses, albedo is one, the
+        normal is zero, and depth is infinite.
+
+        With physical depth of field, each pixel averages several lens samples so that the
+        features are as blurred as the radiance: albedo over all samples, the normal and depth
+        over the samples that hit. */
+    void traceFeatureImages
+       (const shared_ptr<Camera>&               camera,
+        const shared_ptr<Image>&                albedoImage,
+        const shared_ptr<Image>&                normalImage,
+        const shared_ptr<Image>&                depthImage) const;
+
+    /** Running statistics of one pixel for traceImageAdaptive(). Defined in PathTracer.cpp. */
+    class PixelEstimate;
+
+    /** Implements traceImage() for Options::adaptiveSampling */
+    void traceImageAdaptive
+       (const shared_ptr<Image>&                radianceImage,
+        const shared_ptr<Camera>&               camera,
+        const Array<shared_ptr<Light>>&         directLightArray,
+        const Array<shared_ptr<Light>>&         indirectLightArray,
+        const std::function<void(const String&, float)>& statusCallback) const;
+
     /** Produces a buffer of eye rays, stored in raster order in the preallocated rayBuffer. 
         \param castThroughCenter When true (for the first ray at each pixel), cast the ray through
                the pixel center to make images look less noisy.
@@ -330,8 +483,23 @@ public:
         if the scene has changed. 
 
         \param statusCallback Function called periodically to update the GUI with the rendering progress. Arguments are percentage (between 0 and 1) and an arbitrary message string.
+        With Options::adaptiveSampling, it is called after every pass and \a radianceImage then holds the current estimate.
+
+        \param albedoImage If not null, receives Surfel::reflectivity() at the first hit through each pixel center
+        (one where the ray missed). Must have the same dimensions as \a radianceImage.
+        \param normalImage If not null, receives the world-space shading normal at the first hit (zero where the ray missed).
+        \param depthImage If not null, receives the camera-space depth of the first hit in the R channel (infinite where the ray missed).
+
+        These are the feature images that ATrousDenoiser uses.
       */
-    void traceImage(const shared_ptr<Image>& radianceImage, const shared_ptr<Camera>& camera, const Options& options, const std::function<void(const String&, float)>& statusCallback = nullptr) const;
+    void traceImage
+       (const shared_ptr<Image>&                radianceImage,
+        const shared_ptr<Camera>&               camera,
+        const Options&                          options,
+        const std::function<void(const String&, float)>& statusCallback = nullptr,
+        const shared_ptr<Image>&                albedoImage = nullptr,
+        const shared_ptr<Image>&                normalImage = nullptr,
+        const shared_ptr<Image>&                depthImage = nullptr) const;
 
     /** 
      \param output Must be allocated to at least the size of rayBuffer. This may be uncached, memory mapped memory.
@@ -0,0 +1,118 @@
+/**
+  \file G3D-app.lib/include/G3D-app/PostProcessChain.h
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#ifndef GLG3D_PostProcessChain_h
+#define GLG3D_PostProcessChain_h
+
+#include "G3D-base/platform.h"
+#include "G3D-base/ReferenceCount.h"
+#include "G3D-base/Array.h"
+#include "G3D-base/Vector2int16.h"
+
+namespace G3D {
+
+class Camera;
+class DepthOfField;
+class Framebuffer;
+class MotionBlur;
+class RenderDevice;
+class Texture;
+class UniversalBlur;
+
+/**
+  \brief Applies a sequence of HDR post-processing effects without copying between them.
+
+  Applied individually in place, DepthOfField, MotionBlur, and UniversalBlur each copy their
+  input to a temporary texture, because it is also their draw target, and strip the trim band
+  while doing so. The chain instead renders every effect but the last into one of two
+  internal textures with the size and encoding of the input, alternating between them, and
+  feeds that texture to the next effect. The last effect renders into the caller's
+  framebuffer. The trim band is passed to the effects as an offset rather than stripped, so
+  when two or more effects run, none of them copies its input.
+
+  The caller's framebuffer keeps its own COLOR0 texture, which holds the result on return.
+
+  Effects that are disabled by the camera's settings are skipped.
+
+  \sa GApp::onPostProcessHDR3DEffects
+*/
+class PostProcessChain : public ReferenceCountedObject {
+public:
+
+    enum Effect {
+        DEPTH_OF_FIELD,
+        MOTION_BLUR,
+        UNIVERSAL_BLUR
+    };
+
+protected:
+
+    /** In order of application */
+    Array<Effect>                   m_effects;
+
+    shared_ptr<DepthOfField>        m_depthOfField;
+    shared_ptr<MotionBlur>          m_motionBlur;
+    shared_ptr<UniversalBlur>       m_universalBlur;
+
+    /** Draw target of every effect but the last. COLOR0 is rebound to one of m_temp before each. */
+    shared_ptr<Framebuffer>         m_target;
+
+    /** Intermediate results, alternately written and read by consecutive effects */
+    shared_ptr<Texture>             m_temp[2];
+
+    PostProcessChain
+       (const Array<Effect>&               effects,
+        const shared_ptr<DepthOfField>&    depthOfField,
+        const shared_ptr<MotionBlur>&      motionBlur,
+        const shared_ptr<UniversalBlur>&   universalBlur);
+
+    /** Returns m_temp[i], reallocated or resized as needed to match the size and encoding of \a color */
+    const shared_ptr<Texture>& temp(int i, const shared_ptr<Texture>& color);
+
+public:
+
+    /**
+      \param effects In order of application. The default order matches GApp::onPostProcessHDR3DEffects.
+
+      \param depthOfField, motionBlur, universalBlur Instances to apply. If nullptr, the chain creates its own.
+      Pass the application's instances to share their debug settings.
+    */
+    static shared_ptr<PostProcessChain> create
+       (const Array<Effect>&               effects       = Array<Effect>(DEPTH_OF_FIELD, MOTION_BLUR, UNIVERSAL_BLUR),
+        const shared_ptr<DepthOfField>&    depthOfField  = nullptr,
+        const shared_ptr<MotionBlur>&      motionBlur    = nullptr,
+        const shared_ptr<UniversalBlur>&   universalBlur = nullptr);
+
+    const Array<Effect>& effects() const {
+        return m_effects;
+    }
+
+    void setEffects(const Array<Effect>& effects) {
+        m_effects = effects;
+    }
+
+    /**
+      Applies the enabled effects in order to the COLOR0 texture of \a framebuffer and writes the
+      result back to it. Performs no copies unless exactly one effect is enabled, in which case
+      that effect copies its input as when it is applied alone.
+
+      \param trimBandThickness Thickness of the band around the color buffer that the
+      effects neither read nor write, as for DepthOfField::apply.
+    */
+    void apply
+       (RenderDevice*                      rd,
+        const shared_ptr<Framebuffer>&     framebuffer,
+        const shared_ptr<Texture>&         depth,
+        const shared_ptr<Texture>&         velocity,
+        const shared_ptr<Camera>&          camera,
+        Vector2int16                       trimBandThickness);
+};
+
+} // namespace G3D
+
+#endif // GLG3D_PostProcessChain_h
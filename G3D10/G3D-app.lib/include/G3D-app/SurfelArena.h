@@ -0,0 +1,80 @@
+/**
+  \file G3D-app.lib/include/G3D-app/SurfelArena.h
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#pragma once
+
+#include "G3D-base/platform.h"
+#include "G3D-base/ReferenceCount.h"
+#include "G3D-base/Array.h"
+#include "G3D-app/UniversalSurfel.h"
+
+namespace G3D {
+
+/**
+  \brief Preallocated storage for the surfels of one batch of rays.
+
+  TriTree::intersectRays() with a SurfelArena samples the hit for ray \a i into
+  slot \a i of the arena instead of heap-allocating a new Surfel for it. The
+  slots are allocated in blocks that persist across calls, so a path tracer
+  that traces the same number of rays at every bounce allocates no surfels
+  after the first.
+
+  The shared_ptrs that the arena hands out share ownership of their block, so
+  the memory stays valid after the arena is cleared or destroyed. The
+  <i>contents</i> do not: the next batch that uses the arena overwrites every
+  slot that it hits. Copy any surfel that must outlive the batch.
+
+  Slots hold UniversalSurfels. A Material that produces a different Surfel
+  subclass replaces the slot's pointer with its own allocation, as it would
+  for any reused surfel.
+
+  \sa TriTree::intersectRays, PathTracer
+*/
+class SurfelArena : public ReferenceCountedObject {
+public:
+
+    /** Number of surfels allocated together */
+    enum { BLOCK_SIZE = 1024 };
+
+protected:
+
+    Array<shared_ptr<UniversalSurfel>>  m_block;
+
+    SurfelArena() {}
+
+public:
+
+    static shared_ptr<SurfelArena> create();
+
+    /** Allocates blocks until there are at least \a n slots. Not threadsafe. */
+    void reserve(int n);
+
+    /** Number of slots currently allocated */
+    int capacity() const {
+        return m_block.size() * BLOCK_SIZE;
+    }
+
+    /** Points \a surfel at slot \a i. Does nothing if it already points there, to avoid
+        touching the reference count. Threadsafe for distinct \a i once reserve() has
+        been called for the whole batch. */
+    void assign(int i, shared_ptr<Surfel>& surfel) const {
+        debugAssert(i >= 0 && i < capacity());
+        const shared_ptr<UniversalSurfel>& block = m_block[i / BLOCK_SIZE];
+        UniversalSurfel* slot = block.get() + (i % BLOCK_SIZE);
+        if (surfel.get() != slot) {
+            surfel = shared_ptr<Surfel>(block, slot);
+        }
+    }
+
+    /** Releases the arena's references to its blocks */
+    void clear() {
+        m_block.clear();
+    }
+};
+
+} // namespace G3D
@@ -23,7 +23,9 @@ class Surface;
 class Surfel;
 class Material;
 class AABox;
+class Capsule;
 class GBuffer;
+class SurfelArena;
 
 
 /** Interface for ray-casting data structures.
@@ -62,6 +64,12 @@ public:
     /** Make optimizations appropriate for coherent rays (same origin) */
     static const IntersectRayOptions COHERENT_RAY_HINT = 16;
 
+    /** Sort incoherent rays (e.g., after the first bounce of a path tracer) by
+        origin and direction before tracing them, so that each thread works on
+        a smaller part of the tree. Results are still returned in the original
+        ray order. Implementations may ignore this; measure before enabling. */
+    static const IntersectRayOptions REORDER_RAYS_HINT = 32;
+
     class Hit {
     public:
         enum { NONE = -1 };
@@ -74,7 +82,14 @@ public:
         /** For occlusion ray casts, this will always be false. */
         bool        backface;
 
-        Hit() : triIndex(NONE), u(0), v(0), distance(0), backface(false) {}
+        /** Index of the instance that was hit, for trees that store repeated
+            geometry once and place it with instance transforms (see
+            NativeTriTree::Settings::instancing). triIndex then refers to the
+            triangles of that instance's geometry rather than to triArray().
+            NONE for all other hits. Pass the Hit to sample() to resolve it. */
+        int         instance;
+
+        Hit() : triIndex(NONE), u(0), v(0), distance(0), backface(false), instance(NONE) {}
     };
     
     virtual const String& className() const = 0;
@@ -273,22 +288,54 @@ public:
          Array<bool>&                       results,
          IntersectRayOptions                options         = IntersectRayOptions(0)) const = 0;
 
-    /** Returns all triangles that lie within the box. Default implementation
-        tests each triangle in turn (linear time). */
+    /** Returns all triangles that lie within the box. */
     virtual void intersectBox
         (const AABox&                       box,
          Array<Tri>&                        results) const = 0;
 
     /** Returns all triangles that intersect or are contained within
-        the sphere (technically, this is a ball intersection).
-
-        Default implementation calls intersectBox and then filters the results for the sphere.
-     */
+        the sphere (technically, this is a ball intersection). */
     virtual void intersectSphere
         (const Sphere&                      sphere,
          Array<Tri>&                        triArray) const = 0;
 
-    void sample(const Hit& hit, shared_ptr<Surfel>& surfel) const;
+    /** Returns all triangles that intersect or are contained within
+        the capsule. */
+    virtual void intersectCapsule
+        (const Capsule&                     capsule,
+         Array<Tri>&                        triArray) const = 0;
+
+    /** Many intersectBox() queries at once.  results[i] receives the
+        triangles for  boxArray[i]. The queries run concurrently, so this is
+        much faster than issuing them one at a time from a single thread. */
+    virtual void intersectBoxes
+        (const Array<AABox>&                boxArray,
+         Array<Array<Tri>>&                 results) const = 0;
+
+    /** Many intersectSphere() queries at once. \see intersectBoxes() */
+    virtual void intersectSpheres
+        (const Array<Sphere>&               sphereArray,
+         Array<Array<Tri>>&                 results) const = 0;
+
+    /** Many intersectCapsule() queries at once. \see intersectBoxes() */
+    virtual void intersectCapsules
+        (const Array<Capsule>&              capsuleArray,
+         Array<Array<Tri>>&                 results) const = 0;
+
+    /** Returns the world-space surfel at \a hit, or nullptr if it missed. Respects
+        Tri::twoSided(), so a single-sided Tri hit from behind keeps its front-facing normal. */
+    virtual void sample(const Hit& hit, shared_ptr<Surfel>& surfel) const;
+
+    /** Like the Surfel intersectRays() overload, but samples the hit for rays[i] into slot i of
+        \a arena instead of allocating a new Surfel per hit. results[i] is nullptr on a miss.
+        The returned surfels are overwritten by the next call with the same arena.
+
+        Implemented with the Hit overload and sample(). */
+    void intersectRays
+        (const Array<Ray>&                  rays,
+         SurfelArena&                       arena,
+         Array<shared_ptr<Surfel>>&         results,
+         IntersectRayOptions                options         = IntersectRayOptions(0)) const;
 
     /** Create an instance of whatever is the fastest implementation subclass for this machine.
         \param preferGPUData If true, use an implementation that is fast for ray buffers already on the GPU. */
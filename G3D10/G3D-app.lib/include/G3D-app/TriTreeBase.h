@@ -25,6 +25,7 @@ class Surface;
 class Surfel;
 class Material;
 class AABox;
+class Capsule;
 class GBuffer;
 
 /** Common partial implementation base class for ray-casting data structures. */
@@ -42,6 +43,13 @@ protected:
        (const shared_ptr<GLPixelTransferBuffer>& rayCoherence,
         Array<float>&                            rayCoherenceBuffer);
 
+    /** True if the solid \a capsule and the triangle \a v0 \a v1 \a v2 share any point */
+    static bool capsuleIntersectsTriangle
+       (const Capsule&                           capsule,
+        const Point3&                            v0,
+        const Point3&                            v1,
+        const Point3&                            v2);
+
 public:
     
     virtual ~TriTreeBase();
@@ -108,13 +116,33 @@ public:
          Array<bool>&                             results,
          IntersectRayOptions                      options         = IntersectRayOptions(0)) const override;
 
+    /** Tests each triangle in turn (linear time), in parallel */
     virtual void intersectBox
         (const AABox&                             box,
          Array<Tri>&                              results) const override;
 
+    /** Tests each triangle in turn (linear time), in parallel */
     virtual void intersectSphere
         (const Sphere&                            sphere,
          Array<Tri>&                              triArray) const override;
+
+    /** Tests each triangle in turn (linear time), in parallel */
+    virtual void intersectCapsule
+        (const Capsule&                           capsule,
+         Array<Tri>&                              triArray) const override;
+
+    /** Runs the queries in parallel, each testing every triangle */
+    virtual void intersectBoxes
+        (const Array<AABox>&                      boxArray,
+         Array<Array<Tri>>&                       results) const override;
+
+    virtual void intersectSpheres
+        (const Array<Sphere>&                     sphereArray,
+         Array<Array<Tri>>&                       results) const override;
+
+    virtual void intersectCapsules
+        (const Array<Capsule>&                    capsuleArray,
+         Array<Array<Tri>>&                       results) const override;
 };
 
 } // G3D
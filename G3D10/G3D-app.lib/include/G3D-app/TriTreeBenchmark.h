@@ -0,0 +1,134 @@
+/**
+  \file G3D-app.lib/include/G3D-app/TriTreeBenchmark.h
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#ifndef GLG3D_TriTreeBenchmark_h
+#define GLG3D_TriTreeBenchmark_h
+
+#include "G3D-base/platform.h"
+#include "G3D-base/ReferenceCount.h"
+#include "G3D-base/Array.h"
+#include "G3D-base/Ray.h"
+#include "G3D-base/Vector2int32.h"
+#include "G3D-base/G3DString.h"
+#include "G3D-app/TriTree.h"
+
+namespace G3D {
+
+class Scene;
+class TextOutput;
+
+/**
+  \brief Times the TriTree implementations against each other on the same scenes and rays.
+
+  For every scene in the Settings, loads the scene and, for every implementation that is
+  available on this machine, times setContents() and rebuild(). It then generates four
+  fixed ray batches from a seeded Random and times each CPU intersectRays() overload
+  (Hit, bool, and Surfel) and a loop of intersectRay() calls on them:
+
+  - primary: one ray per pixel through the center of each pixel of the scene's default camera
+  - shadow: occlusion rays from the primary hits toward a point above the scene
+  - diffuse: cosine-distributed bounce rays from the primary hits
+  - random: rays between uniformly distributed points in the scene bounds
+
+  The shadow and diffuse rays leave the primary hits, which are found with a default
+  NativeTriTree. So that a change to NativeTriTree cannot change the rays that it is
+  timed on, the batches are saved next to the JSON file the first time that a scene is
+  run with given Settings and loaded on later runs, including runs of other builds.
+  Every implementation, in every build, therefore traces identical rays. Delete the
+  .rays files after editing a scene. Rays that miss the scene leave no shadow or
+  diffuse ray, so those batches may be smaller than the primary batch.
+
+  The results, including Mrays/s for every query and NativeTriTree::Stats for the native
+  tree, are written to a JSON file so that they can be tracked per commit.
+
+  Scene::load() creates textures, so an OpenGL context must exist before run() is called.
+
+  \sa UniversalBlurBenchmark, NativeTriTree::stats()
+*/
+class TriTreeBenchmark : public ReferenceCountedObject {
+public:
+
+    class Settings {
+    public:
+        /** Scene names or filenames, as passed to Scene::load() */
+        Array<String>           sceneNames;
+
+        /** className() of each implementation to time. Implementations that
+            are not available on this machine are reported as skipped. */
+        Array<String>           implementations;
+
+        /** Dimensions of the primary ray batch */
+        Vector2int32            resolution;
+
+        /** Number of rays in the random batch */
+        int                     numRandomRays;
+
+        /** Seed for the Random that generates the shadow, diffuse, and random batches */
+        uint32                  seed;
+
+        /** Untimed runs of each query, to exclude lazy allocation and GPU upload */
+        int                     warmupRuns;
+
+        /** Runs averaged for each query and for rebuild() */
+        int                     timedRuns;
+
+        /** Copied to the output to identify the build, for example a commit hash */
+        String                  label;
+
+        /** If true, the ray batches are saved on first use and loaded afterward.
+            If false, they are regenerated with the current NativeTriTree on every run. */
+        bool                    cacheRays;
+
+        Settings();
+    };
+
+protected:
+
+    class RayBatch {
+    public:
+        String                  name;
+        Array<Ray>              rays;
+        TriTree::IntersectRayOptions options;
+    };
+
+    TriTreeBenchmark() {}
+
+    /** Returns nullptr if \a className is not available on this machine */
+    static shared_ptr<TriTree> createTree(const String& className);
+
+    /** Generates the four batches, using \a tree (already populated) to find the primary hits */
+    void makeRayBatches(const shared_ptr<Scene>& scene, const shared_ptr<TriTree>& tree, const Settings& settings, Array<RayBatch>& batches) const;
+
+    /** Filename under which run() caches the batches of \a sceneName, in the directory of \a jsonFilename */
+    static String rayCacheFilename(const String& sceneName, const Settings& settings, const String& jsonFilename);
+
+    /** Returns false if \a filename does not exist or was made from a scene with a different number of triangles */
+    bool loadRayBatches(const String& filename, int numTris, Array<RayBatch>& batches) const;
+
+    void saveRayBatches(const String& filename, int numTris, const Array<RayBatch>& batches) const;
+
+    /** Writes the fields of \a tree's NativeTriTree::Stats, or nothing for other implementations */
+    void writeStats(const shared_ptr<TriTree>& tree, TextOutput& json) const;
+
+    /** Times every query on \a batch and writes one JSON object */
+    void runBatch(const shared_ptr<TriTree>& tree, const RayBatch& batch, const Settings& settings, TextOutput& json) const;
+
+    /** Times one implementation on \a scene and writes one JSON object */
+    void runImplementation(const shared_ptr<Scene>& scene, const String& className, const Array<RayBatch>& batches, const Settings& settings, TextOutput& json) const;
+
+public:
+
+    static shared_ptr<TriTreeBenchmark> create();
+
+    /** Runs every implementation on every scene and writes the results to \a jsonFilename. */
+    void run(const Settings& settings, const String& jsonFilename);
+};
+
+} // namespace G3D
+
+#endif // GLG3D_TriTreeBenchmark_h
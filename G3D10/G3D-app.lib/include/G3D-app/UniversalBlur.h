@@ -10,8 +10,10 @@
 // Bullshit imports because of direct definition because of linker error when defining in the .cpp
 #include "G3D-gfx/Profiler.h"
 #include "G3D-gfx/Texture.h"
+#include "G3D-gfx/glheaders.h"
 #include "G3D-gfx/RenderDevice.h"
 #include "G3D-gfx/Shader.h"
+#include "G3D-gfx/AttributeArray.h"
 #include "G3D-app/Camera.h"
 #include "G3D-app/Draw.h"
 #include "G3D-app/SlowMesh.h"
@@ -19,6 +21,7 @@
 namespace G3D {
 
     class Texture;
+    class GLPixelTransferBuffer;
     class RenderDevice;
     class Shader;
     class MotionBlurSettings;
@@ -44,22 +47,88 @@ namespace G3D {
     protected:
         UniversalBlur::UniversalBlur();/* : m_debugShowTiles(false) {}*/
 
-        /** The source color is copied into this if needed. Saved between invocations to avoid reallocating the texture.*/
+        /** The source color is copied into this if it is also the draw target. Saved between invocations to avoid reallocating the texture.*/
         shared_ptr<Texture>         m_cachedSrc;
 
         bool                        m_debugShowTiles;
 
-        /** Size ceil(w / maxBlurRadius) x ceil(h / maxBlurRadius). RG = max velocity in tile, B = min speed in tile */
+        /** If true, universalGatherBlur() specializes the gather per tile class. \sa setTileClassification */
+        bool                        m_tileClassification;
+
+        /** If true and supported, computeTileMinMaxWithComputeShader() replaces computeTileMinMax().
+            \sa setComputeShaderTileMinMax */
+        bool                        m_computeShaderTileMinMax;
+
+        /** If true and supported, universalGatherBlur() runs UniversalBlur_universalGather.glc at
+            full resolution. \sa setComputeShaderGather */
+        bool                        m_computeShaderGather;
+
+        /** Gather samples per pixel over both passes in the last apply(), or -1 if unknown.
+            \sa averageSamplesPerPixel */
+        float                       m_averageSamplesPerPixel;
+
+        /** Unit quad instanced once per tile by drawClassifiedTiles() */
+        AttributeArray              m_tileQuadVertices;
+        IndexStream                 m_tileQuadIndices;
+
+        /** Size ceil(w / maxBlurRadius) x ceil(h / maxBlurRadius). RG = max velocity in tile, B = min speed in tile,
+            A = max absolute normalized circle of confusion in tile */
         shared_ptr<Framebuffer>     m_tileMinMaxFramebuffer;
 
-        /** Size h x ceil(w / maxBlurRadius). RG = max velocity in tile, B = min speed in tile */
+        /** Size h x ceil(w / maxBlurRadius). RG = max velocity in tile, B = min speed in tile.
+            Only allocated when the raster passes run. */
         shared_ptr<Framebuffer>     m_tileMinMaxTempFramebuffer;
 
         /** Size ceil(w / maxBlurRadius) x ceil(h / maxBlurRadius).
-            RG = max velocity in neighborhood, B = min speed in neighborhood */
+            RG = max velocity in neighborhood, B = min speed in neighborhood,
+            A = max absolute normalized circle of confusion that can reach the tile */
         shared_ptr<Framebuffer>     m_neighborMinMaxFramebuffer;
 
         shared_ptr<Framebuffer>     m_speedDirectionPassColorBuffer;
+
+        /** Size ceil(w / f) x ceil(h / f) for UniversalBlurSettings::reducedResolutionFactor() f > 1.
+            Allocated on first use. The gather input, its speed direction pass, and its result. */
+        shared_ptr<Framebuffer>     m_reducedColorFramebuffer;
+        shared_ptr<Framebuffer>     m_reducedSpeedDirectionFramebuffer;
+        shared_ptr<Framebuffer>     m_reducedResultFramebuffer;
+
+        /** Ping-ponged temporal accumulation history, allocated on first use. COLOR0 is the
+            accumulated color and COLOR1 is (depth, packed CoC). m_historyIndex is the most recent. */
+        shared_ptr<Framebuffer>     m_historyFramebuffer[2];
+        int                         m_historyIndex;
+
+        /** False until m_historyFramebuffer[m_historyIndex] holds a result of the current size */
+        bool                        m_historyValid;
+
+        /** Counts temporally accumulated frames to vary the sample positions */
+        int                         m_temporalFrameIndex;
+
+        /** Exponential moving average of the GPU time of apply(), in seconds, at the current
+            quality tier, or -1 if not yet measured. \sa updateQualityTier */
+        float                       m_smoothedBlurTime;
+
+        /** Frames since the quality tier last changed */
+        int                         m_framesAtQualityTier;
+
+        /** Smoothed GPU time, in seconds, at which each quality tier was last abandoned for
+            exceeding the frame budget, or -1. \sa updateQualityTier */
+        Array<float>                m_rejectedTierTime;
+
+        /** Frames at a tier before retrying a better tier in m_rejectedTierTime. Doubles after
+            each upgrade that exceeds the budget. */
+        int                         m_upgradeBackoffFrames;
+
+        /** True if the current quality tier was entered from a cheaper one */
+        bool                        m_enteredQualityTierByUpgrade;
+
+        /** 1x1 R32F result of UniversalBlur_samplesPerPixel.glc, allocated on first use */
+        shared_ptr<Texture>         m_samplesPerPixelTexture;
+
+        /** Asynchronous copy of m_samplesPerPixelTexture that a later apply() reads */
+        shared_ptr<GLPixelTransferBuffer> m_samplesPerPixelReadback;
+
+        /** Signaled when m_samplesPerPixelReadback holds its value, or nullptr if no copy is pending */
+        GLsync                      m_samplesPerPixelFence;
         //shared_ptr<Framebuffer>     m_colorBuffer;
         //shared_ptr<Texture>         m_farColorBuffer;
         //shared_ptr<Texture>         m_nearColorBuffer;
@@ -75,10 +144,20 @@ namespace G3D {
             int                               maxBlurRadiusPixels,
             const Vector2int16                trimBandThickness);
 
-        /** Compute m_neighborMax from m_tileMax */
+        /** Compute m_tileMinMaxFramebuffer in a single compute dispatch, without
+            m_tileMinMaxTempFramebuffer. Each work group reduces one tile. */
+        void computeTileMinMaxWithComputeShader
+        (RenderDevice* rd,
+            const shared_ptr<Texture>& velocity,
+            int                        maxBlurRadiusPixels,
+            Vector2int16               trimBandThickness);
+
+        /** Compute m_neighborMax from m_tileMax. The circle of confusion maximum is dilated
+            over \a maxCoCTileRadius tiles, which may be more than the one tile of the velocity. */
         void computeNeighborMinMax
         (RenderDevice* rd,
-            const shared_ptr<Texture>& tileMax);
+            const shared_ptr<Texture>& tileMax,
+            int                        maxCoCTileRadius);
 
         /** Called from apply() to compute the blurry image to the current
             frame buffer by gathering. */
@@ -95,7 +174,36 @@ namespace G3D {
             int                               maxBlurRadiusPixels,
             float                             exposureTimeFraction,
             float                             maxCoCRadiusPixels,
-            Vector2int16                      trimBandThickness);
+            Vector2int16                      trimBandThickness,
+            int                               reducedResolutionFactor = 1,
+            Vector2int16                      colorBufferOffset = Vector2int16(0, 0));
+
+        /** Writes m_reducedColorFramebuffer from \a color, whose trimmed image starts at \a colorBufferOffset */
+        void downsample(RenderDevice* rd, const shared_ptr<Texture>& color, int reducedResolutionFactor, Vector2int16 colorBufferOffset = Vector2int16(0, 0));
+
+        /** Composites m_reducedResultFramebuffer onto the current framebuffer with a joint-bilateral
+            upsample guided by depth and velocity, restoring the full-resolution detail of \a color
+            at pixels that are neither moving nor out of focus. The trimmed image of \a color
+            starts at \a colorBufferOffset. */
+        void upsample
+        (RenderDevice* rd,
+            const shared_ptr<Texture>& color,
+            const shared_ptr<Texture>& depth,
+            const shared_ptr<Texture>& velocity,
+            const shared_ptr<Camera>& camera,
+            float                      maxCoCRadiusPixels,
+            float                      exposureTimeFraction,
+            Vector2int16               trimBandThickness,
+            int                        reducedResolutionFactor,
+            Vector2int16               colorBufferOffset = Vector2int16(0, 0));
+
+        /** Called from universalGatherBlur() when m_tileClassification is set. Draws one quad per
+            tile with a gather shader specialized for each TileClass. Sharp tiles are copied. */
+        void drawClassifiedTiles
+        (RenderDevice* rd,
+            Args& args,
+            const shared_ptr<Camera>& camera,
+            const shared_ptr<Texture>& neighborMax);
 
         /** Called from apply() to compute the blurry image to the current
             frame buffer by gathering. */
@@ -110,14 +218,49 @@ namespace G3D {
             float                             exposureTimeFraction,
             Vector2int16                      trimBandThickness);
         
-        /** Allocates tileMax and neighborMax as needed */
+        /** Allocates tileMax, neighborMax, and the reduced-resolution buffers as needed */
         void updateBuffers
         (const shared_ptr<Texture>& velocityTexture,
             int                              maxBlurRadiusPixels,
-            Vector2int16                     inputGuardBandThickness);
+            Vector2int16                     inputGuardBandThickness,
+            int                              reducedResolutionFactor = 1,
+            bool                             needTempBuffer = true);
 
         void makeRandomBuffer();
 
+        /** Under UniversalBlurSettings::automaticQuality(), reads the GPU time of the previous
+            frame's apply() from the Profiler and moves \a settings to a cheaper or better quality
+            tier. Does not upgrade into a tier that was measured over budget until a backoff that
+            doubles with each failed upgrade has elapsed. Called at the start of apply(). */
+        void updateQualityTier(UniversalBlurSettings& settings);
+
+        /** Blends the current framebuffer with m_historyFramebuffer and writes the result to both.
+            Called from apply() when UniversalBlurSettings::temporalAccumulation() is true.
+            Does nothing if the framebuffer has no color texture, e.g., when drawing to the window. */
+        void temporalAccumulate
+        (RenderDevice* rd,
+            const shared_ptr<Texture>& depth,
+            const shared_ptr<Texture>& velocity,
+            const shared_ptr<Camera>& camera,
+            int                        maxBlurRadiusPixels,
+            float                      maxCoCRadiusPixels,
+            float                      exposureTimeFraction,
+            Vector2int16               trimBandThickness);
+
+        /** Reduces m_neighborMinMaxFramebuffer to the average sample count on the GPU and starts an
+            asynchronous readback. Writes m_averageSamplesPerPixel from an earlier readback once the
+            GPU has completed it, without waiting. Called from apply(), outside of its profiled events,
+            while the Profiler is enabled. */
+        void computeAverageSamplesPerPixel
+        (const shared_ptr<Camera>& camera,
+            int                        numSamplesOdd,
+            int                        maxBlurRadiusPixels,
+            float                      maxCoCRadiusPixels,
+            float                      exposureTimeFraction,
+            Vector2int16               trimmedSize);
+
+        void releaseSamplesPerPixelFence();
+
         /** Debug visualization of the motion blur tiles and directions. Called from apply() */
         void debugDrawTiles
         (RenderDevice* rd,
@@ -142,9 +285,21 @@ namespace G3D {
             SHOW_SIGNED_COC,
         };
 
+        /** Classification of a maxBlurRadius x maxBlurRadius tile by the blurs that can reach it.
+            Bit 0 is motion blur and bit 1 is depth of field; a blur counts if its radius is at
+            least half a pixel. */
+        enum TileClass {
+            SHARP_TILE          = 0,
+            MOTION_BLUR_TILE    = 1,
+            DEPTH_OF_FIELD_TILE = 2,
+            COMBINED_TILE       = 3
+        };
+
         //UniversalBlur();
 
         static shared_ptr<UniversalBlur> create(const String& debugName = "G3D::UniversalBlur");
+
+        virtual ~UniversalBlur();
         
         //static shared_ptr<UniversalBlur> create();
         /*
@@ -180,6 +335,60 @@ namespace G3D {
             return m_debugShowTiles;
         }
 
+        /** When enabled (the default), tiles that no blur reaches are copied and tiles reached
+            by only one of motion blur and depth of field run a gather compiled without the
+            other. Disable to run the full gather on every pixel, e.g., for comparisons. */
+        void setTileClassification(bool b) {
+            m_tileClassification = b;
+        }
+
+        bool tileClassification() const {
+            return m_tileClassification;
+        }
+
+        /** When enabled (the default) and compute shaders are available, the tile min/max buffer is
+            computed in one dispatch, with one work group reducing each tile, instead of two raster
+            passes through a transposed buffer. The neighborhood pass then runs on the result. */
+        void setComputeShaderTileMinMax(bool b) {
+            m_computeShaderTileMinMax = b;
+        }
+
+        bool computeShaderTileMinMax() const {
+            return m_computeShaderTileMinMax;
+        }
+
+        /** When enabled (the default) and compute shaders are available, full-resolution gathers
+            load the color, depth, velocity, and circle of confusion of each 16x16 block of pixels,
+            padded by the maximum circle of confusion radius, into shared memory once and gather
+            from there instead of from textures. Takes precedence over tile classification, which
+            it replaces with a per-block test. Falls back to the raster gather at reduced
+            resolution, when the padded block does not fit in shared memory (e.g., radii above
+            16 pixels with 48 KB), and for output formats that cannot be written as images. */
+        void setComputeShaderGather(bool b) {
+            m_computeShaderGather = b;
+        }
+
+        bool computeShaderGather() const {
+            return m_computeShaderGather;
+        }
+
+        /** Average number of gather samples per pixel over both universal gather passes,
+            accounting for UniversalBlurSettings::adaptiveSampleCount() and tile classification.
+            Computed on the GPU and read back asynchronously, so it describes an apply() one or
+            more frames earlier. Only measured while the Profiler is enabled; -1 otherwise and
+            until the first readback completes. */
+        float averageSamplesPerPixel() const {
+            return m_averageSamplesPerPixel;
+        }
+
+        /** Samples per gather pass for a tile whose samples span \a sampleExtent pixels on each side.
+            Keeps the density of \a numSamplesOdd samples across \a maxCoCRadiusPixels.
+            Mirrors tileSampling() in MotionBlur_universalGather.glsl. */
+        static int tileSampleCount(int numSamplesOdd, int minNumSamples, int maxNumSamples, float sampleExtent, float maxCoCRadiusPixels) {
+            const int n = iCeil(float(numSamplesOdd) * sampleExtent / max(maxCoCRadiusPixels, 1.0f));
+            return clamp(n | 1, minNumSamples, maxNumSamples);
+        }
+
 
     // DoF PART STARTS HERE ----------------------------------------------
 
@@ -0,0 +1,122 @@
+/**
+  \file G3D-app.lib/include/G3D-app/UniversalBlurBenchmark.h
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#pragma once
+
+#ifndef GLG3D_UniversalBlurBenchmark_h
+#define GLG3D_UniversalBlurBenchmark_h
+
+#include "G3D-base/platform.h"
+#include "G3D-base/ReferenceCount.h"
+#include "G3D-base/Array.h"
+#include "G3D-base/Vector2int32.h"
+#include "G3D-base/G3DString.h"
+
+namespace G3D {
+
+class RenderDevice;
+class Texture;
+class Framebuffer;
+class Camera;
+class UniversalBlur;
+class UniversalBlurCPU;
+class Image;
+class MotionBlur;
+class DepthOfField;
+class TextOutput;
+
+/**
+  \brief Times UniversalBlur against the DepthOfField + MotionBlur chain that GApp runs when
+  UniversalBlurSettings::enabled() is false.
+
+  Renders fixed, procedurally generated color/depth/velocity fixtures through both pipelines
+  for every combination of resolution, MotionBlurSettings::numSamples() and
+  MotionBlurSettings::maxBlurDiameterFraction() in the Settings, and writes the average
+  per-pass CPU and GPU times reported by the Profiler to a CSV file with one row per pass.
+  UniversalBlur rows also report UniversalBlur::averageSamplesPerPixel() and whether the
+  blurred image matches UniversalBlurCPU on the same fixtures within the tolerance of
+  UniversalBlurCPU::matches(), which serves as a regression check of the GPU passes.
+
+  To run on machines without a GPU, call requestSoftwareRenderer() before the OpenGL context
+  is created so that Mesa's llvmpipe rasterizer stands in for the hardware driver.
+
+  \sa UniversalBlurCPU, Profiler
+*/
+class UniversalBlurBenchmark : public ReferenceCountedObject {
+public:
+
+    class Settings {
+    public:
+        Array<Vector2int32>     resolutions;
+        Array<int>              numSamples;
+        Array<float>            maxBlurDiameterFractions;
+
+        /** Frames rendered before timing each configuration, to exclude shader compilation and allocation */
+        int                     warmupFrames;
+
+        /** Frames averaged for each configuration */
+        int                     timedFrames;
+
+        Settings();
+    };
+
+protected:
+
+    shared_ptr<UniversalBlur>   m_universalBlur;
+    shared_ptr<MotionBlur>      m_motionBlur;
+    shared_ptr<DepthOfField>    m_depthOfField;
+    shared_ptr<Camera>          m_camera;
+
+    /** Reference that the UniversalBlur output is checked against */
+    shared_ptr<UniversalBlurCPU> m_reference;
+
+    /** Fixtures at the current resolution, as uploaded to m_color, m_depth, and m_velocity */
+    shared_ptr<Image>           m_colorImage;
+    shared_ptr<Image>           m_depthImage;
+    shared_ptr<Image>           m_velocityImage;
+
+    /** Fixtures at the current resolution */
+    shared_ptr<Texture>         m_color;
+    shared_ptr<Texture>         m_depth;
+    shared_ptr<Texture>         m_velocity;
+
+    /** The pipelines blur in place, so each frame starts by copying m_color into this */
+    shared_ptr<Framebuffer>     m_framebuffer;
+
+    UniversalBlurBenchmark();
+
+    /** Creates the fixtures at this resolution for m_camera */
+    void makeFixtures(const Vector2int32& resolution);
+
+    /** Renders one frame of either pipeline, bracketed in a profiler event named after the pipeline */
+    void renderFrame(RenderDevice* rd, bool universal);
+
+    /** Returns true if the last frame rendered by UniversalBlur matches m_reference */
+    bool matchesReference() const;
+
+    /** Runs one configuration and appends its rows to \a csv */
+    void runConfiguration(RenderDevice* rd, bool universal, const Settings& settings, int numSamples, float maxBlurDiameterFraction, TextOutput& csv);
+
+public:
+
+    static shared_ptr<UniversalBlurBenchmark> create();
+
+    /** Selects Mesa's llvmpipe software rasterizer through its environment variables. Must
+        be called before the first OpenGL context is created. On Windows, Mesa's opengl32.dll
+        must also be placed next to the executable. */
+    static void requestSoftwareRenderer();
+
+    /** Enables the Profiler, runs every configuration through both pipelines, and writes
+        the results to \a csvFilename. Renders into its own framebuffer; the framebuffer bound on
+        \a rd is unchanged. */
+    void run(RenderDevice* rd, const Settings& settings, const String& csvFilename);
+};
+
+} // namespace G3D
+
+#endif // GLG3D_UniversalBlurBenchmark_h
@@ -0,0 +1,186 @@
+/**
+  \file G3D-app.lib/include/G3D-app/UniversalBlurCPU.h
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#pragma once
+
+#ifndef GLG3D_UniversalBlurCPU_h
+#define GLG3D_UniversalBlurCPU_h
+
+#include "G3D-base/platform.h"
+#include "G3D-base/ReferenceCount.h"
+#include "G3D-base/Array.h"
+#include "G3D-base/Vector2.h"
+#include "G3D-base/Vector2int16.h"
+#include "G3D-base/Color4.h"
+
+namespace G3D {
+
+class Image;
+class Camera;
+
+/**
+  \brief CPU reference implementation of UniversalBlur::apply().
+
+  Runs the same sequence of passes as the GPU version (computeCoC, the two transposed
+  computeTileMinMax passes, computeNeighborMinMax, and both universalGatherBlur passes)
+  on Images, without an OpenGL context. UniversalBlurBenchmark checks the GPU output
+  against it for every configuration that it times. It can also blur offline renderings
+  such as PathTracer::traceImage() output.
+
+  The per-pixel math mirrors DepthOfField_universalCircleOfConfusion.pix and
+  MotionBlur_universalGather.pix exactly, including the jitter table, the integer
+  truncation of sample coordinates, and the treatment of the trim band. Intermediate
+  buffers are kept in 32-bit float, whereas the GPU stores the packed circle of
+  confusion and the speed-direction pass at 16-bit (or 8-bit for LDR inputs) precision.
+  Because the gather makes hard threshold decisions on those values, isolated pixels
+  can differ by a full tap weight. The guaranteed tolerance is the one checked by matches():
+  mean absolute error below 0.005 and fewer than 1% of pixels off by more than 0.05,
+  with errors measured relative to max(1, |expected|) so that HDR inputs are comparable.
+
+  The reference always gathers at full resolution and ignores
+  UniversalBlurSettings::reducedResolutionFactor() and
+  UniversalBlurSettings::temporalAccumulation(); compare against a GPU result rendered
+  with a factor of 1 and without temporal accumulation.
+
+  Rows are processed concurrently and the color accumulation in the gather is SSE-vectorized
+  on x86.
+
+  \sa UniversalBlur, PathTracer
+*/
+class UniversalBlurCPU : public ReferenceCountedObject {
+protected:
+
+    /** Per-apply() values that the GPU version binds as uniforms and macros */
+    struct Constants;
+
+    /** Stripped of the trim band, like UniversalBlur::m_cachedSrc. Saved between invocations to avoid reallocating. */
+    Array<Color4>               m_color;
+
+    /** Hyperbolic depth, including the trim band */
+    Array<float>                m_depth;
+
+    /** Decoded screen-space velocity in pixels, including the trim band. Empty if there was no velocity input. */
+    Array<Vector2>              m_velocity;
+
+    /** Signed, normalized circle of confusion on [-1, 1]. This is the unpacked A channel of UniversalBlur::m_packedBuffer. */
+    Array<float>                m_packedCoC;
+
+    /** Size h x ceil(w / maxBlurRadius), transposed. Max velocity in tile row.
+        The min speed channel of the GPU buffers is not read by the universal gather and is omitted. */
+    Array<Vector2>              m_tileMinMaxTemp;
+
+    /** Size ceil(w / maxBlurRadius) x ceil(h / maxBlurRadius). Max velocity in tile. */
+    Array<Vector2>              m_tileMinMax;
+
+    /** Size ceil(w / maxBlurRadius) x ceil(h / maxBlurRadius). Max velocity in neighborhood. */
+    Array<Vector2>              m_neighborMinMax;
+
+    /** The A channels of the three buffers above: max absolute normalized circle of confusion */
+    Array<float>                m_tileMaxCoCTemp;
+    Array<float>                m_tileMaxCoC;
+    Array<float>                m_neighborMaxCoC;
+
+    bool                        m_tileClassification;
+
+    /** Output of the first gather pass. RGB = color, A = reach written by the speed direction pass */
+    Array<Color4>               m_speedDirectionPass;
+
+    /** Output of the second gather pass, including the trim band */
+    Array<Color4>               m_result;
+
+    /** Same values as UniversalBlur::m_randomBuffer */
+    float                       m_random[32 * 32];
+
+    UniversalBlurCPU();
+
+    void readInputs
+       (const shared_ptr<Image>&    color,
+        const shared_ptr<Image>&    depth,
+        const shared_ptr<Image>&    velocity,
+        const Constants&            k,
+        bool                        singleThreaded);
+
+    /** Writes m_packedCoC. Mirrors UniversalBlur::computeCoC. */
+    void computeCoC(const shared_ptr<Camera>& camera, const Constants& k, bool singleThreaded);
+
+    /** Writes m_tileMinMaxTemp, m_tileMinMax and their CoC maxima. Mirrors UniversalBlur::computeTileMinMax. */
+    void computeTileMinMax(const Constants& k, bool singleThreaded);
+
+    /** Writes m_neighborMinMax and m_neighborMaxCoC. Mirrors UniversalBlur::computeNeighborMinMax. */
+    void computeNeighborMinMax(const Constants& k, bool singleThreaded);
+
+    /** Mirrors UniversalBlur::universalGatherBlur. \a color is trimmedWidth x trimmedHeight;
+        \a output is outputWidth x outputHeight and is cleared outside of the trim band. */
+    void universalGatherBlur
+       (const Constants&            k,
+        bool                        isSpeedDirection,
+        const Array<Color4>&        color,
+        int                         outputWidth,
+        int                         outputHeight,
+        Array<Color4>&              output,
+        bool                        singleThreaded) const;
+
+    /** Signed CoC at \a x, \a y in m_packedCoC. Out-of-bounds reads return -1, which is
+        what the GPU's texelFetch of a zero texel unpacks to. */
+    float packedCoC(const Constants& k, int x, int y) const;
+
+    /** Returns n if it is odd, otherwise returns n + 1 */
+    inline static int nextOdd(int n) {
+        return n + 1 - (n & 1);
+    }
+
+public:
+
+    static shared_ptr<UniversalBlurCPU> create();
+
+    /** Must match UniversalBlur::tileClassification() for the results to match. Defaults to true. */
+    void setTileClassification(bool b) {
+        m_tileClassification = b;
+    }
+
+    bool tileClassification() const {
+        return m_tileClassification;
+    }
+
+    /**
+        Computes the same image that UniversalBlur::apply() renders for these inputs and \a camera.
+
+        \param color Radiance. May have any format; the alpha channel is ignored.
+        \param depth Hyperbolic depth buffer values (as stored in a G3D depth texture) in the R channel.
+        \param velocity Decoded screen-space position change in pixels in RG, i.e., the
+        GBuffer::Field::SS_POSITION_CHANGE texture read back with its encoding applied.
+        May be nullptr, in which case the scene is treated as static.
+        \param result Must have the same dimensions as \a color. Pixels in the trim band are cleared to zero.
+        \param trimBandThickness Same meaning as for UniversalBlur::apply(). \a depth and \a velocity
+        include the band; \a color does too, and it is stripped as the GPU version does.
+    */
+    void apply
+       (const shared_ptr<Image>&    color,
+        const shared_ptr<Image>&    depth,
+        const shared_ptr<Image>&    velocity,
+        const shared_ptr<Camera>&   camera,
+        const shared_ptr<Image>&    result,
+        Vector2int16                trimBandThickness = Vector2int16(0, 0),
+        bool                        singleThreaded = false);
+
+    /** Returns true if the RGB channels of \a actual match \a expected within the
+        tolerance documented for this class. Errors are measured relative to max(1, |expected|).
+        \param meanTolerance Maximum mean per-channel error
+        \param pixelTolerance Per-channel error above which a pixel counts as an outlier
+        \param outlierFraction Maximum fraction of outlier pixels */
+    static bool matches
+       (const shared_ptr<Image>&    expected,
+        const shared_ptr<Image>&    actual,
+        float                       meanTolerance   = 0.005f,
+        float                       pixelTolerance  = 0.05f,
+        float                       outlierFraction = 0.01f);
+};
+
+} // namespace G3D
+
+#endif // GLG3D_UniversalBlurCPU_h
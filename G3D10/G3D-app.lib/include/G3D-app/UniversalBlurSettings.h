@@ -6,33 +6,78 @@
 #define GLG3D_UniversalBlurSettings_h
 
 #include "G3D-base/platform.h"
+#include "G3D-base/Array.h"
 #include "G3D-app/GBuffer.h"
 #include "G3D-app/DepthOfFieldSettings.h"
 #include "G3D-app/MotionBlurSettings.h"
 
 namespace G3D {
 
-    //class Any;
+    class Any;
 
     /** \see Camera, MotionBlur, DepthOfFieldSettings */
     class UniversalBlurSettings {
+    public:
+
+        /** Parameters that trade the quality of the universal blur for speed.
+            \sa setAutomaticQuality */
+        class QualityTier {
+        public:
+            /** Replaces MotionBlurSettings::numSamples() */
+            int                     numSamples;
+
+            /** Replaces reducedResolutionFactor() */
+            int                     reducedResolutionFactor;
+
+            /** Replaces MotionBlurSettings::maxBlurDiameterFraction() */
+            float                   maxBlurDiameterFraction;
+
+            QualityTier(int numSamples = 27, int reducedResolutionFactor = 1, float maxBlurDiameterFraction = 0.10f) :
+                numSamples(numSamples),
+                reducedResolutionFactor(reducedResolutionFactor),
+                maxBlurDiameterFraction(maxBlurDiameterFraction) {}
+
+            QualityTier(const Any&);
+
+            Any toAny() const;
+        };
+
     private:
         bool                        m_enabled;
         bool                        m_MbAlgorithm;
         bool                        m_DofAlgorithm;
 
-    public:
+        /** Divide the image size by this in both directions for the universal gather passes. */
+        int                         m_reducedResolutionFactor = 1;
 
-        //UniversalBlurSettings();
+        /** Scale the gather sample count per tile. \sa setAdaptiveSampleCount */
+        bool                        m_adaptiveSampleCount = true;
+        int                         m_minNumSamples = 5;
+        int                         m_maxNumSamples = 63;
 
-        //UniversalBlurSettings(const Any&);
+        /** Blend with the reprojected previous result. \sa setTemporalAccumulation */
+        bool                        m_temporalAccumulation = false;
+        int                         m_temporalNumSamples = 5;
+        float                       m_temporalHysteresis = 0.85f;
 
-        //Any toAny() const;
+        /** Select m_qualityTier from the measured blur time. \sa setAutomaticQuality */
+        bool                        m_automaticQuality = false;
+        float                       m_frameBudgetMilliseconds = 2.0f;
+        float                       m_qualityHysteresis = 0.25f;
 
-        UniversalBlurSettings() :
-            m_enabled(false), 
-            m_MbAlgorithm(true)
-        {}
+        /** From highest to lowest quality */
+        Array<QualityTier>          m_qualityTiers;
+
+        /** Index into m_qualityTiers */
+        int                         m_qualityTier = 1;
+
+    public:
+
+        UniversalBlurSettings();
+
+        UniversalBlurSettings(const Any&);
+
+        Any toAny() const;
 
         bool enabled() const {
             return m_enabled;
@@ -58,6 +103,168 @@ namespace G3D {
             m_DofAlgorithm = e;
         }
 
+        /** Divide the image size by this in both directions for the universal gather passes,
+            which are then composited with a depth- and velocity-aware upsample. 1 (the default)
+            gathers at full resolution; 2 and 4 are common values for large blurs at high resolution.
+            In-focus, static pixels keep their full-resolution detail at any factor. */
+        void setReducedResolutionFactor(int f) {
+            alwaysAssertM(f >= 1, "The reduced resolution factor must be at least 1");
+            m_reducedResolutionFactor = f;
+        }
+
+        int reducedResolutionFactor() const {
+            return m_reducedResolutionFactor;
+        }
+
+        /** If true (the default), each tile of the universal gather takes samples in proportion to
+            the largest motion blur and circle of confusion radii that reach it, and spreads them over
+            that radius instead of the maximum circle of confusion. MotionBlurSettings::numSamples
+            is then the count for a tile that the largest blur reaches, clamped to
+            [minNumSamples(), maxNumSamples()]. The sample density is unchanged, so tiles with
+            small blurs cost less without losing quality. */
+        void setAdaptiveSampleCount(bool b) {
+            m_adaptiveSampleCount = b;
+        }
+
+        bool adaptiveSampleCount() const {
+            return m_adaptiveSampleCount;
+        }
+
+        /** Fewest samples per gather pass in a blurred tile when adaptiveSampleCount() is true.
+            Rounded up to an odd number. */
+        void setMinNumSamples(int n) {
+            alwaysAssertM(n >= 1, "Must take at least one sample");
+            m_minNumSamples = n;
+        }
+
+        int minNumSamples() const {
+            return m_minNumSamples;
+        }
+
+        /** Most samples per gather pass when adaptiveSampleCount() is true. Rounded up to an odd number. */
+        void setMaxNumSamples(int n) {
+            alwaysAssertM(n >= 1, "Must take at least one sample");
+            m_maxNumSamples = n;
+        }
+
+        int maxNumSamples() const {
+            return m_maxNumSamples;
+        }
+
+        /** If true, the universal gather takes temporalNumSamples() instead of
+            MotionBlurSettings::numSamples(), varies its sample positions every frame, and blends
+            its result with the previous frame's result reprojected along the SS_POSITION_CHANGE
+            buffer. History is rejected where the depth or circle of confusion changed. This
+            trades some ghosting for a much lower per-frame cost. Default is false. */
+        void setTemporalAccumulation(bool b) {
+            m_temporalAccumulation = b;
+        }
+
+        bool temporalAccumulation() const {
+            return m_temporalAccumulation;
+        }
+
+        /** Samples per gather pass under temporal accumulation, replacing
+            MotionBlurSettings::numSamples(). Default is 5. */
+        void setTemporalNumSamples(int n) {
+            alwaysAssertM(n >= 1, "Must take at least one sample");
+            m_temporalNumSamples = n;
+        }
+
+        int temporalNumSamples() const {
+            return m_temporalNumSamples;
+        }
+
+        /** Weight of valid history under temporal accumulation, on [0, 1). Higher values
+            reduce noise and increase ghosting. Default is 0.85. */
+        void setTemporalHysteresis(float h) {
+            alwaysAssertM((h >= 0.0f) && (h < 1.0f), "Hysteresis must be on [0, 1)");
+            m_temporalHysteresis = h;
+        }
+
+        float temporalHysteresis() const {
+            return m_temporalHysteresis;
+        }
+
+        /** If true, UniversalBlur measures the GPU time of its passes with the Profiler and
+            moves between qualityTiers() to keep them under frameBudgetMilliseconds(). The current
+            tier's values then replace MotionBlurSettings::numSamples(),
+            MotionBlurSettings::maxBlurDiameterFraction(), and reducedResolutionFactor().
+            The tier is held while the Profiler is disabled. Default is false. */
+        void setAutomaticQuality(bool b) {
+            m_automaticQuality = b;
+        }
+
+        bool automaticQuality() const {
+            return m_automaticQuality;
+        }
+
+        /** GPU time allowed for all UniversalBlur passes in a frame under automatic quality.
+            Default is 2 ms. */
+        void setFrameBudgetMilliseconds(float ms) {
+            alwaysAssertM(ms > 0.0f, "The frame budget must be positive");
+            m_frameBudgetMilliseconds = ms;
+        }
+
+        float frameBudgetMilliseconds() const {
+            return m_frameBudgetMilliseconds;
+        }
+
+        /** Under automatic quality, the tier is lowered when the blur exceeds the budget but only
+            raised when it is below (1 - hysteresis) times the budget, so that the tier does not
+            alternate between two neighbors. A better tier that was measured over the budget is
+            retried only after a backoff that doubles with every failed attempt, in case the two
+            neighbors straddle the band. On [0, 1). Default is 0.25. */
+        void setQualityHysteresis(float h) {
+            alwaysAssertM((h >= 0.0f) && (h < 1.0f), "Hysteresis must be on [0, 1)");
+            m_qualityHysteresis = h;
+        }
+
+        float qualityHysteresis() const {
+            return m_qualityHysteresis;
+        }
+
+        /** From highest to lowest quality. The default tiers range from 63 samples at full
+            resolution to 9 samples at quarter resolution with a reduced maximum blur. */
+        void setQualityTiers(const Array<QualityTier>& tiers) {
+            alwaysAssertM(tiers.size() > 0, "Must have at least one quality tier");
+            m_qualityTiers = tiers;
+            m_qualityTier = clamp(m_qualityTier, 0, tiers.size() - 1);
+        }
+
+        const Array<QualityTier>& qualityTiers() const {
+            return m_qualityTiers;
+        }
+
+        /** Index into qualityTiers(). Selected automatically under automatic quality. */
+        void setQualityTier(int t) {
+            m_qualityTier = clamp(t, 0, m_qualityTiers.size() - 1);
+        }
+
+        int qualityTier() const {
+            return m_qualityTier;
+        }
+
+        /** Samples per gather pass that UniversalBlur takes, accounting for temporal
+            accumulation and automatic quality. */
+        int effectiveNumSamples(const MotionBlurSettings& motionBlurSettings) const {
+            return m_temporalAccumulation ? m_temporalNumSamples :
+                m_automaticQuality ? m_qualityTiers[m_qualityTier].numSamples :
+                motionBlurSettings.numSamples();
+        }
+
+        /** Maximum motion blur diameter that UniversalBlur uses, accounting for automatic quality. */
+        float effectiveMaxBlurDiameterFraction(const MotionBlurSettings& motionBlurSettings) const {
+            return m_automaticQuality ? m_qualityTiers[m_qualityTier].maxBlurDiameterFraction :
+                motionBlurSettings.maxBlurDiameterFraction();
+        }
+
+        /** Gather resolution divisor that UniversalBlur uses, accounting for automatic quality. */
+        int effectiveReducedResolutionFactor() const {
+            return m_automaticQuality ? m_qualityTiers[m_qualityTier].reducedResolutionFactor :
+                m_reducedResolutionFactor;
+        }
+
     };
 
 }
@@ -0,0 +1,376 @@
+/**
+  \file G3D-app.lib/source/ATrousDenoiser.cpp
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#include "G3D-base/platform.h"
+#ifdef G3D_X86
+#   include <emmintrin.h>
+#endif
+#include "G3D-base/Image.h"
+#include "G3D-base/Thread.h"
+#include "G3D-app/ATrousDenoiser.h"
+
+namespace G3D {
+
+shared_ptr<ATrousDenoiser> ATrousDenoiser::create() {
+    return createShared<ATrousDenoiser>();
+}
+
+
+/** B3-spline */
+static const float kernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+/** Keeps the relative color difference of nearly black pixels from refusing all neighbors */
+static const float colorFloor = 0.01f;
+
+/** Keeps the depth weight finite at zero depth */
+static const float depthFloor = 1e-6f;
+
+
+/** x^(2^log2Power) */
+static inline float powerOfTwoPower(float x, int log2Power) {
+    for (int i = 0; i < log2Power; ++i) {
+        x *= x;
+    }
+    return x;
+}
+
+
+void ATrousDenoiser::readInputs
+   (const shared_ptr<Image>&    color,
+    const shared_ptr<Image>&    albedo,
+    const shared_ptr<Image>&    normal,
+    const shared_ptr<Image>&    depth,
+    bool                        singleThreaded) {
+
+    const int w = color->width();
+    const int h = color->height();
+
+    for (int c = 0; c < 3; ++c) {
+        m_color[0][c].resize(w * h, false);
+        m_color[1][c].resize(w * h, false);
+        m_normal[c].resize(notNull(normal) ? w * h : 0, false);
+    }
+    m_albedo.resize(notNull(albedo) ? w * h : 0, false);
+    m_depth.resize(notNull(depth) ? w * h : 0, false);
+    m_hit.resize((notNull(normal) || notNull(depth)) ? w * h : 0, false);
+
+    // Black surfaces would divide by zero. Their demodulated color is large but
+    // multiplied back by the same albedo, so the clamp only affects how they filter.
+    const Color3 minAlbedo(0.01f);
+
+    runConcurrently(0, h, [&](int y) {
+        for (int x = 0; x < w; ++x) {
+            const int i = x + y * w;
+            Color3 c = color->get<Color3>(x, y);
+            if (notNull(albedo)) {
+                m_albedo[i] = albedo->get<Color3>(x, y).max(minAlbedo);
+                c = c / m_albedo[i];
+            }
+            m_color[0][0][i] = c.r;
+            m_color[0][1][i] = c.g;
+            m_color[0][2][i] = c.b;
+
+            bool hit = true;
+            if (notNull(normal)) {
+                const Color3& n = normal->get<Color3>(x, y);
+                m_normal[0][i] = n.r;
+                m_normal[1][i] = n.g;
+                m_normal[2][i] = n.b;
+                hit = ! n.isZero();
+            }
+
+            if (notNull(depth)) {
+                // Misses store zero so that differences with them stay finite
+                const float z = depth->get<Color1>(x, y).value;
+                hit = isFinite(z);
+                m_depth[i] = hit ? z : 0.0f;
+            }
+
+            if (m_hit.size() > 0) {
+                m_hit[i] = hit ? 1.0f : 0.0f;
+            }
+        }
+    }, singleThreaded);
+}
+
+
+void ATrousDenoiser::filterPixel(int x, int y, int width, int height, int src, int step, float invColorSigma2, const Settings& settings) {
+    const Array<float>* input  = m_color[src];
+    Array<float>*       output = m_color[1 - src];
+
+    const bool hasNormal = (m_normal[0].size() > 0);
+    const bool hasDepth  = (m_depth.size() > 0);
+    const bool hasHit    = (m_hit.size() > 0);
+
+    const int   p  = x + y * width;
+    const float rp = input[0][p];
+    const float gp = input[1][p];
+    const float bp = input[2][p];
+
+    // Color differences are relative, so that the filter behaves the same in bright and dark
+    // regions of HDR images
+    const float colorScale = invColorSigma2 / (square(rp) + square(gp) + square(bp) + colorFloor);
+
+    const float zp   = hasDepth ? m_depth[p] : 0.0f;
+    const float hitP = hasHit   ? m_hit[p]   : 1.0f;
+
+    float sum[3] = {0.0f, 0.0f, 0.0f};
+    float totalWeight = 0.0f;
+
+    for (int dy = -2; dy <= 2; ++dy) {
+        const int qy = y + dy * step;
+        if ((qy < 0) || (qy >= height)) { continue; }
+
+        for (int dx = -2; dx <= 2; ++dx) {
+            const int qx = x + dx * step;
+            if ((qx < 0) || (qx >= width)) { continue; }
+
+            const int q = qx + qy * width;
+            float weight = kernel[dx + 2] * kernel[dy + 2];
+            if (q != p) {
+                // Never mix the background with the scene
+                if (hasHit && (m_hit[q] != hitP)) { continue; }
+
+                float exponent = -(square(input[0][q] - rp) + square(input[1][q] - gp) + square(input[2][q] - bp)) * colorScale;
+
+                // Background pixels have no features to compare
+                if (hitP != 0.0f) {
+                    if (hasNormal) {
+                        const float d = m_normal[0][p] * m_normal[0][q] + m_normal[1][p] * m_normal[1][q] + m_normal[2][p] * m_normal[2][q];
+                        weight *= powerOfTwoPower(max(0.0f, d), settings.normalPowerLog2);
+                    }
+
+                    if (hasDepth) {
+                        const float pixelDistance = float(step * max(abs(dx), abs(dy)));
+                        exponent -= fabsf(m_depth[q] - zp) / (settings.depthSigma * fabsf(zp) * pixelDistance + depthFloor);
+                    }
+                }
+
+                weight *= expf(exponent);
+            }
+
+            sum[0] += input[0][q] * weight;
+            sum[1] += input[1][q] * weight;
+            sum[2] += input[2][q] * weight;
+            totalWeight += weight;
+        } // dx
+    } // dy
+
+    // The center tap always has positive weight
+    for (int c = 0; c < 3; ++c) {
+        output[c][p] = sum[c] / totalWeight;
+    }
+}
+
+
+#ifdef G3D_X86
+
+/** exp(x) for x <= 0, from 2^x = 2^floor(x) * 2^fraction(x) with a degree-7
+    polynomial for the fraction. Relative error is below 4e-6. */
+static inline __m128 expNonPositive4(__m128 x) {
+    // Below this the result underflows to zero in 2^floor(x)
+    x = _mm_max_ps(x, _mm_set1_ps(-87.0f));
+    const __m128 t = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
+
+    // Truncation rounds toward zero, so subtract one where it rounded up
+    __m128 i = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+    i = _mm_sub_ps(i, _mm_and_ps(_mm_cmpgt_ps(i, t), _mm_set1_ps(1.0f)));
+    const __m128 f = _mm_sub_ps(t, i);
+
+    // Taylor series of 2^f = e^(f ln 2)
+    __m128 p = _mm_set1_ps(1.5252734e-5f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.5403530e-4f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.3333558e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.6181291e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.5504109e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.4022651e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.9314718e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+
+    // 2^i from the exponent bits
+    const __m128i exponent = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(i), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(exponent));
+}
+
+
+/** \a a where \a mask is set, otherwise \a b */
+static inline __m128 select4(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+
+void ATrousDenoiser::filterFour(int x, int y, int width, int height, int src, int step, float invColorSigma2, const Settings& settings) {
+    const Array<float>* input  = m_color[src];
+    Array<float>*       output = m_color[1 - src];
+
+    const bool hasNormal = (m_normal[0].size() > 0);
+    const bool hasDepth  = (m_depth.size() > 0);
+    const bool hasHit    = (m_hit.size() > 0);
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one  = _mm_set1_ps(1.0f);
+
+    const int    p  = x + y * width;
+    const __m128 rp = _mm_loadu_ps(input[0].getCArray() + p);
+    const __m128 gp = _mm_loadu_ps(input[1].getCArray() + p);
+    const __m128 bp = _mm_loadu_ps(input[2].getCArray() + p);
+
+    const __m128 negColorScale = _mm_div_ps(_mm_set1_ps(-invColorSigma2),
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(rp, rp), _mm_mul_ps(gp, gp)), _mm_add_ps(_mm_mul_ps(bp, bp), _mm_set1_ps(colorFloor))));
+
+    __m128 nxp = zero, nyp = zero, nzp = zero;
+    if (hasNormal) {
+        nxp = _mm_loadu_ps(m_normal[0].getCArray() + p);
+        nyp = _mm_loadu_ps(m_normal[1].getCArray() + p);
+        nzp = _mm_loadu_ps(m_normal[2].getCArray() + p);
+    }
+
+    __m128 zp = zero;
+    __m128 invDepthScale[2] = {zero, zero};
+    if (hasDepth) {
+        // One scale for each of the two tap distances, step and 2 * step
+        zp = _mm_loadu_ps(m_depth.getCArray() + p);
+        const __m128 absZp = _mm_andnot_ps(_mm_set1_ps(-0.0f), zp);
+        for (int d = 0; d < 2; ++d) {
+            const __m128 scale = _mm_mul_ps(absZp, _mm_set1_ps(settings.depthSigma * float(step * (d + 1))));
+            invDepthScale[d] = _mm_div_ps(one, _mm_add_ps(scale, _mm_set1_ps(depthFloor)));
+        }
+    }
+
+    const __m128 hitP     = hasHit ? _mm_loadu_ps(m_hit.getCArray() + p) : one;
+    const __m128 hitPMask = _mm_cmpneq_ps(hitP, zero);
+
+    __m128 sumR = zero, sumG = zero, sumB = zero, totalWeight = zero;
+
+    for (int dy = -2; dy <= 2; ++dy) {
+        const int qy = y + dy * step;
+        if ((qy < 0) || (qy >= height)) { continue; }
+
+        for (int dx = -2; dx <= 2; ++dx) {
+            const int q = x + dx * step + qy * width;
+
+            const __m128 rq = _mm_loadu_ps(input[0].getCArray() + q);
+            const __m128 gq = _mm_loadu_ps(input[1].getCArray() + q);
+            const __m128 bq = _mm_loadu_ps(input[2].getCArray() + q);
+
+            __m128 weight = _mm_set1_ps(kernel[dx + 2] * kernel[dy + 2]);
+            if (q != p) {
+                const __m128 dr = _mm_sub_ps(rq, rp);
+                const __m128 dg = _mm_sub_ps(gq, gp);
+                const __m128 db = _mm_sub_ps(bq, bp);
+                __m128 exponent = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db)), negColorScale);
+
+                if (hasNormal) {
+                    const __m128 d = _mm_add_ps(_mm_add_ps(
+                        _mm_mul_ps(nxp, _mm_loadu_ps(m_normal[0].getCArray() + q)),
+                        _mm_mul_ps(nyp, _mm_loadu_ps(m_normal[1].getCArray() + q))),
+                        _mm_mul_ps(nzp, _mm_loadu_ps(m_normal[2].getCArray() + q)));
+                    __m128 normalWeight = _mm_max_ps(d, zero);
+                    for (int i = 0; i < settings.normalPowerLog2; ++i) {
+                        normalWeight = _mm_mul_ps(normalWeight, normalWeight);
+                    }
+
+                    // Background pixels have no features to compare
+                    weight = _mm_mul_ps(weight, select4(hitPMask, normalWeight, one));
+                }
+
+                if (hasDepth) {
+                    // Misses store zero depth, so background pairs contribute nothing here
+                    const __m128 dz = _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(_mm_loadu_ps(m_depth.getCArray() + q), zp));
+                    const int d = max(abs(dx), abs(dy)) - 1;
+                    exponent = _mm_sub_ps(exponent, _mm_and_ps(hitPMask, _mm_mul_ps(dz, invDepthScale[d])));
+                }
+
+                weight = _mm_mul_ps(weight, expNonPositive4(exponent));
+
+                if (hasHit) {
+                    // Never mix the background with the scene
+                    weight = _mm_and_ps(weight, _mm_cmpeq_ps(_mm_loadu_ps(m_hit.getCArray() + q), hitP));
+                }
+            }
+
+            sumR = _mm_add_ps(sumR, _mm_mul_ps(rq, weight));
+            sumG = _mm_add_ps(sumG, _mm_mul_ps(gq, weight));
+            sumB = _mm_add_ps(sumB, _mm_mul_ps(bq, weight));
+            totalWeight = _mm_add_ps(totalWeight, weight);
+        } // dx
+    } // dy
+
+    // The center tap always has positive weight
+    const __m128 invTotalWeight = _mm_div_ps(one, totalWeight);
+    _mm_storeu_ps(output[0].getCArray() + p, _mm_mul_ps(sumR, invTotalWeight));
+    _mm_storeu_ps(output[1].getCArray() + p, _mm_mul_ps(sumG, invTotalWeight));
+    _mm_storeu_ps(output[2].getCArray() + p, _mm_mul_ps(sumB, invTotalWeight));
+}
+
+#endif
+
+
+void ATrousDenoiser::filterPass(int width, int height, int src, int step, float colorSigma, const Settings& settings, bool singleThreaded) {
+    const float invColorSigma2 = 1.0f / square(colorSigma);
+
+    runConcurrently(0, height, [&](int y) {
+        int x = 0;
+#       ifdef G3D_X86
+            // Pixels whose taps leave the image on the left or right are filtered one at a time
+            for (; x < min(2 * step, width); ++x) {
+                filterPixel(x, y, width, height, src, step, invColorSigma2, settings);
+            }
+            for (; x + 3 + 2 * step < width; x += 4) {
+                filterFour(x, y, width, height, src, step, invColorSigma2, settings);
+            }
+#       endif
+        for (; x < width; ++x) {
+            filterPixel(x, y, width, height, src, step, invColorSigma2, settings);
+        }
+    }, singleThreaded);
+}
+
+
+void ATrousDenoiser::apply
+   (const shared_ptr<Image>&    color,
+    const shared_ptr<Image>&    albedo,
+    const shared_ptr<Image>&    normal,
+    const shared_ptr<Image>&    depth,
+    const shared_ptr<Image>&    result,
+    const Settings&             settings,
+    bool                        singleThreaded) {
+
+    alwaysAssertM(notNull(color) && notNull(result), "Color and result images may not be nullptr");
+    alwaysAssertM((result->width() == color->width()) && (result->height() == color->height()), "Result must have the same dimensions as color");
+    alwaysAssertM(isNull(albedo) || ((albedo->width() == color->width()) && (albedo->height() == color->height())), "Albedo must have the same dimensions as color");
+    alwaysAssertM(isNull(normal) || ((normal->width() == color->width()) && (normal->height() == color->height())), "Normal must have the same dimensions as color");
+    alwaysAssertM(isNull(depth)  || ((depth->width()  == color->width()) && (depth->height()  == color->height())), "Depth must have the same dimensions as color");
+
+    const int w = color->width();
+    const int h = color->height();
+
+    readInputs(color, albedo, normal, depth, singleThreaded);
+
+    int src = 0;
+    float colorSigma = settings.colorSigma;
+    for (int pass = 0; pass < settings.numPasses; ++pass) {
+        filterPass(w, h, src, 1 << pass, colorSigma, settings, singleThreaded);
+        src = 1 - src;
+        colorSigma *= 0.5f;
+    }
+
+    // Remodulate
+    runConcurrently(0, h, [&](int y) {
+        for (int x = 0; x < w; ++x) {
+            const int i = x + y * w;
+            Color3 c(m_color[src][0][i], m_color[src][1][i], m_color[src][2][i]);
+            if (m_albedo.size() > 0) {
+                c = c * m_albedo[i];
+            }
+            result->set(x, y, c);
+        }
+    }, singleThreaded);
+}
+
+} // namespace G3D
@@ -57,6 +57,7 @@ void Camera::init
     m_previousProjection = m_projection;
     reader.getIfPresent("depthOfFieldSettings", m_depthOfFieldSettings);
     reader.getIfPresent("motionBlurSettings",   m_motionBlurSettings);
+    reader.getIfPresent("universalBlurSettings", m_universalBlurSettings);
     reader.getIfPresent("filmSettings",         m_filmSettings);
     reader.getIfPresent("visualizationScale",   m_visualizationScale);
     reader.getIfPresent("overridePixelOffset",  m_overridePixelOffset);
@@ -71,6 +72,7 @@ Any Camera::toAny(const bool forceAll) const {
     any["projection"]           = m_projection;
     any["depthOfFieldSettings"] = m_depthOfFieldSettings;
     any["motionBlurSettings"]   = m_motionBlurSettings;
+    any["universalBlurSettings"] = m_universalBlurSettings;
     any["filmSettings"]         = m_filmSettings;
     any["visualizationScale"]   = m_visualizationScale;
     any["overridePixelOffset"]  = m_overridePixelOffset;
@@ -525,6 +527,19 @@ void Camera::makeGUI(GuiPane* p, GApp* app) {
             Pointer<bool>(&universalBlurSettings(),
                 &UniversalBlurSettings::enabled,
                 &UniversalBlurSettings::setEnabled));
+
+        uBlurPane->addCheckBox
+        ("Automatic quality",
+            Pointer<bool>(&universalBlurSettings(),
+                &UniversalBlurSettings::automaticQuality,
+                &UniversalBlurSettings::setAutomaticQuality));
+
+        GuiNumberBox<float>* n = uBlurPane->addNumberBox("Budget",
+            Pointer<float>(&universalBlurSettings(),
+                &UniversalBlurSettings::frameBudgetMilliseconds,
+                &UniversalBlurSettings::setFrameBudgetMilliseconds),
+            "ms", GuiTheme::LINEAR_SLIDER, 0.25f, 16.0f);
+        n->setCaptionWidth(105);
     }
 
     /////////////////////////////////////////////////////////
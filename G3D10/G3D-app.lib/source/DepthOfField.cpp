@@ -25,6 +25,11 @@ shared_ptr<DepthOfField> DepthOfField::create(const String& debugName) {
 }
 
 
+bool DepthOfField::enabled(const shared_ptr<Camera>& camera) {
+    return (camera->depthOfFieldSettings().model() != DepthOfFieldModel::NONE) && camera->depthOfFieldSettings().enabled() && ! camera->universalBlurSettings().enabled();
+}
+
+
 void DepthOfField::apply
 (RenderDevice*                  rd, 
  shared_ptr<Texture>            color,
@@ -33,7 +38,7 @@ void DepthOfField::apply
  Vector2int16                   trimBandThickness,
  DebugOption                    debugOption) {
 
-    if ((camera->depthOfFieldSettings().model() == DepthOfFieldModel::NONE) || ! camera->depthOfFieldSettings().enabled() || camera->universalBlurSettings().enabled()) {
+    if (! enabled(camera)) {
         const shared_ptr<Framebuffer>& f = rd->framebuffer();
         const shared_ptr<Framebuffer::Attachment>& a = f->get(Framebuffer::COLOR0);
        
@@ -59,11 +64,22 @@ void DepthOfField::apply
     const bool diskFramebuffer = camera->depthOfFieldSettings().diskFramebuffer();
 
     debugAssert(maxCoCRadiusPixels >= 0.0f);
+    BEGIN_PROFILER_EVENT("DepthOfField::computeCoC");
     computeCoC(rd, color, depth, camera, trimBandThickness, farRadiusRescale, maxCoCRadiusPixels);
+    END_PROFILER_EVENT();
+
+    BEGIN_PROFILER_EVENT("DepthOfField::blurPass (horizontal)");
     blurPass(rd, m_packedBuffer, m_packedBuffer, m_horizontalFramebuffer, true, camera, viewport, maxCoCRadiusPixels, diskFramebuffer);
+    END_PROFILER_EVENT();
+
+    BEGIN_PROFILER_EVENT("DepthOfField::blurPass (vertical)");
     blurPass(rd, m_tempBlurBuffer, m_tempNearBuffer, m_verticalFramebuffer, false, camera, viewport, maxCoCRadiusPixels, diskFramebuffer);
+    END_PROFILER_EVENT();
+
+    BEGIN_PROFILER_EVENT("DepthOfField::composite");
     composite(rd, m_packedBuffer, m_blurBuffer, m_nearBuffer, debugOption, trimBandThickness, farRadiusRescale, diskFramebuffer);
     END_PROFILER_EVENT();
+    END_PROFILER_EVENT();
 }
 
 
@@ -35,6 +35,7 @@
 #include "G3D-app/Light.h"
 #include "G3D-gfx/AudioDevice.h"
 #include "G3D-app/MotionBlur.h"
+#include "G3D-app/PostProcessChain.h"
 #include "G3D-app/SceneEditorWindow.h"
 #include "G3D-app/ScreenCapture.h"
 #include "G3D-gfx/Shader.h"
@@ -396,6 +397,8 @@ void GApp::initializeOpenGL(RenderDevice* rd, OSWindow* window, bool createWindo
     m_depthOfField = DepthOfField::create();
     m_motionBlur   = MotionBlur::create();
     m_universalBlur = UniversalBlur::create();
+    m_postProcessChain = PostProcessChain::create(Array<PostProcessChain::Effect>(PostProcessChain::DEPTH_OF_FIELD, PostProcessChain::MOTION_BLUR, PostProcessChain::UNIVERSAL_BLUR),
+        m_depthOfField, m_motionBlur, m_universalBlur);
 
     renderDevice->setColorClearValue(Color3(0.1f, 0.5f, 1.0f));
 
@@ -1191,27 +1194,13 @@ void GApp::onGraphics3D(RenderDevice* rd, Array<shared_ptr<Surface> >& allSurfac
 
 
 void GApp::onPostProcessHDR3DEffects(RenderDevice* rd) {
-    // Post-process special effects
-    
-    if (activeCamera()->universalBlurSettings().enabled())
-    {
-        m_universalBlur->apply(
-            rd,
-            m_framebuffer->texture(0),
-            m_framebuffer->texture(Framebuffer::DEPTH),
-            m_gbuffer->texture(GBuffer::Field::SS_POSITION_CHANGE),
-            activeCamera(),
-            m_settings.hdrFramebuffer.depthGuardBandThickness - m_settings.hdrFramebuffer.colorGuardBandThickness
-        );
-    }
-    else
-    {
-        m_depthOfField->apply(rd, m_framebuffer->texture(0), m_framebuffer->texture(Framebuffer::DEPTH), activeCamera(), m_settings.hdrFramebuffer.depthGuardBandThickness - m_settings.hdrFramebuffer.colorGuardBandThickness);
-
-        m_motionBlur->apply(rd, m_framebuffer->texture(0), m_gbuffer->texture(GBuffer::Field::SS_POSITION_CHANGE),
-            m_framebuffer->texture(Framebuffer::DEPTH), activeCamera(),
-            m_settings.hdrFramebuffer.depthGuardBandThickness - m_settings.hdrFramebuffer.colorGuardBandThickness);
-    }
+    // Post-process special effects. Either universal blur, or depth of field followed by
+    // motion blur through an intermediate texture, written back to m_framebuffer's color texture.
+    m_postProcessChain->apply(rd, m_framebuffer,
+        m_framebuffer->texture(Framebuffer::DEPTH),
+        m_gbuffer->texture(GBuffer::Field::SS_POSITION_CHANGE),
+        activeCamera(),
+        m_settings.hdrFramebuffer.depthGuardBandThickness - m_settings.hdrFramebuffer.colorGuardBandThickness);
 }
 
 
@@ -16,6 +16,11 @@
 #include "G3D-app/SlowMesh.h"
 
 namespace G3D {
+
+bool MotionBlur::enabled(const shared_ptr<Camera>& camera) {
+    return camera->motionBlurSettings().enabled() && ! camera->universalBlurSettings().enabled();
+}
+
     
 void MotionBlur::apply
  (RenderDevice*                 rd, 
@@ -25,7 +30,7 @@ void MotionBlur::apply
   const shared_ptr<Camera>&     camera,
   Vector2int16                  trimBandThickness) {
 
-    if (! camera->motionBlurSettings().enabled() || camera->universalBlurSettings().enabled()) {
+    if (! enabled(camera)) {
         return;
     }
 
@@ -45,16 +50,15 @@ void MotionBlur::apply
 
     shared_ptr<Texture> src;
 
-    // Copy the input to another buffer
+    // Position of the trimmed image within src
+    Vector2int16 colorBufferOffset(0, 0);
 
-    if (((notNull(rd->framebuffer()) &&
-        (color == rd->framebuffer()->get(Framebuffer::COLOR0)->texture())) ||
-        ! trimBandThickness.isZero())) {
+    if (notNull(rd->framebuffer()) &&
+        (color == rd->framebuffer()->get(Framebuffer::COLOR0)->texture())) {
         // The input color buffer is the current framebuffer's draw target.
         // Make a copy so that we can read from it during the final gatherBlur pass.
-        // Note that if we knew that we were performing multiple effects at the same time
-        // (e.g., Film, DepthOfField, and MotionBlur), we could avoid this copy by 
-        // connecting the output of one to the input of the next.
+        // PostProcessChain avoids this copy by connecting the output of one
+        // effect to the input of the next.
 
         if (isNull(m_cachedSrc) || (m_cachedSrc->format() != color->format())) {
             // Reallocate the underlying texture
@@ -70,12 +74,22 @@ void MotionBlur::apply
         Texture::copy(color, src, 0, 0, 1.0f, trimBandThickness, CubeFace::POS_X, CubeFace::POS_X, rd, false);
 
     } else {
+        // Read around the trim band in place instead of stripping it
         src = color;
+        colorBufferOffset = trimBandThickness;
     }
 
+    BEGIN_PROFILER_EVENT("G3D::MotionBlur::computeTileMinMax");
     computeTileMinMax(rd, velocity, maxBlurRadiusPixels, trimBandThickness);
+    END_PROFILER_EVENT();
+
+    BEGIN_PROFILER_EVENT("G3D::MotionBlur::computeNeighborMinMax");
     computeNeighborMinMax(rd, m_tileMinMaxFramebuffer->texture(0));
-    gatherBlur(rd, src, m_neighborMinMaxFramebuffer->texture(0), velocity, depth, numSamplesOdd, maxBlurRadiusPixels, exposureTimeFraction, trimBandThickness);
+    END_PROFILER_EVENT();
+
+    BEGIN_PROFILER_EVENT("G3D::MotionBlur::gatherBlur");
+    gatherBlur(rd, src, m_neighborMinMaxFramebuffer->texture(0), velocity, depth, numSamplesOdd, maxBlurRadiusPixels, exposureTimeFraction, trimBandThickness, colorBufferOffset);
+    END_PROFILER_EVENT();
             
     if (m_debugShowTiles) {
         rd->push2D(); {
@@ -105,6 +119,7 @@ void MotionBlur::computeTileMinMax
         velocity->encoding());
 
     args.setMacro("maxBlurRadius", maxBlurRadiusPixels);
+    args.setMacro("TILE_MAX_COC", 0);
 
     // Horizontal pass
     rd->push2D(m_tileMinMaxTempFramebuffer); {
@@ -151,6 +166,7 @@ void MotionBlur::computeNeighborMinMax
             GBuffer::Field::SS_POSITION_CHANGE,
             tileMax->encoding());
 
+        args.setMacro("NEIGHBOR_MAX_COC", 0);
         args.setRect(rd->viewport());
         LAUNCH_SHADER("MotionBlur_neighborMinMax.*", args);
 
@@ -167,7 +183,8 @@ void MotionBlur::gatherBlur
     int                               numSamplesOdd,
     int                               maxBlurRadiusPixels,
     float                             exposureTimeFraction,
-    Vector2int16                      trimBandThickness) {
+    Vector2int16                      trimBandThickness,
+    Vector2int16                      colorBufferOffset) {
         
     // Switch to 2D mode using the current framebuffer
     rd->push2D(); {
@@ -193,6 +210,7 @@ void MotionBlur::gatherBlur
         args.setUniform("depthBuffer",                depth, Sampler::buffer());
 
         args.setUniform("trimBandThickness",          trimBandThickness);
+        args.setUniform("colorBufferOffset",          colorBufferOffset);
         
         args.setRect(rd->viewport());
         LAUNCH_SHADER("MotionBlur_gather.*", args);
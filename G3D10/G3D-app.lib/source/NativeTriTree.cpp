@@ -7,14 +7,21 @@
   Available under the BSD License
 */
 
+#include <mutex>
+#include "G3D-base/platform.h"
+#ifdef G3D_X86
+#   include <emmintrin.h>
+#endif
 #include "G3D-base/AreaMemoryManager.h"
 #include "G3D-base/Intersect.h"
 #include "G3D-base/CollisionDetection.h"
 #include "G3D-app/NativeTriTree.h"
+#include "G3D-app/Material.h"
 #include "G3D-gfx/RenderDevice.h"
 #include "G3D-app/Draw.h"
 #include "G3D-app/Surface.h"
 #include "G3D-app/UniversalSurfel.h"
+#include "G3D-app/Entity.h"
 
 namespace G3D {
 
@@ -28,28 +35,55 @@ namespace G3D {
 #endif
 
 const char* NativeTriTree::algorithmName(SplitAlgorithm s) {
-    const char* n[] = {"Mean extent", "Median area", "Median count", "SAH"};
+    const char* n[] = {"Mean extent", "Median area", "Median count", "SAH", "Binned SAH"};
     return n[s];
 }
 
 
-void NativeTriTree::intersectSphere
-   (const Sphere& sphere,
-    Array<Tri>&   triArray) const {
-    if (m_root) {
-        Set<Tri*> alreadyAdded;
-        m_root->intersectSphere(sphere, m_vertexArray, triArray, alreadyAdded);
+/** Relative costs used by the Surface Area Heuristic */
+static const float boxIntersectTime = 5;
+static const float triIntersectTime = 1;
+
+/** Number of polygons per task when binning and splitting a single large node concurrently */
+static const int parallelChunkSize = 4096;
+
+/** Levels of the Node tree, and subtree size in flat nodes, at which refit() stops
+    refitting children concurrently */
+static const int parallelRefitDepth = 6;
+static const int parallelRefitNodes = 1024;
+
+
+namespace _internal {
+/** Serializes access to an underlying MemoryManager so that subtrees
+    can be built concurrently. Nodes are allocated in pairs, so contention
+    is low relative to the work of splitting. */
+class LockedMemoryManager : public MemoryManager {
+protected:
+    std::mutex                  m_mutex;
+    shared_ptr<MemoryManager>   m_base;
+
+public:
+
+    LockedMemoryManager(const shared_ptr<MemoryManager>& base) : m_base(base) {}
+
+    static shared_ptr<LockedMemoryManager> create(const shared_ptr<MemoryManager>& base) {
+        return createShared<LockedMemoryManager>(base);
     }
-}
 
+    virtual void* alloc(size_t s) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_base->alloc(s);
+    }
 
-void NativeTriTree::intersectBox
-   (const AABox&  box,
-    Array<Tri>&   triArray) const {
-    if (m_root) {
-        Set<Tri*> alreadyAdded;
-        m_root->intersectBox(box, m_vertexArray, triArray, alreadyAdded);
+    virtual void free(void* x) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_base->free(x);
+    }
+
+    virtual bool isThreadsafe() const override {
+        return true;
     }
+};
 }
 
 
@@ -61,7 +95,7 @@ void NativeTriTree::rebuild() {
         m_memoryManager.reset();
     }
 
-    Settings settings;
+    const RealTime startTime = System::time();
     static const float epsilon = 0.000001f;
 
     Array<Poly> source;
@@ -73,28 +107,23 @@ void NativeTriTree::rebuild() {
     }
     
     if (source.size() > 0) {
-        m_memoryManager = AreaMemoryManager::create();
-        m_root = new (m_memoryManager->alloc(sizeof(Node))) Node(source, settings, m_memoryManager);
+        m_memoryManager = _internal::LockedMemoryManager::create(AreaMemoryManager::create());
+        m_root = new (m_memoryManager->alloc(sizeof(Node))) Node(source, m_settings, m_memoryManager);
     }
 
+    flatten();
+    updateMaterialTable();
+    m_numRefits = 0;
+    m_refit     = false;
+
     m_lastBuildTime = System::time();
+    m_buildDuration = m_lastBuildTime - startTime;
 
     // alwaysAssertM(m_triArray.size() == m_triArray.capacity(), "Allocated too much memory for the Tri Array");
     // alwaysAssertM(m_vertexArray.vertex.size() == m_vertexArray.vertex.capacity(), "Allocated too much memory for the vertex array");
 }
 
 
-/** Returns true if \a ray hits \a box.
-
-   \param maxTime The routine <i>may</i> return false if an intersection exists but lies after maxTime*/
-inline static bool intersect(const PrecomputedRay& ray, const AABox& box, float maxTime) {
-    //  Enabling the more exact test actually hurts performance on test scenes
-    //    float t;
-    //    return Intersect::rayAABox(ray, box, t) && (t < maxTime);
-    return Intersect::rayAABox(ray, box); 
-}
-  
-
 void NativeTriTree::Node::setValueArray(const Array<Poly>& src, const shared_ptr<MemoryManager>& mm) {
     if (src.size() == 0) {
         return;
@@ -165,9 +194,7 @@ void NativeTriTree::Node::split(Array<Poly>& original, const Settings& settings,
         // the triangle because otherwise it is being
         // multiplied at every split.
         const float maxArea = bounds.area() * settings.maxAreaFraction;
-        for (int j = 0; j < original.size(); ++j) {
-            original[j].split(axis, splitLocation, maxArea, lowArray, highArray, spanArray);
-        }
+        splitPolys(original, axis, splitLocation, maxArea, settings, lowArray, highArray, spanArray);
         
         if (badSplit(original.size(), lowArray.size(), highArray.size())) {
             if (i == 2) {
@@ -187,14 +214,62 @@ void NativeTriTree::Node::split(Array<Poly>& original, const Settings& settings,
                           format("Pointer is not a multiple of four bytes: %d", (int)(intptr_t)ptr));
             packedChildAxis = reinterpret_cast<uintptr_t>(ptr) | static_cast<uintptr_t>(axis);
 
-            new (ptr) Node(lowArray, settings, mm);
-            new (ptr + 1) Node(highArray, settings, mm);
+            if (original.size() >= settings.parallelBuildThreshold) {
+                // The subtrees share no state except for the (locked) memory manager
+                runConcurrently(0, 2, [&](int c) {
+                    new (ptr + c) Node((c == 0) ? lowArray : highArray, settings, mm);
+                });
+            } else {
+                new (ptr) Node(lowArray, settings, mm);
+                new (ptr + 1) Node(highArray, settings, mm);
+            }
             return;
         }
     }
 }
 
 
+void NativeTriTree::Node::splitPolys
+   (const Array<Poly>& original,
+    Vector3::Axis      axis,
+    float              offset,
+    float              minSpanArea,
+    const Settings&    settings,
+    Array<Poly>&       lowArray,
+    Array<Poly>&       highArray,
+    Array<Poly>&       spanArray) {
+
+    const int numChunks = iCeil(float(original.size()) / float(parallelChunkSize));
+
+    if ((original.size() < settings.parallelBuildThreshold) || (numChunks < 2)) {
+        for (int j = 0; j < original.size(); ++j) {
+            original[j].split(axis, offset, minSpanArea, lowArray, highArray, spanArray);
+        }
+        return;
+    }
+
+    // Split each chunk into its own arrays, and then concatenate them in
+    // order so that the result matches the serial loop exactly
+    Array<Array<Poly>> chunkLow, chunkHigh, chunkSpan;
+    chunkLow.resize(numChunks);
+    chunkHigh.resize(numChunks);
+    chunkSpan.resize(numChunks);
+
+    runConcurrently(0, numChunks, [&](int c) {
+        const int end = min(original.size(), (c + 1) * parallelChunkSize);
+        for (int j = c * parallelChunkSize; j < end; ++j) {
+            original[j].split(axis, offset, minSpanArea, chunkLow[c], chunkHigh[c], chunkSpan[c]);
+        }
+    });
+
+    for (int c = 0; c < numChunks; ++c) {
+        lowArray.append(chunkLow[c]);
+        highArray.append(chunkHigh[c]);
+        spanArray.append(chunkSpan[c]);
+    }
+}
+
+
 void NativeTriTree::Node::destroy(const shared_ptr<MemoryManager>& mm) {
     // Destroy children
     if (! isLeaf()) {
@@ -228,6 +303,9 @@ float NativeTriTree::Node::chooseSplitLocation(Array<Poly>& source, const Settin
         
     case SAH:
         return chooseSAHSplitLocation(source, axis, settings);
+
+    case BINNED_SAH:
+        return chooseBinnedSAHSplitLocation(source, axis, settings);
         
     default:
         alwaysAssertM(false, "Fell through switch");
@@ -359,6 +437,117 @@ float NativeTriTree::Node::chooseSAHSplitLocationFast(Array<Poly>& source, Vecto
 }
 
 
+namespace _internal {
+/** Polygons whose centers fall within one interval of a node for BINNED_SAH */
+class SAHBin {
+public:
+    int         count;
+    Vector3     low;
+    Vector3     high;
+
+    SAHBin() : count(0), low(Vector3::inf()), high(-Vector3::inf()) {}
+
+    void insert(const Vector3& polyLow, const Vector3& polyHigh) {
+        ++count;
+        low  = low.min(polyLow);
+        high = high.max(polyHigh);
+    }
+
+    void insert(const SAHBin& bin) {
+        count += bin.count;
+        low  = low.min(bin.low);
+        high = high.max(bin.high);
+    }
+
+    float area() const {
+        return (count > 0) ? AABox(low, high).area() : 0.0f;
+    }
+};
+}
+
+
+float NativeTriTree::Node::chooseBinnedSAHSplitLocation(const Array<Poly>& source, Vector3::Axis axis, const Settings& settings) {
+    using _internal::SAHBin;
+
+    const float lo     = bounds.low()[axis];
+    const float extent = bounds.extent()[axis];
+    const int   K      = max(2, settings.numBins);
+
+    if (extent <= 0.0f) {
+        return bounds.center()[axis];
+    }
+
+    const float binsPerUnit = float(K) / extent;
+    Array<SAHBin> bin;
+    bin.resize(K);
+
+    const int numChunks = iCeil(float(source.size()) / float(parallelChunkSize));
+    if ((source.size() < settings.parallelBuildThreshold) || (numChunks < 2)) {
+        for (int i = 0; i < source.size(); ++i) {
+            const Poly& poly = source[i];
+            const int b = clamp(iFloor(((poly.low()[axis] + poly.high()[axis]) * 0.5f - lo) * binsPerUnit), 0, K - 1);
+            bin[b].insert(poly.low(), poly.high());
+        }
+    } else {
+        // Bin each chunk separately and then merge, so that no bin is shared between tasks
+        Array<Array<SAHBin>> chunkBin;
+        chunkBin.resize(numChunks);
+        runConcurrently(0, numChunks, [&](int c) {
+            Array<SAHBin>& local = chunkBin[c];
+            local.resize(K);
+            const int end = min(source.size(), (c + 1) * parallelChunkSize);
+            for (int i = c * parallelChunkSize; i < end; ++i) {
+                const Poly& poly = source[i];
+                const int b = clamp(iFloor(((poly.low()[axis] + poly.high()[axis]) * 0.5f - lo) * binsPerUnit), 0, K - 1);
+                local[b].insert(poly.low(), poly.high());
+            }
+        });
+
+        for (int c = 0; c < numChunks; ++c) {
+            for (int b = 0; b < K; ++b) {
+                bin[b].insert(chunkBin[c][b]);
+            }
+        }
+    }
+
+    // Sweep from above for the high-side cost of the boundary below each bin
+    Array<float> highCost;
+    highCost.resize(K);
+    const float containingArea = bounds.area();
+    {
+        SAHBin high;
+        for (int b = K - 1; b > 0; --b) {
+            high.insert(bin[b]);
+            highCost[b] = (high.count > 0) ? SAHCost(high.count, high.area(), containingArea) : (float)inf();
+        }
+    }
+
+    // Sweep from below, tracking the lowest total cost
+    float lowestCost  = (float)inf();
+    int   lowestCostBoundary = -1;
+    {
+        SAHBin low;
+        for (int b = 1; b < K; ++b) {
+            low.insert(bin[b - 1]);
+            if (low.count > 0) {
+                const float cost = SAHCost(low.count, low.area(), containingArea) + highCost[b];
+                if (cost < lowestCost) {
+                    lowestCost = cost;
+                    lowestCostBoundary = b;
+                }
+            }
+        }
+    }
+
+    if (lowestCostBoundary == -1) {
+        // All centers are in a single bin
+        return bounds.center()[axis];
+    } else {
+        return lo + extent * float(lowestCostBoundary) / float(K);
+    }
+}
+
+
 float NativeTriTree::Node::chooseSAHSplitLocationAccurate(Array<Poly>& source, Vector3::Axis axis, const Settings& settings) {
     // Get the unique potential split locations
     
@@ -390,9 +579,6 @@ float NativeTriTree::Node::chooseSAHSplitLocationAccurate(Array<Poly>& source, V
 
 
 float NativeTriTree::Node::SAHCost(int size, float area, float containingArea) {
-    static const float boxIntersectTime = 5;
-    static const float triIntersectTime = 1;
-    
     if (size == 0) {
         return 0;
     } else {
@@ -402,8 +588,8 @@ float NativeTriTree::Node::SAHCost(int size, float area, float containingArea) {
 
 
 float NativeTriTree::Node::SAHCost(Vector3::Axis axis, float offset, const Array<Poly>& original, float containingArea, const Settings& settings) {
-    // TODO: pass these arrays in for thread-safing
-    static Array<Poly> lowArray, highArray, spanArray;
+    // Per-thread because subtrees may be built concurrently
+    static thread_local Array<Poly> lowArray, highArray, spanArray;
     
     lowArray.fastClear();
     highArray.fastClear();
@@ -420,14 +606,13 @@ float NativeTriTree::Node::SAHCost(Vector3::Axis axis, float offset, const Array
 }
 
 
-static bool rayTriangleIntersection
-   (const PrecomputedRay&                         ray,
+bool NativeTriTree::rayTriangleIntersection
+   (const PrecomputedRay&              ray,
     float                              minDistance,
     float                              maxDistance,
-    const Tri&                         tri,
-    const CPUVertexArray&              vertexArray,
-    TriTree::Hit&                  hitData,
-    TriTree::IntersectRayOptions   options) {
+    const FlatTriBlock&                block,
+    Hit&                               hitData,
+    IntersectRayOptions                options) const {
     
     // See RTR3 p.746 (RTR2 ch. 13.7) for the basic algorithm used in this function.
 
@@ -436,165 +621,336 @@ static bool rayTriangleIntersection
     // How much to grow the edges of triangles by to allow for small roundoff.
     static const float conservative = 1e-8f;
 
-    // Get all vertex attributes from these to avoid unneccessary pointer indirection
-    const CPUVertexArray::Vertex& vertex0 = tri.vertex(vertexArray, 0);
-    const CPUVertexArray::Vertex& vertex1 = tri.vertex(vertexArray, 1);
-    const CPUVertexArray::Vertex& vertex2 = tri.vertex(vertexArray, 2);
-    
-    const Vector3& v0 = vertex0.position;
-    const Vector3& e1 = vertex1.position - v0;
-    const Vector3& e2 = vertex2.position - v0;
+    const bool  noBackfaceTest = (options & NativeTriTree::DO_NOT_CULL_BACKFACES) != 0;
+    const bool  alphaTest      = ((options & NativeTriTree::NO_PARTIAL_COVERAGE_TEST) == 0);
+    const float alphaThreshold = ((options & NativeTriTree::PARTIAL_COVERAGE_THRESHOLD_ZERO) != 0) ? 1.0f : 0.5f;
 
-    const bool noBackfaceTest = (options & NativeTriTree::DO_NOT_CULL_BACKFACES) != 0;
+    // Barycentrics, distance, and determinant of each lane, valid where
+    // the bit of hitMask is set
+    alignas(16) float laneU[FlatTriBlock::SIZE], laneV[FlatTriBlock::SIZE], laneT[FlatTriBlock::SIZE], laneA[FlatTriBlock::SIZE];
+    int hitMask = 0;
 
-    // This test is equivalent to n.dot(ray.direction()) >= -EPS
-    // Where n is the face unit normal, which we do not explicitly store
-    // The first two check whether we should treat the tri as double sided
-    if (! (noBackfaceTest || tri.twoSided()) && (tri.area() >= 0) && (e1.cross(e2)).dot(ray.direction()) >= -EPS * 2.0f * tri.area()) {
-        // Backface or nearly parallel
-        return false;
+#   ifdef G3D_X86
+    {
+        // Moller-Trumbore against all lanes at once. Unused lanes have zero
+        // edges, so their determinant fails the EPS test.
+        const Vector3& direction = ray.direction();
+        const __m128 d[3] = {_mm_set1_ps(direction.x), _mm_set1_ps(direction.y), _mm_set1_ps(direction.z)};
+        const __m128 e1[3] = {_mm_load_ps(block.e1[0]), _mm_load_ps(block.e1[1]), _mm_load_ps(block.e1[2])};
+        const __m128 e2[3] = {_mm_load_ps(block.e2[0]), _mm_load_ps(block.e2[1]), _mm_load_ps(block.e2[2])};
+
+        __m128 valid = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+        if (! noBackfaceTest) {
+            // n.dot(d) >= -EPS * |n| is a backface or nearly parallel, where
+            // |n| = 2 * area. Two-sided lanes are exempt.
+            const __m128 n[3] = {
+                _mm_sub_ps(_mm_mul_ps(e1[1], e2[2]), _mm_mul_ps(e1[2], e2[1])),
+                _mm_sub_ps(_mm_mul_ps(e1[2], e2[0]), _mm_mul_ps(e1[0], e2[2])),
+                _mm_sub_ps(_mm_mul_ps(e1[0], e2[1]), _mm_mul_ps(e1[1], e2[0]))};
+            const __m128 nDotD = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], d[0]), _mm_mul_ps(n[1], d[1])), _mm_mul_ps(n[2], d[2]));
+            const __m128 nLength = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], n[0]), _mm_mul_ps(n[1], n[1])), _mm_mul_ps(n[2], n[2])));
+            const __m128i twoSidedBit = _mm_set1_epi32(FlatTriBlock::TWO_SIDED);
+            const __m128 twoSided = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_load_si128((const __m128i*)block.data), twoSidedBit), twoSidedBit));
+            valid = _mm_or_ps(twoSided, _mm_cmplt_ps(nDotD, _mm_mul_ps(_mm_set1_ps(-EPS), nLength)));
+
+            if (_mm_movemask_ps(valid) == 0) {
+                return false;
+            }
+        }
+
+        // p = d x e2
+        const __m128 p[3] = {
+            _mm_sub_ps(_mm_mul_ps(d[1], e2[2]), _mm_mul_ps(d[2], e2[1])),
+            _mm_sub_ps(_mm_mul_ps(d[2], e2[0]), _mm_mul_ps(d[0], e2[2])),
+            _mm_sub_ps(_mm_mul_ps(d[0], e2[1]), _mm_mul_ps(d[1], e2[0]))};
+
+        const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1[0], p[0]), _mm_mul_ps(e1[1], p[1])), _mm_mul_ps(e1[2], p[2]));
+        const __m128 f = _mm_div_ps(_mm_set1_ps(1.0f), a);
+        const __m128 c = _mm_mul_ps(_mm_set1_ps(conservative), f);
+
+        const Vector3& origin = ray.origin();
+        const __m128 s[3] = {
+            _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(origin.x), _mm_load_ps(block.v0[0])), f),
+            _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(origin.y), _mm_load_ps(block.v0[1])), f),
+            _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(origin.z), _mm_load_ps(block.v0[2])), f)};
+
+        const __m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s[0], p[0]), _mm_mul_ps(s[1], p[1])), _mm_mul_ps(s[2], p[2]));
+
+        // q = s x e1
+        const __m128 q[3] = {
+            _mm_sub_ps(_mm_mul_ps(s[1], e1[2]), _mm_mul_ps(s[2], e1[1])),
+            _mm_sub_ps(_mm_mul_ps(s[2], e1[0]), _mm_mul_ps(s[0], e1[2])),
+            _mm_sub_ps(_mm_mul_ps(s[0], e1[1]), _mm_mul_ps(s[1], e1[0]))};
+
+        const __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], q[0]), _mm_mul_ps(d[1], q[1])), _mm_mul_ps(d[2], q[2]));
+        const __m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2[0], q[0]), _mm_mul_ps(e2[1], q[1])), _mm_mul_ps(e2[2], q[2]));
+
+        const __m128 negC     = _mm_sub_ps(_mm_setzero_ps(), c);
+        const __m128 onePlusC = _mm_add_ps(_mm_set1_ps(1.0f), c);
+        const __m128 absA     = _mm_max_ps(a, _mm_sub_ps(_mm_setzero_ps(), a));
+
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(u, negC));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(u, onePlusC));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(v, negC));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), onePlusC));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(absA, _mm_set1_ps(EPS)));
+        valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, _mm_set1_ps(minDistance)));
+        valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(maxDistance)));
+
+        hitMask = _mm_movemask_ps(valid);
+        if (hitMask == 0) {
+            return false;
+        }
+
+        _mm_store_ps(laneU, u);
+        _mm_store_ps(laneV, v);
+        _mm_store_ps(laneT, t);
+        _mm_store_ps(laneA, a);
     }
+#   else
+        for (int lane = 0; lane < FlatTriBlock::SIZE; ++lane) {
+            if (! block.used(lane)) {
+                continue;
+            }
 
-    const Vector3& p = ray.direction().cross(e2);
+            const Vector3& v0 = block.vertex0(lane);
+            const Vector3& e1 = block.edge1(lane);
+            const Vector3& e2 = block.edge2(lane);
+
+            // This test is equivalent to n.dot(ray.direction()) >= -EPS
+            // Where n is the face unit normal, which we do not explicitly store
+            if (! (noBackfaceTest || ((block.flags(lane) & FlatTriBlock::TWO_SIDED) != 0))) {
+                const Vector3& n = e1.cross(e2);
+                if (n.dot(ray.direction()) >= -EPS * n.length()) {
+                    // Backface or nearly parallel
+                    continue;
+                }
+            }
 
-    // Will be negative if we are coming from the back.
-    const float a = e1.dot(p);
+            const Vector3& p = ray.direction().cross(e2);
 
-    // Divide by a
-    const float f = 1.0f / a;
-    const float c = conservative * f;
+            // Will be negative if we are coming from the back.
+            const float a = e1.dot(p);
 
-    const Vector3& s = (ray.origin() - v0) * f;
-    const float u = s.dot(p);
+            // Divide by a
+            const float f = 1.0f / a;
+            const float c = conservative * f;
 
-    // Note: (ua > a) == (u > 1). Delaying the division by a until
-    // after all u-v tests have passed gives a 6% speedup.
-    if ((u < -c) || (u > 1 + c)) {
-        // We hit the plane of the triangle, but outside the triangle
-        return false;
-    }
+            const Vector3& s = (ray.origin() - v0) * f;
+            const float u = s.dot(p);
 
-    const Vector3& q = s.cross(e1);
-    const float v = ray.direction().dot(q);
+            if ((u < -c) || (u > 1 + c)) {
+                // We hit the plane of the triangle, but outside the triangle
+                continue;
+            }
 
-    if ((v < -c) || ((u + v) > 1.0f + c) || (abs(a) < EPS)) {
-        // We hit the plane of the triangle, but outside the triangle...
-        // OR        
-        // this ray was parallel, but passed the backface test. This case happens really infrequently.
-        return false;
-    }
+            const Vector3& q = s.cross(e1);
+            const float v = ray.direction().dot(q);
+
+            if ((v < -c) || ((u + v) > 1.0f + c) || (abs(a) < EPS)) {
+                // We hit the plane of the triangle, but outside the triangle...
+                // OR        
+                // this ray was parallel, but passed the backface test. This case happens really infrequently.
+                continue;
+            }
     
-    const float t = e2.dot(q);
+            const float t = e2.dot(q);
+            if ((t > minDistance) && (t < maxDistance)) {
+                laneU[lane] = u;
+                laneV[lane] = v;
+                laneT[lane] = t;
+                laneA[lane] = a;
+                hitMask |= 1 << lane;
+            }
+        }
+#   endif
 
-    if ((t > minDistance) && (t < maxDistance)) {
-        const bool alphaTest = ((options & NativeTriTree::NO_PARTIAL_COVERAGE_TEST) == 0);
-        const float alphaThreshold = ((options & NativeTriTree::PARTIAL_COVERAGE_THRESHOLD_ZERO) != 0) ? 1.0f : 0.5f;
+    // Keep the closest lane that passes the alpha test
+    bool anyHit = false;
+    for (int lane = 0; lane < FlatTriBlock::SIZE; ++lane) {
+        if (((hitMask & (1 << lane)) == 0) || (laneT[lane] >= maxDistance)) {
+            continue;
+        }
 
-        if (alphaTest && ! tri.intersectionAlphaTest(vertexArray, u, v, alphaThreshold)) {
+        const int triIndex = block.triIndex(lane);
+        if (alphaTest && ((block.flags(lane) & FlatTriBlock::HAS_PARTIAL_COVERAGE) != 0) &&
+            ! passesAlphaTest(triIndex, laneU[lane], laneV[lane], alphaThreshold)) {
             // Failed the filter (e.g., alpha test)
-            return false;
-        } else {
+            continue;
+        }
+
+        // This is a new hit.  Save away the data about the hit
+        // location (including if we hit the backside), but don't bother computing barycentric w,
+        // the hit location or the normal until after we've checked
+        // against all triangles.
+        hitData.triIndex = triIndex;
+        hitData.distance = laneT[lane];
+        hitData.u        = laneU[lane];
+        hitData.v        = laneV[lane];
+        hitData.backface = (laneA[lane] < 0);
+        maxDistance      = laneT[lane];
+        anyHit           = true;
+    }
+
+    return anyHit;
+}
+
+
+bool NativeTriTree::passesAlphaTest(int triIndex, float u, float v, float threshold) const {
+    const Material* material = triMaterial(triIndex);
+    if (isNull(material)) {
+        return true;
+    }
+
+    const Tri& tri = m_triArray[triIndex];
+    const float w = 1.0f - u - v;
+    const Point2& texCoord =
+        w * tri.texCoord(m_vertexArray, 0) +
+        u * tri.texCoord(m_vertexArray, 1) +
+        v * tri.texCoord(m_vertexArray, 2);
+
+    return ! material->coverageLessThanEqual(threshold, texCoord);
+}
+
 
-            // This is a new hit.  Save away the data about the hit
-            // location (including if we hit the backside), but don't bother computing barycentric w,
-            // the hit location or the normal until after we've checked
-            // against all triangles.
-            // The triangle index will be filled in by the caller
-            hitData.distance = t;
-            hitData.u = u;
-            hitData.v = v;
-            hitData.backface = (a < 0);
-            return true;
+void NativeTriTree::updateMaterialTable() {
+    m_materialTable.fastClear();
+    m_triMaterial.resize(m_triArray.size());
+
+    // Resolve each distinct data pointer once. Consecutive Tris usually come
+    // from the same Surface, so most need no table lookup at all.
+    Table<const ReferenceCountedObject*, int> dataIndex;
+    Table<const Material*, int>               materialIndex;
+    const ReferenceCountedObject*             lastData  = nullptr;
+    int                                       lastIndex = -1;
+
+    for (int t = 0; t < m_triArray.size(); ++t) {
+        const Tri& tri = m_triArray[t];
+        const ReferenceCountedObject* data = tri.m_data.get();
+        if ((lastIndex == -1) || (data != lastData)) {
+            bool created = false;
+            int& index = dataIndex.getCreate(data, created);
+            if (created) {
+                const shared_ptr<Material>& material = tri.material();
+                bool materialCreated = false;
+                int& m = materialIndex.getCreate(material.get(), materialCreated);
+                if (materialCreated) {
+                    m = m_materialTable.size();
+                    m_materialTable.append(material);
+                }
+                index = m;
+            }
+            lastData  = data;
+            lastIndex = index;
         }
-    } else {
-        return false;
+        m_triMaterial[t] = lastIndex;
     }
 }
 
 
-bool NativeTriTree::Node::intersectRay
-   (const NativeTriTree&                     triTree,
-    const PrecomputedRay&                         ray,
-    float                              maxDistance,
-    Hit&                               hitData,
-    IntersectRayOptions                options) const {
-        
-    // Don't bother paying the bounding box intersection at
-    // leaves, since we have to pay it again below.
-    if (! isLeaf() && ! intersect(ray, bounds, maxDistance)) {
-        // The ray doesn't hit this node, so it can't hit the
-        // children of the node either--stop searching.
-        return false;
+void NativeTriTree::Node::flatten
+   (const NativeTriTree&               triTree,
+    Array<FlatNode>&                   nodeArray,
+    Array<FlatTriBlock>&               blockArray) const {
+
+    const int index = nodeArray.size();
+    FlatNode& flat = nodeArray.next();
+    flat.low             = bounds.low();
+    flat.high            = bounds.high();
+    flat.splitLocation   = splitLocation;
+    flat.secondChildAxis = 0;
+    flat.firstTriBlock   = blockArray.size();
+    flat.numTriBlocks    = 0;
+    flat.triLow          = Vector3::zero();
+    flat.triHigh         = Vector3::zero();
+
+    if (valueArray) {
+        flat.numTriBlocks = (valueArray->size + FlatTriBlock::SIZE - 1) / FlatTriBlock::SIZE;
+        flat.triLow       = valueArray->bounds.low();
+        flat.triHigh      = valueArray->bounds.high();
+
+        for (int v = 0; v < valueArray->size; ++v) {
+            const int lane = v % FlatTriBlock::SIZE;
+            if (lane == 0) {
+                blockArray.next().clear();
+            }
+
+            // Pointer arithmetic to find what index in the tri tree array this triangle was.
+            const int triIndex = int(valueArray->data[v] - triTree.m_triArray.getCArray());
+            blockArray.last().set(lane, *(valueArray->data[v]), triIndex, triTree.m_vertexArray);
+        }
     }
-    
-    enum {NONE = -1};
-    
-    const Vector3::Axis axis = splitAxis();
 
-    int firstChild = NONE, secondChild = NONE;
     if (! isLeaf()) {
-        computeTraversalOrder(ray, firstChild, secondChild);
+        child(0).flatten(triTree, nodeArray, blockArray);
+
+        // nodeArray may have been reallocated, so flat is no longer valid
+        const int secondChild = nodeArray.size();
+        nodeArray[index].secondChildAxis = (uint32(secondChild) << 2) | uint32(splitAxis());
+        child(1).flatten(triTree, nodeArray, blockArray);
     }
-    
-    bool hit = false;
-    // Test on the side closer to the ray origin.
-    if (firstChild != NONE) {
-        hit = child(firstChild).intersectRay(triTree, ray, maxDistance, hitData, options) || hit;
-        if (((options & OCCLUSION_TEST_ONLY) != 0) && hit) {
-            return true;
-        } else if (hit) {
-            maxDistance = hitData.distance;
+}
+
+
+void NativeTriTree::FlatTriBlock::clear() {
+    System::memset(this, 0, sizeof(FlatTriBlock));
+    for (int lane = 0; lane < SIZE; ++lane) {
+        data[lane] = UNUSED;
+    }
+}
+
+
+void NativeTriTree::FlatTriBlock::set(int lane, const Tri& tri, int index, const CPUVertexArray& vertexArray) {
+    debugAssertM(uint32(index) < (UNUSED >> FLAG_BITS), "Too many Tris for FlatTriBlock::data");
+    const Vector3& p0    = tri.vertex(vertexArray, 0).position;
+    const Vector3& edge1 = tri.vertex(vertexArray, 1).position - p0;
+    const Vector3& edge2 = tri.vertex(vertexArray, 2).position - p0;
+    for (int a = 0; a < 3; ++a) {
+        v0[a][lane] = p0[a];
+        e1[a][lane] = edge1[a];
+        e2[a][lane] = edge2[a];
+    }
+    data[lane] = (uint32(index) << FLAG_BITS) |
+        (tri.twoSided() ? TWO_SIDED : 0) | (tri.hasPartialCoverage() ? HAS_PARTIAL_COVERAGE : 0);
+}
+
+
+void NativeTriTree::Node::refit(const CPUVertexArray& vertexArray, int parallelDepth) {
+    if (! isLeaf()) {
+        if (parallelDepth > 0) {
+            runConcurrently(0, 2, [&](int c) { child(c).refit(vertexArray, parallelDepth - 1); });
+        } else {
+            child(0).refit(vertexArray, 0);
+            child(1).refit(vertexArray, 0);
         }
     }
-    
-    // Test the contents of the node. If the value array is
-    // really small, don't waste time on the bounds
-    // intersection, just run the ray-triangle intersection.
-    if (valueArray &&
-        (valueArray->size > 0) && 
-        intersect(ray, valueArray->bounds, maxDistance)) {
-
-        // Test for intersection against every object at this node.
-        for (int v = 0; v < valueArray->size; ++v) { 
-            const Tri& tri = *(valueArray->data[v]);
-            const bool justHit = rayTriangleIntersection(ray, ray.minDistance(), maxDistance, tri, triTree.m_vertexArray, hitData, options);
-            
-            if (justHit) {
-                hit = true;
-                // Pointer arithmetic to find what index in the tri tree array this triangle was.
-                // The data array is a set of pointers into the triArray.
-                hitData.triIndex = int(valueArray->data[v] - triTree.m_triArray.getCArray());
-
-                if ((options & OCCLUSION_TEST_ONLY) != 0) {
-                    return true;
-                } else {
-                    maxDistance = hitData.distance;
-                }
+
+    Vector3 lo = Vector3::inf();
+    Vector3 hi = -Vector3::inf();
+
+    // Whole triangles, since the polygons that they were clipped to when
+    // building no longer correspond to the moved geometry
+    if (valueArray) {
+        for (int v = 0; v < valueArray->size; ++v) {
+            const Tri* tri = valueArray->data[v];
+            for (int i = 0; i < 3; ++i) {
+                const Vector3& p = tri->position(vertexArray, i);
+                lo = lo.min(p);
+                hi = hi.max(p);
             }
-        }        
+        }
+        valueArray->bounds = AABox(lo, hi);
     }
-    
-    // Test on the side farther from the ray origin.
-    if (secondChild != NONE) {
-        
-        if (ray.direction()[axis] != 0.0f) {
-            // See if there was an intersection before hitting the splitting plane.  
-            // If so, there is no need to look on the far side and recursion terminates. 
-            // This test makes about a factor of two improvement in performance.
-            const float distanceToSplittingPlane = (splitLocation - ray.origin()[axis]) * ray.invDirection()[axis];
-
-            if (distanceToSplittingPlane > maxDistance) {
-                // We aren't going to hit anything else before hitting the splitting plane,
-                // so don't bother looking on the far side of the splitting plane at the other
-                // child.
-                return hit;
-            }
+
+    if (! isLeaf()) {
+        for (int c = 0; c < 2; ++c) {
+            lo = lo.min(child(c).bounds.low());
+            hi = hi.max(child(c).bounds.high());
         }
-        
-        hit = child(secondChild).intersectRay(triTree, ray, maxDistance, hitData, options) || hit;
     }
 
-    return hit;
+    bounds = AABox(lo, hi);
 }
 
 
@@ -629,62 +985,6 @@ static void draw(RenderDevice* rd, const AABox& m_box, const Color4& color) {
 #endif
 
 
-void NativeTriTree::Node::intersectSphere(const Sphere& sphere, const CPUVertexArray& vertexArray, Array<Tri>& triArray, Set<Tri*>& alreadyAdded) const {
-    if (! bounds.intersects(sphere)) {
-        return;
-    }
-
-    // Add the triangles at this node
-    if (valueArray && valueArray->bounds.intersects(sphere)) {
-        for (int v = 0; v < valueArray->size; ++v) {
-            Tri* tri = const_cast<Tri*>(valueArray->data[v]);
-            if (! alreadyAdded.contains(tri)) {
-                if ((tri->area() > 0) && CollisionDetection::fixedSolidSphereIntersectsFixedTriangle(sphere, Triangle(tri->position(vertexArray, 0), 
-                                                                                       tri->position(vertexArray, 1), tri->position(vertexArray, 2)))) {
-                    triArray.append(*tri);
-                    alreadyAdded.insert(tri);
-                }
-            }
-        }
-    }
-
-    // Recurse into children
-    if (! isLeaf()) {
-        for (int c = 0; c < 2; ++c) {
-            child(c).intersectSphere(sphere, vertexArray, triArray, alreadyAdded);
-        }
-    }
-}
-
-
-void NativeTriTree::Node::intersectBox(const AABox& box,  const CPUVertexArray& vertexArray, Array<Tri>& triArray, Set<Tri*>& alreadyAdded) const {
-    if (! bounds.intersects(box)) {
-        return;
-    }
-
-    // Add the triangles at this node
-    if (valueArray && valueArray->bounds.intersects(box)) {
-        for (int v = 0; v < valueArray->size; ++v) {
-            Tri* tri = const_cast<Tri*>(valueArray->data[v]);
-            if (! alreadyAdded.contains(tri)) {
-                if ((tri->area() > 0) && CollisionDetection::fixedSolidBoxIntersectsFixedTriangle(box, Triangle(tri->position(vertexArray, 0), 
-                                                                                 tri->position(vertexArray, 1), tri->position(vertexArray, 2)))) {
-                    triArray.append(*tri);
-                    alreadyAdded.insert(tri);
-                }
-            }
-        }
-    }
-
-    // Recurse into children
-    if (! isLeaf()) {
-        for (int c = 0; c < 2; ++c) {
-            child(c).intersectBox(box, vertexArray, triArray, alreadyAdded);
-        }
-    }
-}
-
-
 void NativeTriTree::Node::draw(RenderDevice* rd, const CPUVertexArray& vertexArray, int level, bool showBoxes, int minNodeSize) const {
     /*
     if (valueArray && (valueArray->size > minNodeSize)) {
@@ -749,9 +1049,16 @@ void NativeTriTree::Node::print(const String& indent) const {
 }
 
 
-void NativeTriTree::Node::getStats(Stats& s, int level, int valuesPerNode) const {    
+void NativeTriTree::Node::getStats(Stats& s, int level, int valuesPerNode, float rootArea) const {    
     int n = (valueArray) ? valueArray->size : 0;
     s.numTris += n;
+
+    if (level == 0) {
+        rootArea = max(bounds.area(), 1e-10f);
+    }
+
+    // Probability that a ray which hits the root also hits this node, times the cost of testing it
+    s.sahCost += (bounds.area() / rootArea) * (boxIntersectTime + triIntersectTime * n);
     ++s.numNodes;
     s.depth = max(s.depth, level);
     s.largestNode = max(s.largestNode, n);
@@ -766,13 +1073,267 @@ void NativeTriTree::Node::getStats(Stats& s, int level, int valuesPerNode) const
         s.shallowestLeaf = min(s.shallowestLeaf, level);
     } else {
         for (int c = 0; c < 2; ++c) {
-            child(c).getStats(s, level + 1, valuesPerNode);
+            child(c).getStats(s, level + 1, valuesPerNode, rootArea);
         }
     }            
 }
 
 
-NativeTriTree::NativeTriTree() : m_root(nullptr) {}
+NativeTriTree::NativeTriTree() :
+    m_root(nullptr),
+    m_flatNode(nullptr),
+    m_numFlatNodes(0),
+    m_flatTriBlock(nullptr),
+    m_numFlatTriBlocks(0),
+    m_buildDuration(0),
+    m_numRefits(0),
+    m_refit(false) {}
+
+
+void NativeTriTree::freeFlatTree() {
+    if (m_mappedFile) {
+        // load() pointed the flat arrays into the file
+        m_mappedFile.reset();
+    } else {
+        System::alignedFree(m_flatNode);
+        System::alignedFree(m_flatTriBlock);
+    }
+    m_flatNode         = nullptr;
+    m_flatTriBlock     = nullptr;
+    m_numFlatNodes     = 0;
+    m_numFlatTriBlocks = 0;
+}
+
+
+void NativeTriTree::flatten() {
+    freeFlatTree();
+
+    if (isNull(m_root)) {
+        return;
+    }
+
+    Array<FlatNode>     nodeArray;
+    Array<FlatTriBlock> blockArray;
+    m_root->flatten(*this, nodeArray, blockArray);
+
+    // Copy to cache-line aligned memory, since Array only guarantees 16-byte alignment
+    static const size_t cacheLineSize = 64;
+    static_assert(sizeof(FlatNode) == cacheLineSize, "FlatNode must occupy exactly one cache line");
+    m_numFlatNodes = nodeArray.size();
+    m_flatNode     = static_cast<FlatNode*>(System::alignedMalloc(sizeof(FlatNode) * m_numFlatNodes, cacheLineSize));
+    System::memcpy(m_flatNode, nodeArray.getCArray(), sizeof(FlatNode) * m_numFlatNodes);
+
+    static_assert(sizeof(FlatTriBlock) == 40 * FlatTriBlock::SIZE, "FlatTriBlock must not be padded");
+    m_numFlatTriBlocks = blockArray.size();
+    if (m_numFlatTriBlocks > 0) {
+        m_flatTriBlock = static_cast<FlatTriBlock*>(System::alignedMalloc(sizeof(FlatTriBlock) * m_numFlatTriBlocks, cacheLineSize));
+        System::memcpy(m_flatTriBlock, blockArray.getCArray(), sizeof(FlatTriBlock) * m_numFlatTriBlocks);
+    }
+}
+
+
+void NativeTriTree::refitFlat(int index, int end) {
+    FlatNode& node = m_flatNode[index];
+
+    Vector3 lo = Vector3::inf();
+    Vector3 hi = -Vector3::inf();
+
+    for (uint32 b = node.firstTriBlock; b < node.firstTriBlock + node.numTriBlocks; ++b) {
+        FlatTriBlock& block = m_flatTriBlock[b];
+        for (int lane = 0; lane < FlatTriBlock::SIZE; ++lane) {
+            if (block.used(lane)) {
+                const int t = block.triIndex(lane);
+                block.set(lane, m_triArray[t], t, m_vertexArray);
+                const Vector3& p0 = block.vertex0(lane);
+                const Vector3& p1 = p0 + block.edge1(lane);
+                const Vector3& p2 = p0 + block.edge2(lane);
+                lo = lo.min(p0).min(p1).min(p2);
+                hi = hi.max(p0).max(p1).max(p2);
+            }
+        }
+    }
+
+    if (node.numTriBlocks > 0) {
+        node.triLow  = lo;
+        node.triHigh = hi;
+    }
+
+    if (! node.isLeaf()) {
+        const int secondChild = node.secondChild();
+        if (end - index >= parallelRefitNodes) {
+            runConcurrently(0, 2, [&](int c) {
+                if (c == 0) {
+                    refitFlat(index + 1, secondChild);
+                } else {
+                    refitFlat(secondChild, end);
+                }
+            });
+        } else {
+            refitFlat(index + 1, secondChild);
+            refitFlat(secondChild, end);
+        }
+
+        lo = lo.min(m_flatNode[index + 1].low).min(m_flatNode[secondChild].low);
+        hi = hi.max(m_flatNode[index + 1].high).max(m_flatNode[secondChild].high);
+    }
+
+    node.low  = lo;
+    node.high = hi;
+}
+
+
+void NativeTriTree::refit() {
+    if (m_numFlatNodes == 0) {
+        return;
+    }
+
+    // After load() there is only the flattened tree
+    if (notNull(m_root)) {
+        m_root->refit(m_vertexArray, parallelRefitDepth);
+    }
+    refitFlat(0, m_numFlatNodes);
+    m_refit = true;
+    ++m_numRefits;
+
+    m_lastBuildTime = System::time();
+}
+
+
+void NativeTriTree::findSurfaceGroups(const Array<shared_ptr<Surface>>& surfaceArray, Array<SurfaceGroup>& groupArray) {
+    groupArray.fastClear();
+
+    shared_ptr<Entity> current;
+    for (int s = 0; s < surfaceArray.size(); ++s) {
+        const shared_ptr<Entity>& entity = surfaceArray[s]->entity();
+        if ((groupArray.size() == 0) || (entity != current)) {
+            current = entity;
+            SurfaceGroup& group = groupArray.next();
+            group.entity       = entity;
+            group.firstSurface = s;
+            group.numSurfaces  = 0;
+            group.firstTri     = 0;
+            group.numTris      = 0;
+            group.firstVertex  = 0;
+            group.numVertices  = 0;
+        }
+        ++groupArray.last().numSurfaces;
+    }
+}
+
+
+bool NativeTriTree::updateSurfaces
+   (const Array<shared_ptr<Surface>>&  surfaceArray,
+    const Array<SurfaceGroup>&         groupArray,
+    ImageStorage                       newStorage) {
+
+    if (groupArray.size() != m_surfaceGroup.size()) {
+        return false;
+    }
+
+    Array<int> changedArray;
+    for (int g = 0; g < groupArray.size(); ++g) {
+        const shared_ptr<Entity>& entity = groupArray[g].entity.lock();
+        if ((m_surfaceGroup[g].entity.lock() != entity) || (m_surfaceGroup[g].numSurfaces != groupArray[g].numSurfaces)) {
+            return false;
+        }
+
+        if (isNull(entity) || (entity->lastChangeTime() > m_lastBuildTime)) {
+            changedArray.append(g);
+        }
+    }
+
+    if (changedArray.size() == 0) {
+        return true;
+    }
+
+    const bool computePrevPosition = false;
+    Array<shared_ptr<Surface>> groupSurfaceArray;
+    CPUVertexArray             groupVertexArray;
+    Array<Tri>                 groupTriArray;
+
+    for (const int g : changedArray) {
+        const SurfaceGroup& group = m_surfaceGroup[g];
+
+        groupSurfaceArray.fastClear();
+        for (int s = 0; s < group.numSurfaces; ++s) {
+            groupSurfaceArray.append(surfaceArray[groupArray[g].firstSurface + s]);
+        }
+
+        groupVertexArray.clear();
+        groupTriArray.fastClear();
+        Surface::getTris(groupSurfaceArray, groupVertexArray, groupTriArray, computePrevPosition);
+
+        if ((groupTriArray.size() != group.numTris) || (groupVertexArray.size() != group.numVertices)) {
+            // The topology changed. The caller rebuilds everything, so the
+            // groups already replaced do not matter.
+            return false;
+        }
+        Surface::setStorage(groupSurfaceArray, newStorage);
+
+        // The tree holds pointers to the Tris, so overwrite them in place,
+        // offsetting the indices to the group's vertices
+        runConcurrently(0, group.numVertices, [&](int v) {
+            m_vertexArray.vertex[group.firstVertex + v] = groupVertexArray.vertex[v];
+        });
+
+        runConcurrently(0, group.numTris, [&](int t) {
+            Tri& tri = m_triArray[group.firstTri + t];
+            tri = groupTriArray[t];
+            for (int i = 0; i < 3; ++i) {
+                tri.index[i] += group.firstVertex;
+            }
+        });
+    }
+
+    // The new Tris may reference other Surfaces
+    updateMaterialTable();
+    refit();
+    return true;
+}
+
+
+void NativeTriTree::setContents
+   (const Array<shared_ptr<Surface>>&  surfaceArray,
+    ImageStorage                       newStorage) {
+
+    if (m_settings.instancing) {
+        clear();
+        setInstancedContents(surfaceArray, newStorage);
+        return;
+    }
+
+    Array<SurfaceGroup> groupArray;
+    findSurfaceGroups(surfaceArray, groupArray);
+
+    if (notNull(m_root) && (m_numRefits < m_settings.maxRefitsPerRebuild) &&
+        updateSurfaces(surfaceArray, groupArray, newStorage)) {
+        return;
+    }
+
+    // Extract each group separately to record where its triangles and
+    // vertices are. Surfaces of different Entitys therefore never share
+    // vertices, which they rarely could anyway.
+    const bool computePrevPosition = false;
+    clear();
+    Array<shared_ptr<Surface>> groupSurfaceArray;
+    for (SurfaceGroup& group : groupArray) {
+        groupSurfaceArray.fastClear();
+        for (int s = 0; s < group.numSurfaces; ++s) {
+            groupSurfaceArray.append(surfaceArray[group.firstSurface + s]);
+        }
+
+        group.firstTri    = m_triArray.size();
+        group.firstVertex = m_vertexArray.size();
+        Surface::getTris(groupSurfaceArray, m_vertexArray, m_triArray, computePrevPosition);
+        group.numTris     = m_triArray.size() - group.firstTri;
+        group.numVertices = m_vertexArray.size() - group.firstVertex;
+    }
+    Surface::setStorage(surfaceArray, newStorage);
+    m_sky = nullptr;
+    rebuild();
+
+    m_surfaceGroup = groupArray;
+}
 
 
 NativeTriTree::~NativeTriTree() {
@@ -783,8 +1344,9 @@ NativeTriTree::~NativeTriTree() {
 /** Walk the entire tree, computing statistics */
 NativeTriTree::Stats NativeTriTree::stats(int valuesPerNode) const {
     Stats s;
+    s.buildTime = m_buildDuration;
     if (m_root) {
-        m_root->getStats(s, 0, valuesPerNode);
+        m_root->getStats(s, 0, valuesPerNode, 0.0f);
         s.averageValuesPerLeaf /= s.numLeaves;
     } else {
         s.shallowestLeaf = 0;
@@ -796,6 +1358,14 @@ NativeTriTree::Stats NativeTriTree::stats(int valuesPerNode) const {
 
 void NativeTriTree::clear() {
     TriTreeBase::clear();
+    freeFlatTree();
+    m_surfaceGroup.fastClear();
+    m_prototypeArray.fastClear();
+    m_instanceArray.fastClear();
+    m_instanceNode.fastClear();
+    m_materialTable.fastClear();
+    m_triMaterial.fastClear();
+    m_overlapScratch.clear();
     if (m_root) {
         m_root->destroy(m_memoryManager);
         m_memoryManager->free(m_root);
@@ -826,8 +1396,109 @@ bool NativeTriTree::intersectRay
     Hit&                               hit,
     IntersectRayOptions                options) const {
 
+    if (m_instanceArray.size() > 0) {
+        return intersectInstances(ray, hit, options);
+    } else {
+        return intersectFlatTree(ray, hit, options);
+    }
+}
+
+
+bool NativeTriTree::intersectFlatTree
+   (const PrecomputedRay&              ray, 
+    Hit&                               hit,
+    IntersectRayOptions                options) const {
+
+    if (m_numFlatNodes == 0) {
+        return false;
+    }
+
+    const bool occlusionTestOnly = (options & OCCLUSION_TEST_ONLY) != 0;
     float maxDistance = ray.maxDistance();
-    return notNull(m_root) && m_root->intersectRay(*this, ray, maxDistance, hit, options);        
+    bool  anyHit = false;
+
+    // Second children that remain to be visited, with the distance along the ray to their
+    // splitting plane. At most one entry per level.
+    class StackEntry {
+    public:
+        int     node;
+        float   distanceToSplittingPlane;
+    };
+    SmallArray<StackEntry, 64> stack;
+
+    int current = 0;
+    while (true) {
+        const FlatNode& node = m_flatNode[current];
+        int next = -1;
+
+        // Don't bother paying the bounding box intersection at
+        // leaves, since we have to pay it again for the triangles.
+        if (node.isLeaf() || intersectBounds(ray, node.low, node.high, maxDistance)) {
+
+            // Test the contents of the node before either child. The
+            // hit returned is the same as for any other order, since
+            // maxDistance only decreases.
+            if ((node.numTriBlocks > 0) && intersectBounds(ray, node.triLow, node.triHigh, maxDistance)) {
+                const FlatTriBlock* block = m_flatTriBlock + node.firstTriBlock;
+                const FlatTriBlock* end   = block + node.numTriBlocks;
+                for (; block < end; ++block) {
+                    if (rayTriangleIntersection(ray, ray.minDistance(), maxDistance, *block, hit, options)) {
+                        anyHit = true;
+                        if (occlusionTestOnly) {
+                            return true;
+                        }
+                        maxDistance = hit.distance;
+                    }
+                }
+            }
+
+            if (! node.isLeaf()) {
+                enum {NONE = -1};
+                int firstChild = NONE, secondChild = NONE;
+                node.computeTraversalOrder(ray, firstChild, secondChild);
+
+                // The first child immediately follows its parent
+                const int childIndex[2] = {current + 1, node.secondChild()};
+
+                if (m_refit) {
+                    // The children may overlap the splitting plane, so always
+                    // visit both and rely on their boxes for culling
+                    if (firstChild == NONE) {
+                        firstChild = 0;
+                    }
+                    StackEntry entry;
+                    entry.node = childIndex[1 - firstChild];
+                    entry.distanceToSplittingPlane = -finf();
+                    stack.push(entry);
+                } else if (secondChild != NONE) {
+                    const Vector3::Axis axis = node.splitAxis();
+                    StackEntry entry;
+                    entry.node = childIndex[secondChild];
+                    entry.distanceToSplittingPlane = (ray.direction()[axis] != 0.0f) ?
+                        (node.splitLocation - ray.origin()[axis]) * ray.invDirection()[axis] : -finf();
+                    stack.push(entry);
+                }
+
+                if (firstChild != NONE) {
+                    next = childIndex[firstChild];
+                }
+            }
+        }
+
+        // Pop until reaching a child on whose side of the splitting plane
+        // something could still be hit
+        while ((next == -1) && (stack.size() > 0)) {
+            const StackEntry entry = stack.pop();
+            if (entry.distanceToSplittingPlane <= maxDistance) {
+                next = entry.node;
+            }
+        }
+
+        if (next == -1) {
+            return anyHit;
+        }
+        current = next;
+    }
 }
 
 
@@ -837,7 +1508,36 @@ void NativeTriTree::intersectRays
     IntersectRayOptions                 options) const {
 
     results.resize(rays.size());
-    runConcurrently(0, rays.size(), [&](int i) { intersectRay(rays[i], results[i], options); });
+
+    if (((options & REORDER_RAYS_HINT) != 0) && (rays.size() >= MIN_REORDER_RAYS)) {
+        // Trace the rays in sorted order, so that the contiguous ranges that
+        // each thread receives visit the same parts of the tree, and then
+        // scatter the hits back to the caller's order
+        Array<int> order;
+        computeRayOrder(rays, order);
+
+        Array<PrecomputedRay> sortedRays;
+        sortedRays.resize(rays.size());
+        runConcurrently(0, rays.size(), [&](int i) { sortedRays[i] = rays[order[i]]; });
+
+        Array<Hit> sortedResults;
+        intersectRays(sortedRays, sortedResults, options & ~REORDER_RAYS_HINT);
+
+        runConcurrently(0, rays.size(), [&](int i) { results[order[i]] = sortedResults[i]; });
+        return;
+    }
+
+    if (((options & COHERENT_RAY_HINT) != 0) && (m_instanceArray.size() == 0)) {
+        // Consecutive rays are usually neighboring pixels (e.g., PathTracer's
+        // row-major eye rays), so trace them in packets
+        const int numPackets = (rays.size() + PACKET_SIZE - 1) / PACKET_SIZE;
+        runConcurrently(0, numPackets, [&](int p) {
+            const int first = p * PACKET_SIZE;
+            intersectRayPacket(rays.getCArray() + first, min(PACKET_SIZE, rays.size() - first), results.getCArray() + first, options);
+        });
+    } else {
+        runConcurrently(0, rays.size(), [&](int i) { intersectRay(rays[i], results[i], options); });
+    }
 }
 
 
@@ -850,7 +1550,7 @@ shared_ptr<Surfel> NativeTriTree::intersectRay
     Hit hit;
     if (intersectRay(ray, hit, options)) {
         shared_ptr<Surfel> surfel;
-        m_triArray[hit.triIndex].sample(hit.u, hit.v, hit.triIndex, m_vertexArray, hit.backface, surfel);
+        sample(hit, surfel);
         return surfel;
     } else {
         return nullptr;
@@ -885,7 +1585,7 @@ void NativeTriTree::intersectRays
     conversionTimer.tock();
     debugConversionOverheadTime = conversionTimer.elapsedTime();
 
-    runConcurrently(0, prays.size(), [&](int i) { intersectRay(prays[i], results[i], options); });
+    intersectRays(prays, results, options);
 }
 
 #ifdef _MSC_VER
@@ -0,0 +1,502 @@
+/**
+  \file G3D-app.lib/source/NativeTriTree_file.cpp
+
+  Saving and memory-mapping of built NativeTriTrees.
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#include "G3D-base/FileSystem.h"
+#include "G3D-base/Any.h"
+#include "G3D-app/NativeTriTree.h"
+#include "G3D-app/Scene.h"
+#include "G3D-app/UniversalSurface.h"
+#include "G3D-app/UniversalMaterial.h"
+
+#ifdef G3D_WINDOWS
+#   include <windows.h>
+#else
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+namespace G3D {
+
+namespace _internal {
+
+/** A whole file mapped copy-on-write. The pages are writable so that
+    NativeTriTree::refit() can update a loaded tree, but changes never
+    reach the file. */
+class MappedFile {
+private:
+    uint8*      m_data;
+    size_t      m_size;
+
+    MappedFile(uint8* data, size_t size) : m_data(data), m_size(size) {}
+
+public:
+
+    /** Returns nullptr if the file cannot be opened or mapped */
+    static shared_ptr<MappedFile> create(const String& filename) {
+#       ifdef G3D_WINDOWS
+            const HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE) {
+                return nullptr;
+            }
+
+            LARGE_INTEGER size;
+            if (! GetFileSizeEx(file, &size) || (size.QuadPart == 0)) {
+                CloseHandle(file);
+                return nullptr;
+            }
+
+            const HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+            CloseHandle(file);
+            if (isNull(mapping)) {
+                return nullptr;
+            }
+
+            // The view keeps the mapping alive
+            void* data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+            CloseHandle(mapping);
+            if (isNull(data)) {
+                return nullptr;
+            }
+
+            return shared_ptr<MappedFile>(new MappedFile((uint8*)data, size_t(size.QuadPart)));
+#       else
+            const int file = open(filename.c_str(), O_RDONLY);
+            if (file < 0) {
+                return nullptr;
+            }
+
+            struct stat status;
+            if ((fstat(file, &status) != 0) || (status.st_size == 0)) {
+                close(file);
+                return nullptr;
+            }
+
+            // The mapping outlives the descriptor
+            void* data = mmap(nullptr, size_t(status.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+            close(file);
+            if (data == MAP_FAILED) {
+                return nullptr;
+            }
+
+            return shared_ptr<MappedFile>(new MappedFile((uint8*)data, size_t(status.st_size)));
+#       endif
+    }
+
+    ~MappedFile() {
+#       ifdef G3D_WINDOWS
+            UnmapViewOfFile(m_data);
+#       else
+            munmap(m_data, m_size);
+#       endif
+    }
+
+    uint8* data() const {
+        return m_data;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+};
+
+
+/** Start of a file written by NativeTriTree::save(). Offsets are in bytes
+    from the start of the file, so it can be mapped at any address. */
+class TriTreeFileHeader {
+public:
+    char        magic[8];
+    int32       version;
+
+    /** Sizes of the stored structures, which depend on the compiler */
+    int32       sizeofFlatNode;
+    int32       sizeofFlatTriBlock;
+    int32       sizeofVertex;
+
+    uint64      specificationHash;
+    uint64      settingsHash;
+
+    int32       numFlatNodes;
+    int32       numFlatTriBlocks;
+    int32       refit;
+
+    int32       numTris;
+    int32       numVertices;
+    int32       hasTangent;
+    int32       hasTexCoord0;
+
+    int32       numMaterials;
+    int32       numSources;
+
+    uint64      flatNodeOffset;
+    uint64      flatTriBlockOffset;
+    uint64      triOffset;
+    uint64      vertexOffset;
+
+    /** Material names followed by source filenames, each an int32 length and then the characters */
+    uint64      stringOffset;
+    uint64      fileSize;
+};
+
+
+/** A Tri in the file, with its material as an index into the material names */
+class SavedTri {
+public:
+    uint32      index[3];
+    float       area;
+    uint32      flags;
+    int32       material;
+};
+
+} // namespace _internal
+
+static const char triTreeFileMagic[8] = {'G', '3', 'D', 'T', 'R', 'I', 'T', 'R'};
+
+/** Alignment of each array in the file. Matches the cache-line alignment of the flattened tree. */
+static const size_t fileSectionAlignment = 64;
+
+static size_t alignFileOffset(size_t offset) {
+    return (offset + fileSectionAlignment - 1) & ~(fileSectionAlignment - 1);
+}
+
+
+size_t NativeTriTree::settingsHash() const {
+    uint32 maxAreaFractionBits = 0;
+    System::memcpy(&maxAreaFractionBits, &m_settings.maxAreaFraction, sizeof(float));
+
+    size_t h = size_t(m_settings.algorithm);
+    h = h * 31 + size_t(maxAreaFractionBits);
+    h = h * 31 + size_t(m_settings.valuesPerLeaf);
+    h = h * 31 + size_t(m_settings.accurateSAHCountThreshold);
+    h = h * 31 + size_t(m_settings.numBins);
+    return h;
+}
+
+
+bool NativeTriTree::save
+   (const String&                      filename,
+    const Array<String>&               sourceFilenameArray,
+    size_t                             specificationHash) const {
+
+    alwaysAssertM(System::machineEndian() == G3DEndian::G3D_LITTLE_ENDIAN,
+        "Cannot save a NativeTriTree on a big endian machine");
+
+    if (m_instanceArray.size() > 0) {
+        return false;
+    }
+
+    // Materials are stored by name, so names must identify them
+    Array<String>           materialName;
+    Array<const Material*>  materialOfName;
+    Table<String, int>      materialIndex;
+    Array<_internal::SavedTri> savedTri;
+    savedTri.resize(m_triArray.size());
+    for (int t = 0; t < m_triArray.size(); ++t) {
+        const Tri& tri = m_triArray[t];
+        const shared_ptr<Material>& material = tri.material();
+        if (isNull(material) || material->name().empty()) {
+            return false;
+        }
+
+        bool created = false;
+        int& index = materialIndex.getCreate(material->name(), created);
+        if (created) {
+            index = materialName.size();
+            materialName.append(material->name());
+            materialOfName.append(material.get());
+        } else if (materialOfName[index] != material.get()) {
+            return false;
+        }
+
+        _internal::SavedTri& dst = savedTri[t];
+        dst.index[0] = tri.index[0];
+        dst.index[1] = tri.index[1];
+        dst.index[2] = tri.index[2];
+        dst.area     = tri.m_area;
+        dst.flags    = uint32(tri.m_flags);
+        dst.material = index;
+    }
+
+    Array<String> strings;
+    strings.append(materialName);
+    for (const String& source : sourceFilenameArray) {
+        strings.append(FileSystem::resolve(source));
+    }
+
+    _internal::TriTreeFileHeader header;
+    System::memset(&header, 0, sizeof(header));
+    System::memcpy(header.magic, triTreeFileMagic, sizeof(header.magic));
+    header.version            = FILE_FORMAT_VERSION;
+    header.sizeofFlatNode     = int32(sizeof(FlatNode));
+    header.sizeofFlatTriBlock = int32(sizeof(FlatTriBlock));
+    header.sizeofVertex       = int32(sizeof(CPUVertexArray::Vertex));
+    header.specificationHash  = uint64(specificationHash);
+    header.settingsHash       = uint64(settingsHash());
+    header.numFlatNodes       = m_numFlatNodes;
+    header.numFlatTriBlocks   = m_numFlatTriBlocks;
+    header.refit              = m_refit ? 1 : 0;
+    header.numTris            = m_triArray.size();
+    header.numVertices        = m_vertexArray.vertex.size();
+    header.hasTangent         = m_vertexArray.hasTangent ? 1 : 0;
+    header.hasTexCoord0       = m_vertexArray.hasTexCoord0 ? 1 : 0;
+    header.numMaterials       = materialName.size();
+    header.numSources         = sourceFilenameArray.size();
+
+    size_t offset = alignFileOffset(sizeof(header));
+    header.flatNodeOffset = offset;
+    offset = alignFileOffset(offset + sizeof(FlatNode) * m_numFlatNodes);
+    header.flatTriBlockOffset = offset;
+    offset = alignFileOffset(offset + sizeof(FlatTriBlock) * m_numFlatTriBlocks);
+    header.triOffset = offset;
+    offset = alignFileOffset(offset + sizeof(_internal::SavedTri) * savedTri.size());
+    header.vertexOffset = offset;
+    offset = alignFileOffset(offset + sizeof(CPUVertexArray::Vertex) * m_vertexArray.vertex.size());
+    header.stringOffset = offset;
+    for (const String& s : strings) {
+        offset += sizeof(int32) + s.size();
+    }
+    header.fileSize = offset;
+
+    FileSystem::createDirectory(FilePath::parent(filename));
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (isNull(file)) {
+        return false;
+    }
+
+    size_t written = 0;
+    bool ok = true;
+    const auto& write = [&](const void* data, size_t bytes) {
+        if (bytes > 0) {
+            ok = (fwrite(data, 1, bytes, file) == bytes) && ok;
+            written += bytes;
+        }
+    };
+    const auto& padTo = [&](size_t target) {
+        static const uint8 zero[fileSectionAlignment] = {};
+        debugAssert(target - written < fileSectionAlignment);
+        write(zero, target - written);
+    };
+
+    write(&header, sizeof(header));
+    padTo(size_t(header.flatNodeOffset));
+    write(m_flatNode, sizeof(FlatNode) * m_numFlatNodes);
+    padTo(size_t(header.flatTriBlockOffset));
+    write(m_flatTriBlock, sizeof(FlatTriBlock) * m_numFlatTriBlocks);
+    padTo(size_t(header.triOffset));
+    write(savedTri.getCArray(), sizeof(_internal::SavedTri) * savedTri.size());
+    padTo(size_t(header.vertexOffset));
+    write(m_vertexArray.vertex.getCArray(), sizeof(CPUVertexArray::Vertex) * m_vertexArray.vertex.size());
+    padTo(size_t(header.stringOffset));
+    for (const String& s : strings) {
+        const int32 length = int32(s.size());
+        write(&length, sizeof(length));
+        write(s.c_str(), s.size());
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    file = nullptr;
+
+    if (! ok) {
+        // Never leave a truncated file for load() to find
+        FileSystem::removeFile(filename);
+    }
+    return ok;
+}
+
+
+bool NativeTriTree::load
+   (const String&                      filename,
+    size_t                             specificationHash,
+    const Table<String, shared_ptr<Material>>& materialTable) {
+
+    alwaysAssertM(System::machineEndian() == G3DEndian::G3D_LITTLE_ENDIAN,
+        "Cannot load a NativeTriTree on a big endian machine");
+
+    const RealTime startTime = System::time();
+
+    if (! FileSystem::exists(filename)) {
+        return false;
+    }
+
+    const shared_ptr<_internal::MappedFile>& file = _internal::MappedFile::create(filename);
+    if (isNull(file) || (file->size() < sizeof(_internal::TriTreeFileHeader))) {
+        return false;
+    }
+
+    const _internal::TriTreeFileHeader& header = *reinterpret_cast<const _internal::TriTreeFileHeader*>(file->data());
+    if ((memcmp(header.magic, triTreeFileMagic, sizeof(header.magic)) != 0) ||
+        (header.version != FILE_FORMAT_VERSION) ||
+        (header.sizeofFlatNode != int32(sizeof(FlatNode))) ||
+        (header.sizeofFlatTriBlock != int32(sizeof(FlatTriBlock))) ||
+        (header.sizeofVertex != int32(sizeof(CPUVertexArray::Vertex))) ||
+        (header.specificationHash != uint64(specificationHash)) ||
+        (header.settingsHash != uint64(settingsHash())) ||
+        (header.fileSize != file->size())) {
+        debugPrintf("NativeTriTree::load: %s is out of date\n", filename.c_str());
+        return false;
+    }
+
+    // Guard against truncated or corrupt files before trusting any offset
+    const auto& fits = [&](uint64 offset, int32 count, size_t elementSize) {
+        return (count >= 0) && (offset <= header.fileSize) &&
+            (uint64(count) * elementSize <= header.fileSize - offset);
+    };
+    if (! fits(header.flatNodeOffset, header.numFlatNodes, sizeof(FlatNode)) ||
+        ! fits(header.flatTriBlockOffset, header.numFlatTriBlocks, sizeof(FlatTriBlock)) ||
+        ! fits(header.triOffset, header.numTris, sizeof(_internal::SavedTri)) ||
+        ! fits(header.vertexOffset, header.numVertices, sizeof(CPUVertexArray::Vertex)) ||
+        (header.numMaterials < 0) || (header.numSources < 0)) {
+        return false;
+    }
+
+    const uint8* data = file->data();
+    Array<String> strings;
+    size_t offset = size_t(header.stringOffset);
+    for (int i = 0; i < header.numMaterials + header.numSources; ++i) {
+        int32 length = 0;
+        if (offset + sizeof(length) > header.fileSize) {
+            return false;
+        }
+        System::memcpy(&length, data + offset, sizeof(length));
+        offset += sizeof(length);
+        if ((length < 0) || (offset + size_t(length) > header.fileSize)) {
+            return false;
+        }
+        strings.append(String((const char*)(data + offset), size_t(length)));
+        offset += size_t(length);
+    }
+
+    for (int i = header.numMaterials; i < strings.size(); ++i) {
+        const String& source = strings[i];
+        if (! FileSystem::exists(source) || FileSystem::isNewer(source, filename)) {
+            debugPrintf("NativeTriTree::load: %s is older than %s\n", filename.c_str(), source.c_str());
+            return false;
+        }
+    }
+
+    // Resolve every material before changing anything
+    Array<shared_ptr<Material>> material;
+    material.resize(header.numMaterials);
+    for (int m = 0; m < header.numMaterials; ++m) {
+        const shared_ptr<Material>* ptr = materialTable.getPointer(strings[m]);
+        if (isNull(ptr) || isNull(*ptr)) {
+            debugPrintf("NativeTriTree::load: no material named %s\n", strings[m].c_str());
+            return false;
+        }
+        material[m] = *ptr;
+    }
+
+    const _internal::SavedTri* savedTri = reinterpret_cast<const _internal::SavedTri*>(data + header.triOffset);
+    for (int t = 0; t < header.numTris; ++t) {
+        const _internal::SavedTri& src = savedTri[t];
+        if ((src.material < 0) || (src.material >= header.numMaterials) ||
+            (src.index[0] >= uint32(header.numVertices)) ||
+            (src.index[1] >= uint32(header.numVertices)) ||
+            (src.index[2] >= uint32(header.numVertices))) {
+            return false;
+        }
+    }
+
+    // Traversal trusts the split axes, child indices, and block ranges, so check them all.
+    // Children must follow their parent, which also rules out cycles.
+    const FlatNode* flatNode = reinterpret_cast<const FlatNode*>(data + header.flatNodeOffset);
+    for (int n = 0; n < header.numFlatNodes; ++n) {
+        const FlatNode& node = flatNode[n];
+        if ((uint64(node.firstTriBlock) + uint64(node.numTriBlocks) > uint64(header.numFlatTriBlocks)) ||
+            (! node.isLeaf() && (((node.secondChildAxis & 3) == 3) || (n + 1 >= header.numFlatNodes) ||
+                                (node.secondChild() <= n + 1) || (node.secondChild() >= header.numFlatNodes)))) {
+            debugPrintf("NativeTriTree::load: %s has an invalid node %d\n", filename.c_str(), n);
+            return false;
+        }
+    }
+
+    const FlatTriBlock* flatTriBlock = reinterpret_cast<const FlatTriBlock*>(data + header.flatTriBlockOffset);
+    for (int b = 0; b < header.numFlatTriBlocks; ++b) {
+        for (int lane = 0; lane < FlatTriBlock::SIZE; ++lane) {
+            if (flatTriBlock[b].used(lane) && (flatTriBlock[b].triIndex(lane) >= header.numTris)) {
+                debugPrintf("NativeTriTree::load: %s has an invalid triangle index in block %d\n", filename.c_str(), b);
+                return false;
+            }
+        }
+    }
+
+    clear();
+
+    m_vertexArray.vertex.resize(header.numVertices);
+    System::memcpy(m_vertexArray.vertex.getCArray(), data + header.vertexOffset, sizeof(CPUVertexArray::Vertex) * header.numVertices);
+    m_vertexArray.hasTangent   = (header.hasTangent != 0);
+    m_vertexArray.hasTexCoord0 = (header.hasTexCoord0 != 0);
+
+    // The Tris reference their Material directly because the Surfaces
+    // that produced them were never created
+    m_triArray.resize(header.numTris);
+    runConcurrently(0, header.numTris, [&](int t) {
+        const _internal::SavedTri& src = savedTri[t];
+        Tri& tri     = m_triArray[t];
+        tri.index[0] = src.index[0];
+        tri.index[1] = src.index[1];
+        tri.index[2] = src.index[2];
+        tri.m_area   = src.area;
+        tri.m_flags  = src.flags;
+        tri.m_data   = material[src.material];
+    });
+
+    updateMaterialTable();
+
+    m_mappedFile       = file;
+    m_flatNode         = reinterpret_cast<FlatNode*>(file->data() + header.flatNodeOffset);
+    m_flatTriBlock     = reinterpret_cast<FlatTriBlock*>(file->data() + header.flatTriBlockOffset);
+    m_numFlatNodes     = header.numFlatNodes;
+    m_numFlatTriBlocks = header.numFlatTriBlocks;
+    m_refit            = (header.refit != 0);
+    m_numRefits        = 0;
+    m_sky              = nullptr;
+
+    m_lastBuildTime = System::time();
+    m_buildDuration = m_lastBuildTime - startTime;
+
+    return true;
+}
+
+
+void NativeTriTree::setContents
+   (const shared_ptr<Scene>&           scene,
+    const String&                      cacheFilename,
+    ImageStorage                       newStorage) {
+
+    Array<shared_ptr<Surface>> surfaceArray;
+    scene->onPose(surfaceArray);
+
+    Table<String, shared_ptr<Material>> materialTable;
+    for (const shared_ptr<Surface>& surface : surfaceArray) {
+        const shared_ptr<UniversalSurface>& universalSurface = dynamic_pointer_cast<UniversalSurface>(surface);
+        if (notNull(universalSurface) && notNull(universalSurface->material())) {
+            materialTable.set(universalSurface->material()->name(), universalSurface->material());
+        }
+    }
+
+    const Any& specification = scene->toAny();
+    const size_t specificationHash = specification.hash();
+    Array<String> sourceFilenameArray;
+    if (! specification.source().filename.empty()) {
+        sourceFilenameArray.append(specification.source().filename);
+    }
+
+    if (load(cacheFilename, specificationHash, materialTable)) {
+        Surface::setStorage(surfaceArray, newStorage);
+        return;
+    }
+
+    setContents(surfaceArray, newStorage);
+    save(cacheFilename, sourceFilenameArray, specificationHash);
+}
+
+}
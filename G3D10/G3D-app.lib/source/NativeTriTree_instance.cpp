@@ -0,0 +1,360 @@
+/**
+  \file G3D-app.lib/source/NativeTriTree_instance.cpp
+
+  Two-level storage of instanced geometry for NativeTriTree::Settings::instancing.
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#include <algorithm>
+#include "G3D-base/Table.h"
+#include "G3D-app/NativeTriTree.h"
+#include "G3D-app/Surfel.h"
+#include "G3D-app/UniversalSurface.h"
+#include "G3D-app/UniversalMaterial.h"
+
+namespace G3D {
+
+namespace _internal {
+
+/** Identifies the surfaces that UniversalSurface::getTrisHomogeneous transforms
+    together: the same source vertex array in the same frame. Same as the
+    IndexOffsetTableKey of UniversalSurface.cpp. */
+class InstanceKey {
+public:
+    const CPUVertexArray*   vertexArray;
+    CFrame                  cFrame;
+
+    static size_t hashCode(const InstanceKey& key) {
+        const size_t cframeHash = key.cFrame.rotation.row(0).hashCode() + key.cFrame.rotation.row(1).hashCode() +
+                                  key.cFrame.rotation.row(2).hashCode() + key.cFrame.translation.hashCode();
+        return HashTrait<void*>::hashCode(key.vertexArray) + cframeHash;
+    }
+
+    static bool equals(const InstanceKey& a, const InstanceKey& b) {
+        return (a.vertexArray == b.vertexArray) && (a.cFrame == b.cFrame);
+    }
+};
+
+
+/** Identifies instances that can share one bottom-level tree: the same source
+    vertex array, and the same index array, material, and sidedness for each
+    of their surfaces, in order */
+class PrototypeKey {
+public:
+    class SurfaceKey {
+    public:
+        const Array<int>*   index;
+        const Material*     material;
+        bool                twoSided;
+    };
+
+    const CPUVertexArray*   vertexArray;
+    Array<SurfaceKey>       surfaceArray;
+
+    static size_t hashCode(const PrototypeKey& key) {
+        size_t h = HashTrait<void*>::hashCode(key.vertexArray);
+        for (const SurfaceKey& s : key.surfaceArray) {
+            h = h * 31 + HashTrait<void*>::hashCode(s.index) + HashTrait<void*>::hashCode(s.material);
+        }
+        return h;
+    }
+
+    static bool equals(const PrototypeKey& a, const PrototypeKey& b) {
+        if ((a.vertexArray != b.vertexArray) || (a.surfaceArray.size() != b.surfaceArray.size())) {
+            return false;
+        }
+        for (int s = 0; s < a.surfaceArray.size(); ++s) {
+            const SurfaceKey& x = a.surfaceArray[s];
+            const SurfaceKey& y = b.surfaceArray[s];
+            if ((x.index != y.index) || (x.material != y.material) || (x.twoSided != y.twoSided)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+}
+
+/** Instances per leaf of the top-level tree */
+static const int instancesPerLeaf = 2;
+
+
+void NativeTriTree::setInstancedContents
+   (const Array<shared_ptr<Surface>>&  surfaceArray,
+    ImageStorage                       newStorage) {
+
+    // Surfaces that are not instanced go into the world-space tree
+    Array<shared_ptr<Surface>> worldSurfaceArray;
+
+    // Group the UniversalSurfaces into instances
+    Table<_internal::InstanceKey, int, _internal::InstanceKey, _internal::InstanceKey> instanceTable;
+    Array<Array<shared_ptr<UniversalSurface>>> instanceSurfaceArray;
+    Array<CFrame> instanceFrame;
+
+    for (const shared_ptr<Surface>& surface : surfaceArray) {
+        const shared_ptr<UniversalSurface>& uniS = dynamic_pointer_cast<UniversalSurface>(surface);
+        if (isNull(uniS) || isNull(uniS->cpuGeom().vertexArray) || isNull(uniS->cpuGeom().index)) {
+            worldSurfaceArray.append(surface);
+            continue;
+        }
+
+        _internal::InstanceKey key;
+        key.vertexArray = uniS->cpuGeom().vertexArray;
+        key.cFrame      = uniS->frame();
+
+        bool created = false;
+        int& index = instanceTable.getCreate(key, created);
+        if (created) {
+            index = instanceSurfaceArray.size();
+            instanceSurfaceArray.next();
+            instanceFrame.append(key.cFrame);
+        }
+        instanceSurfaceArray[index].append(uniS);
+    }
+
+    // Find the instances that share geometry
+    Table<_internal::PrototypeKey, int, _internal::PrototypeKey, _internal::PrototypeKey> prototypeTable;
+    Array<int> instancePrototype;
+    Array<int> prototypeFirstInstance;
+    Array<int> prototypeNumInstances;
+    instancePrototype.resize(instanceSurfaceArray.size());
+
+    for (int i = 0; i < instanceSurfaceArray.size(); ++i) {
+        _internal::PrototypeKey key;
+        key.vertexArray = instanceSurfaceArray[i][0]->cpuGeom().vertexArray;
+        for (const shared_ptr<UniversalSurface>& surface : instanceSurfaceArray[i]) {
+            _internal::PrototypeKey::SurfaceKey& s = key.surfaceArray.next();
+            s.index    = surface->cpuGeom().index;
+            s.material = surface->material().get();
+            s.twoSided = surface->gpuGeom()->twoSided;
+        }
+
+        bool created = false;
+        int& p = prototypeTable.getCreate(key, created);
+        if (created) {
+            p = prototypeNumInstances.size();
+            prototypeFirstInstance.append(i);
+            prototypeNumInstances.append(0);
+        }
+        ++prototypeNumInstances[p];
+        instancePrototype[i] = p;
+    }
+
+    // Build one object-space tree per geometry that is placed more than
+    // once. Geometry placed once gains nothing from the indirection.
+    Array<int> prototypeTree;
+    prototypeTree.resize(prototypeNumInstances.size());
+    for (int p = 0; p < prototypeNumInstances.size(); ++p) {
+        const Array<shared_ptr<UniversalSurface>>& source = instanceSurfaceArray[prototypeFirstInstance[p]];
+
+        if (prototypeNumInstances[p] < 2) {
+            prototypeTree[p] = -1;
+            for (const shared_ptr<UniversalSurface>& surface : source) {
+                worldSurfaceArray.append(surface);
+            }
+            continue;
+        }
+
+        Settings settings = m_settings;
+        settings.instancing = false;
+
+        const shared_ptr<NativeTriTree>& tree = NativeTriTree::create();
+        tree->setSettings(settings);
+        tree->m_vertexArray.copyFrom(*source[0]->cpuGeom().vertexArray);
+
+        // As in UniversalSurface::getTrisHomogeneous, without the transformation
+        for (const shared_ptr<UniversalSurface>& surface : source) {
+            const Array<int>& index = *surface->cpuGeom().index;
+            const bool twoSided = surface->gpuGeom()->twoSided;
+            const bool hasPartialCoverage = surface->material()->hasPartialCoverage();
+            for (int i = 0; i < index.size(); i += 3) {
+                tree->m_triArray.append(Tri(index[i], index[i + 1], index[i + 2], tree->m_vertexArray, surface, twoSided, hasPartialCoverage));
+            }
+        }
+        tree->rebuild();
+
+        prototypeTree[p] = m_prototypeArray.size();
+        m_prototypeArray.append(tree);
+    }
+
+    for (int i = 0; i < instanceSurfaceArray.size(); ++i) {
+        const int t = prototypeTree[instancePrototype[i]];
+        if ((t == -1) || (m_prototypeArray[t]->m_numFlatNodes == 0)) {
+            continue;
+        }
+
+        const FlatNode& root = m_prototypeArray[t]->m_flatNode[0];
+        Instance& instance = m_instanceArray.next();
+        instance.frame     = instanceFrame[i];
+        instance.prototype = t;
+
+        Vector3 lo = Vector3::inf();
+        Vector3 hi = -Vector3::inf();
+        for (int c = 0; c < 8; ++c) {
+            const Point3& P = instance.frame.pointToWorldSpace
+                (Point3(((c & 1) ? root.high : root.low).x,
+                        ((c & 2) ? root.high : root.low).y,
+                        ((c & 4) ? root.high : root.low).z));
+            lo = lo.min(P);
+            hi = hi.max(P);
+        }
+        instance.bounds = AABox(lo, hi);
+    }
+
+    const bool computePrevPosition = false;
+    Surface::getTris(worldSurfaceArray, m_vertexArray, m_triArray, computePrevPosition);
+    Surface::setStorage(surfaceArray, newStorage);
+    m_sky = nullptr;
+    rebuild();
+
+    if (m_instanceArray.size() > 0) {
+        buildInstanceTree(0, m_instanceArray.size());
+    }
+}
+
+
+void NativeTriTree::buildInstanceTree(int first, int count) {
+    Vector3 lo = Vector3::inf(), hi = -Vector3::inf();
+    Vector3 centerLo = Vector3::inf(), centerHi = -Vector3::inf();
+    for (int i = first; i < first + count; ++i) {
+        const AABox& bounds = m_instanceArray[i].bounds;
+        lo = lo.min(bounds.low());
+        hi = hi.max(bounds.high());
+        centerLo = centerLo.min(bounds.center());
+        centerHi = centerHi.max(bounds.center());
+    }
+
+    const int index = m_instanceNode.size();
+    InstanceNode& node = m_instanceNode.next();
+    node.low           = lo;
+    node.high          = hi;
+    node.secondChild   = 0;
+    node.firstInstance = first;
+    node.numInstances  = count;
+
+    if (count <= instancesPerLeaf) {
+        return;
+    }
+
+    // Median split on the axis along which the instance centers spread the most
+    const Vector3::Axis axis = (centerHi - centerLo).primaryAxis();
+    const int half = count / 2;
+    Instance* begin = m_instanceArray.getCArray() + first;
+    std::nth_element(begin, begin + half, begin + count, [axis](const Instance& a, const Instance& b) {
+        return a.bounds.center()[axis] < b.bounds.center()[axis];
+    });
+
+    buildInstanceTree(first, half);
+
+    // m_instanceNode may have been reallocated, so node is no longer valid
+    m_instanceNode[index].secondChild  = m_instanceNode.size();
+    m_instanceNode[index].numInstances = 0;
+    buildInstanceTree(first + half, count - half);
+}
+
+
+bool NativeTriTree::intersectInstances
+   (const PrecomputedRay&              ray,
+    Hit&                               hit,
+    IntersectRayOptions                options) const {
+
+    const bool occlusionTestOnly = (options & OCCLUSION_TEST_ONLY) != 0;
+
+    hit.instance = Hit::NONE;
+    bool anyHit = intersectFlatTree(ray, hit, options);
+    if (anyHit && occlusionTestOnly) {
+        return true;
+    }
+    float maxDistance = anyHit ? hit.distance : ray.maxDistance();
+
+    SmallArray<int, 64> stack;
+    int current = 0;
+    while (true) {
+        const InstanceNode& node = m_instanceNode[current];
+        int next = -1;
+
+        if (intersectBounds(ray, node.low, node.high, maxDistance)) {
+            if (node.secondChild == 0) {
+                for (int i = node.firstInstance; i < node.firstInstance + node.numInstances; ++i) {
+                    const Instance& instance = m_instanceArray[i];
+                    if ((node.numInstances > 1) && ! intersectBounds(ray, instance.bounds.low(), instance.bounds.high(), maxDistance)) {
+                        continue;
+                    }
+
+                    // The frame is rigid, so distances are the same in object space
+                    const PrecomputedRay objectRay(Ray::fromOriginAndDirection
+                        (instance.frame.pointToObjectSpace(ray.origin()),
+                         instance.frame.vectorToObjectSpace(ray.direction()),
+                         ray.minDistance(), maxDistance));
+
+                    Hit instanceHit;
+                    if (m_prototypeArray[instance.prototype]->intersectFlatTree(objectRay, instanceHit, options)) {
+                        hit          = instanceHit;
+                        hit.instance = i;
+                        anyHit       = true;
+                        if (occlusionTestOnly) {
+                            return true;
+                        }
+                        maxDistance  = hit.distance;
+                    }
+                }
+            } else {
+                stack.push(node.secondChild);
+                next = current + 1;
+            }
+        }
+
+        if (next == -1) {
+            if (stack.size() == 0) {
+                return anyHit;
+            }
+            next = stack.pop();
+        }
+        current = next;
+    }
+}
+
+
+void NativeTriTree::sample(const Hit& hit, shared_ptr<Surfel>& surfel) const {
+    if (hit.triIndex == Hit::NONE) {
+        surfel = nullptr;
+        return;
+    }
+
+    const bool           instanced = (hit.instance != Hit::NONE);
+    const NativeTriTree& tree      = instanced ? *m_prototypeArray[m_instanceArray[hit.instance].prototype] : *this;
+    const Material*      material  = tree.triMaterial(hit.triIndex);
+    if (isNull(material)) {
+        surfel = nullptr;
+        return;
+    }
+
+    const Tri& tri = tree.m_triArray[hit.triIndex];
+    if (instanced) {
+        material->sample(tri, hit.u, hit.v, hit.triIndex, tree.m_vertexArray, hit.backface, surfel, 0, 0, tri.twoSided());
+        if (notNull(surfel)) {
+            surfel->transformToWorldSpace(m_instanceArray[hit.instance].frame);
+        }
+    } else {
+        material->sample(tri, hit.u, hit.v, hit.triIndex, m_vertexArray, hit.backface, surfel, 0, 0, tri.twoSided());
+    }
+}
+
+
+void NativeTriTree::intersectRays
+   (const Array<Ray>&                   rays,
+    Array<shared_ptr<Surfel>>&          results,
+    IntersectRayOptions                 options,
+    const Array<float>&                 coneBuffer) const {
+
+    Array<Hit> hits;
+    results.resize(rays.size());
+    intersectRays(rays, hits, options);
+    runConcurrently(0, hits.size(), [&](int i) { sample(hits[i], results[i]); });
+}
+
+}
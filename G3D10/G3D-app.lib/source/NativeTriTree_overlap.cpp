@@ -0,0 +1,177 @@
+/**
+  \file G3D-app.lib/source/NativeTriTree_overlap.cpp
+
+  Box, sphere, and capsule overlap queries on the flattened NativeTriTree.
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#include "G3D-base/Capsule.h"
+#include "G3D-base/CollisionDetection.h"
+#include "G3D-base/Sphere.h"
+#include "G3D-app/NativeTriTree.h"
+
+namespace G3D {
+
+static inline bool boundsOverlap(const Vector3& low, const Vector3& high, const AABox& box) {
+    return (low.x <= box.high().x) && (high.x >= box.low().x) &&
+           (low.y <= box.high().y) && (high.y >= box.low().y) &&
+           (low.z <= box.high().z) && (high.z >= box.low().z);
+}
+
+
+static AABox capsuleBounds(const Capsule& capsule) {
+    const Vector3 r(capsule.radius(), capsule.radius(), capsule.radius());
+    const Point3& a = capsule.point(0);
+    const Point3& b = capsule.point(1);
+    return AABox(a.min(b) - r, a.max(b) + r);
+}
+
+
+template<class Test>
+void NativeTriTree::intersectFlatVolume(const AABox& bounds, const Test& test, Array<Tri>& results) const {
+    results.fastClear();
+    if (m_numFlatNodes == 0) {
+        return;
+    }
+
+    // Take a scratch object from the pool, so that concurrent queries do not share bits
+    shared_ptr<OverlapScratch> scratch;
+    {
+        std::lock_guard<std::mutex> lock(m_overlapScratchMutex);
+        scratch = (m_overlapScratch.size() > 0) ? m_overlapScratch.pop() : createShared<OverlapScratch>();
+    }
+    Array<uint32>& testedBits = scratch->testedBits;
+    Array<int>&    testedTris = scratch->testedTris;
+
+    const int numWords = (m_triArray.size() + 31) / 32;
+    if (testedBits.size() < numWords) {
+        const int oldSize = testedBits.size();
+        testedBits.resize(numWords);
+        System::memset(testedBits.getCArray() + oldSize, 0, sizeof(uint32) * (numWords - oldSize));
+    }
+    testedTris.fastClear();
+
+    SmallArray<int, 64> stack;
+    int current = 0;
+    while (true) {
+        const FlatNode& node = m_flatNode[current];
+        int next = -1;
+
+        if (boundsOverlap(node.low, node.high, bounds)) {
+            if ((node.numTriBlocks > 0) && boundsOverlap(node.triLow, node.triHigh, bounds)) {
+                const FlatTriBlock* block = m_flatTriBlock + node.firstTriBlock;
+                const FlatTriBlock* end   = block + node.numTriBlocks;
+                for (; block < end; ++block) {
+                    for (int lane = 0; (lane < FlatTriBlock::SIZE) && block->used(lane); ++lane) {
+                        const int t = block->triIndex(lane);
+                        uint32& word = testedBits[t >> 5];
+                        const uint32 bit = 1U << (t & 31);
+                        if ((word & bit) == 0) {
+                            word |= bit;
+                            testedTris.append(t);
+                            const Point3& v0 = block->vertex0(lane);
+                            if ((m_triArray[t].area() > 0.0f) && test(v0, v0 + block->edge1(lane), v0 + block->edge2(lane))) {
+                                results.append(m_triArray[t]);
+                            }
+                        }
+                    }
+                }
+            }
+
+            if (! node.isLeaf()) {
+                // The first child immediately follows its parent
+                stack.push(node.secondChild());
+                next = current + 1;
+            }
+        }
+
+        if ((next == -1) && (stack.size() > 0)) {
+            next = stack.pop();
+        }
+
+        if (next == -1) {
+            break;
+        }
+        current = next;
+    }
+
+    for (const int t : testedTris) {
+        testedBits[t >> 5] = 0;
+    }
+
+    std::lock_guard<std::mutex> lock(m_overlapScratchMutex);
+    m_overlapScratch.append(scratch);
+}
+
+
+void NativeTriTree::intersectBox
+   (const AABox&  box,
+    Array<Tri>&   triArray) const {
+
+    intersectFlatVolume(box, [&](const Point3& v0, const Point3& v1, const Point3& v2) {
+        return CollisionDetection::fixedSolidBoxIntersectsFixedTriangle(box, Triangle(v0, v1, v2));
+    }, triArray);
+}
+
+
+void NativeTriTree::intersectSphere
+   (const Sphere& sphere,
+    Array<Tri>&   triArray) const {
+
+    AABox bounds;
+    sphere.getBounds(bounds);
+    intersectFlatVolume(bounds, [&](const Point3& v0, const Point3& v1, const Point3& v2) {
+        return CollisionDetection::fixedSolidSphereIntersectsFixedTriangle(sphere, Triangle(v0, v1, v2));
+    }, triArray);
+}
+
+
+void NativeTriTree::intersectCapsule
+   (const Capsule& capsule,
+    Array<Tri>&    triArray) const {
+
+    intersectFlatVolume(capsuleBounds(capsule), [&](const Point3& v0, const Point3& v1, const Point3& v2) {
+        return capsuleIntersectsTriangle(capsule, v0, v1, v2);
+    }, triArray);
+}
+
+
+// Each query writes only its own result array and takes its own scratch
+// bits, so the batches need no other synchronization
+
+void NativeTriTree::intersectBoxes
+   (const Array<AABox>&                boxArray,
+    Array<Array<Tri>>&                 results) const {
+
+    results.resize(boxArray.size());
+    runConcurrently(0, boxArray.size(), [&](int q) {
+        intersectBox(boxArray[q], results[q]);
+    });
+}
+
+
+void NativeTriTree::intersectSpheres
+   (const Array<Sphere>&               sphereArray,
+    Array<Array<Tri>>&                 results) const {
+
+    results.resize(sphereArray.size());
+    runConcurrently(0, sphereArray.size(), [&](int q) {
+        intersectSphere(sphereArray[q], results[q]);
+    });
+}
+
+
+void NativeTriTree::intersectCapsules
+   (const Array<Capsule>&              capsuleArray,
+    Array<Array<Tri>>&                 results) const {
+
+    results.resize(capsuleArray.size());
+    runConcurrently(0, capsuleArray.size(), [&](int q) {
+        intersectCapsule(capsuleArray[q], results[q]);
+    });
+}
+
+}
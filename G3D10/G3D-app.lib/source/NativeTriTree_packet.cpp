@@ -0,0 +1,280 @@
+/**
+  \file G3D-app.lib/source/NativeTriTree_packet.cpp
+
+  Ray packet traversal of the flattened NativeTriTree, used by intersectRays()
+  for COHERENT_RAY_HINT batches.
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#include "G3D-base/platform.h"
+#ifdef G3D_X86
+#   include <xmmintrin.h>
+#endif
+#include "G3D-app/NativeTriTree.h"
+
+namespace G3D {
+
+#ifdef G3D_X86
+
+namespace _internal {
+/** NativeTriTree::PACKET_SIZE rays in structure-of-arrays form, one per SSE lane */
+class RayPacket4 {
+public:
+    __m128      origin[3];
+    __m128      direction[3];
+    __m128      invDirection[3];
+    __m128      minDistance;
+
+    /** Distance to the closest hit so far. -inf for lanes that are finished
+        or unused, which no box or triangle test can then pass. */
+    __m128      maxDistance;
+};
+
+
+/** Returns the mask of lanes whose ray hits the box from \a low to \a high
+    between the origin and maxDistance. Same test as the scalar traversal in
+    NativeTriTree.cpp, with the box tested against all rays of the packet at once. */
+static inline __m128 intersectBox4(const RayPacket4& packet, const Vector3& low, const Vector3& high) {
+    __m128 enter = _mm_setzero_ps();
+    __m128 exit  = packet.maxDistance;
+    for (int a = 0; a < 3; ++a) {
+        const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(low[a]),  packet.origin[a]), packet.invDirection[a]);
+        const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(high[a]), packet.origin[a]), packet.invDirection[a]);
+        enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+        exit  = _mm_min_ps(exit,  _mm_max_ps(t0, t1));
+    }
+    return _mm_cmple_ps(enter, exit);
+}
+}
+
+using _internal::RayPacket4;
+using _internal::intersectBox4;
+
+
+void NativeTriTree::intersectRayPacket
+   (const PrecomputedRay*              ray,
+    int                                numRays,
+    Hit*                               hit,
+    IntersectRayOptions                options) const {
+
+    debugAssert(numRays > 0 && numRays <= PACKET_SIZE);
+
+    for (int r = 0; r < numRays; ++r) {
+        hit[r] = Hit();
+    }
+
+    if (m_numFlatNodes == 0) {
+        return;
+    }
+
+    // Same constants as rayTriangleIntersection()
+    static const float EPS = 1e-12f;
+    static const float conservative = 1e-8f;
+
+    // Same bound as intersectBounds()
+    static const float maxInvDirection = 1e30f;
+
+    const bool  occlusionTestOnly = (options & OCCLUSION_TEST_ONLY) != 0;
+    const bool  noBackfaceTest    = (options & DO_NOT_CULL_BACKFACES) != 0;
+    const bool  alphaTest         = (options & NO_PARTIAL_COVERAGE_TEST) == 0;
+    const float alphaThreshold    = ((options & PARTIAL_COVERAGE_THRESHOLD_ZERO) != 0) ? 1.0f : 0.5f;
+
+    // Unused lanes repeat the first ray, and are disabled by their maxDistance
+    alignas(16) float lane[3][3][PACKET_SIZE];
+    alignas(16) float laneMinDistance[PACKET_SIZE];
+    alignas(16) float laneMaxDistance[PACKET_SIZE];
+    for (int r = 0; r < PACKET_SIZE; ++r) {
+        const PrecomputedRay& src = ray[(r < numRays) ? r : 0];
+        for (int a = 0; a < 3; ++a) {
+            lane[0][a][r] = src.origin()[a];
+            lane[1][a][r] = src.direction()[a];
+            // Finite, so that a ray starting on a box face does not produce NaN
+            lane[2][a][r] = clamp(src.invDirection()[a], -maxInvDirection, maxInvDirection);
+        }
+        laneMinDistance[r] = src.minDistance();
+        laneMaxDistance[r] = (r < numRays) ? src.maxDistance() : -finf();
+    }
+
+    RayPacket4 packet;
+    for (int a = 0; a < 3; ++a) {
+        packet.origin[a]       = _mm_load_ps(lane[0][a]);
+        packet.direction[a]    = _mm_load_ps(lane[1][a]);
+        packet.invDirection[a] = _mm_load_ps(lane[2][a]);
+    }
+    packet.minDistance = _mm_load_ps(laneMinDistance);
+    packet.maxDistance = _mm_load_ps(laneMaxDistance);
+
+    // Lanes that have finished an occlusion test
+    int finishedMask = ~((1 << numRays) - 1) & ((1 << PACKET_SIZE) - 1);
+
+    SmallArray<int, 64> stack;
+    int current = 0;
+    while (true) {
+        const FlatNode& node = m_flatNode[current];
+        int next = -1;
+
+        if (_mm_movemask_ps(intersectBox4(packet, node.low, node.high)) != 0) {
+
+            if ((node.numTriBlocks > 0) && (_mm_movemask_ps(intersectBox4(packet, node.triLow, node.triHigh)) != 0)) {
+                const FlatTriBlock* block = m_flatTriBlock + node.firstTriBlock;
+                const FlatTriBlock* end   = block + node.numTriBlocks;
+                for (; block < end; ++block) {
+                    for (int k = 0; k < FlatTriBlock::SIZE; ++k) {
+                        if (! block->used(k)) {
+                            // Only the last block of a node has unused lanes, and they are at its end
+                            break;
+                        }
+
+                        // Moller-Trumbore of triangle k against all lanes, as in rayTriangleIntersection()
+                        const __m128 e1[3] = {_mm_set1_ps(block->e1[0][k]), _mm_set1_ps(block->e1[1][k]), _mm_set1_ps(block->e1[2][k])};
+                        const __m128 e2[3] = {_mm_set1_ps(block->e2[0][k]), _mm_set1_ps(block->e2[1][k]), _mm_set1_ps(block->e2[2][k])};
+                        const __m128* d = packet.direction;
+                        const uint32 flags = block->flags(k);
+                        const int triIndex = block->triIndex(k);
+
+                        __m128 valid = _mm_cmpge_ps(packet.maxDistance, packet.minDistance);
+
+                        if (! (noBackfaceTest || ((flags & FlatTriBlock::TWO_SIDED) != 0))) {
+                            const Vector3& n = block->edge1(k).cross(block->edge2(k));
+                            const __m128 nDotD = _mm_add_ps(_mm_add_ps(
+                                _mm_mul_ps(_mm_set1_ps(n.x), d[0]),
+                                _mm_mul_ps(_mm_set1_ps(n.y), d[1])),
+                                _mm_mul_ps(_mm_set1_ps(n.z), d[2]));
+                            valid = _mm_and_ps(valid, _mm_cmplt_ps(nDotD, _mm_set1_ps(-EPS * n.length())));
+                        }
+
+                        if (_mm_movemask_ps(valid) == 0) {
+                            continue;
+                        }
+
+                        // p = d x e2
+                        const __m128 p[3] = {
+                            _mm_sub_ps(_mm_mul_ps(d[1], e2[2]), _mm_mul_ps(d[2], e2[1])),
+                            _mm_sub_ps(_mm_mul_ps(d[2], e2[0]), _mm_mul_ps(d[0], e2[2])),
+                            _mm_sub_ps(_mm_mul_ps(d[0], e2[1]), _mm_mul_ps(d[1], e2[0]))};
+
+                        const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1[0], p[0]), _mm_mul_ps(e1[1], p[1])), _mm_mul_ps(e1[2], p[2]));
+                        const __m128 f = _mm_div_ps(_mm_set1_ps(1.0f), a);
+                        const __m128 c = _mm_mul_ps(_mm_set1_ps(conservative), f);
+
+                        const __m128 s[3] = {
+                            _mm_mul_ps(_mm_sub_ps(packet.origin[0], _mm_set1_ps(block->v0[0][k])), f),
+                            _mm_mul_ps(_mm_sub_ps(packet.origin[1], _mm_set1_ps(block->v0[1][k])), f),
+                            _mm_mul_ps(_mm_sub_ps(packet.origin[2], _mm_set1_ps(block->v0[2][k])), f)};
+
+                        const __m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s[0], p[0]), _mm_mul_ps(s[1], p[1])), _mm_mul_ps(s[2], p[2]));
+
+                        // q = s x e1
+                        const __m128 q[3] = {
+                            _mm_sub_ps(_mm_mul_ps(s[1], e1[2]), _mm_mul_ps(s[2], e1[1])),
+                            _mm_sub_ps(_mm_mul_ps(s[2], e1[0]), _mm_mul_ps(s[0], e1[2])),
+                            _mm_sub_ps(_mm_mul_ps(s[0], e1[1]), _mm_mul_ps(s[1], e1[0]))};
+
+                        const __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], q[0]), _mm_mul_ps(d[1], q[1])), _mm_mul_ps(d[2], q[2]));
+                        const __m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2[0], q[0]), _mm_mul_ps(e2[1], q[1])), _mm_mul_ps(e2[2], q[2]));
+
+                        const __m128 negC     = _mm_sub_ps(_mm_setzero_ps(), c);
+                        const __m128 onePlusC = _mm_add_ps(_mm_set1_ps(1.0f), c);
+                        const __m128 absA     = _mm_max_ps(a, _mm_sub_ps(_mm_setzero_ps(), a));
+
+                        valid = _mm_and_ps(valid, _mm_cmpge_ps(u, negC));
+                        valid = _mm_and_ps(valid, _mm_cmple_ps(u, onePlusC));
+                        valid = _mm_and_ps(valid, _mm_cmpge_ps(v, negC));
+                        valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), onePlusC));
+                        valid = _mm_and_ps(valid, _mm_cmpge_ps(absA, _mm_set1_ps(EPS)));
+                        valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, packet.minDistance));
+                        valid = _mm_and_ps(valid, _mm_cmplt_ps(t, packet.maxDistance));
+
+                        const int hitMask = _mm_movemask_ps(valid);
+                        if (hitMask == 0) {
+                            continue;
+                        }
+
+                        alignas(16) float laneU[PACKET_SIZE], laneV[PACKET_SIZE], laneT[PACKET_SIZE], laneA[PACKET_SIZE];
+                        _mm_store_ps(laneU, u);
+                        _mm_store_ps(laneV, v);
+                        _mm_store_ps(laneT, t);
+                        _mm_store_ps(laneA, a);
+                        _mm_store_ps(laneMaxDistance, packet.maxDistance);
+
+                        for (int r = 0; r < numRays; ++r) {
+                            if ((hitMask & (1 << r)) == 0) {
+                                continue;
+                            }
+
+                            if (alphaTest && ((flags & FlatTriBlock::HAS_PARTIAL_COVERAGE) != 0) &&
+                                ! passesAlphaTest(triIndex, laneU[r], laneV[r], alphaThreshold)) {
+                                // Failed the filter (e.g., alpha test)
+                                continue;
+                            }
+
+                            Hit& h = hit[r];
+                            h.triIndex = triIndex;
+                            h.distance = laneT[r];
+                            h.u        = laneU[r];
+                            h.v        = laneV[r];
+                            h.backface = (laneA[r] < 0);
+
+                            if (occlusionTestOnly) {
+                                finishedMask |= 1 << r;
+                                laneMaxDistance[r] = -finf();
+                            } else {
+                                laneMaxDistance[r] = laneT[r];
+                            }
+                        }
+
+                        packet.maxDistance = _mm_load_ps(laneMaxDistance);
+
+                        if (finishedMask == (1 << PACKET_SIZE) - 1) {
+                            return;
+                        }
+                    }
+                }
+            }
+
+            if (! node.isLeaf()) {
+                // Visit first the child on the side of the splitting plane where the
+                // packet begins, judged by its first ray. The box tests cull the
+                // children that individual rays never reach, so the order only
+                // affects performance.
+                const Vector3::Axis axis = node.splitAxis();
+                const float origin = ray[0].origin()[axis];
+                const bool  lowFirst = (origin < node.splitLocation) ||
+                    ((origin == node.splitLocation) && (ray[0].direction()[axis] < 0));
+
+                const int childIndex[2] = {current + 1, node.secondChild()};
+                stack.push(childIndex[lowFirst ? 1 : 0]);
+                next = childIndex[lowFirst ? 0 : 1];
+            }
+        }
+
+        if (next == -1) {
+            if (stack.size() == 0) {
+                return;
+            }
+            next = stack.pop();
+        }
+        current = next;
+    }
+}
+
+#else
+
+void NativeTriTree::intersectRayPacket
+   (const PrecomputedRay*              ray,
+    int                                numRays,
+    Hit*                               hit,
+    IntersectRayOptions                options) const {
+
+    for (int r = 0; r < numRays; ++r) {
+        hit[r] = Hit();
+        intersectRay(ray[r], hit[r], options);
+    }
+}
+
+#endif
+
+}
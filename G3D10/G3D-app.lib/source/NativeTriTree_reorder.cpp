@@ -0,0 +1,149 @@
+/**
+  \file G3D-app.lib/source/NativeTriTree_reorder.cpp
+
+  Ray sorting for NativeTriTree::intersectRays() with REORDER_RAYS_HINT.
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#include "G3D-app/NativeTriTree.h"
+
+namespace G3D {
+
+/** Bits of each origin coordinate in the Morton code */
+static const int mortonBitsPerAxis = 9;
+
+/** Bits sorted per radix pass */
+static const int radixBits = 10;
+static const int numRadixBuckets = 1 << radixBits;
+
+/** 3 * mortonBitsPerAxis bits of Morton code followed by 3 bits of octant */
+static const int numRadixPasses = (3 * mortonBitsPerAxis + 3 + radixBits - 1) / radixBits;
+
+/** Keys per histogram block. Each block is counted and scattered by one task. */
+static const int radixBlockSize = 16 * 1024;
+
+
+/** Inserts two zero bits between each of the low mortonBitsPerAxis bits of \a x */
+static inline uint32 spreadBits3(uint32 x) {
+    x &= (1 << mortonBitsPerAxis) - 1;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x <<  8)) & 0x0300F00F;
+    x = (x | (x <<  4)) & 0x030C30C3;
+    x = (x | (x <<  2)) & 0x09249249;
+    return x;
+}
+
+
+/** Stable least-significant-digit radix sort of \a numPasses * radixBits bits
+    of the keys, carrying \a value along. Each pass counts digits per block in
+    parallel, computes every block's output offsets with one serial prefix sum
+    over (digit, block), and then scatters the blocks in parallel. The tmp arrays
+    must be the same size as the inputs. The result is in \a key and \a value. */
+static void parallelRadixSort
+   (Array<uint32>&      key,
+    Array<int>&         value,
+    Array<uint32>&      tmpKey,
+    Array<int>&         tmpValue,
+    int                 numPasses) {
+
+    const int n = key.size();
+    const int numBlocks = (n + radixBlockSize - 1) / radixBlockSize;
+
+    Array<int> blockOffset;
+    blockOffset.resize(numBlocks * numRadixBuckets);
+
+    uint32* srcKey   = key.getCArray();
+    int*    srcValue = value.getCArray();
+    uint32* dstKey   = tmpKey.getCArray();
+    int*    dstValue = tmpValue.getCArray();
+
+    for (int pass = 0; pass < numPasses; ++pass) {
+        const int shift = pass * radixBits;
+
+        runConcurrently(0, numBlocks, [&](int b) {
+            int* count = blockOffset.getCArray() + b * numRadixBuckets;
+            System::memset(count, 0, sizeof(int) * numRadixBuckets);
+            const int end = min(n, (b + 1) * radixBlockSize);
+            for (int i = b * radixBlockSize; i < end; ++i) {
+                ++count[(srcKey[i] >> shift) & (numRadixBuckets - 1)];
+            }
+        });
+
+        // Blocks write each digit in block order, which keeps the sort stable
+        int sum = 0;
+        for (int d = 0; d < numRadixBuckets; ++d) {
+            for (int b = 0; b < numBlocks; ++b) {
+                int& offset = blockOffset[b * numRadixBuckets + d];
+                const int count = offset;
+                offset = sum;
+                sum += count;
+            }
+        }
+
+        runConcurrently(0, numBlocks, [&](int b) {
+            int* offset = blockOffset.getCArray() + b * numRadixBuckets;
+            const int end = min(n, (b + 1) * radixBlockSize);
+            for (int i = b * radixBlockSize; i < end; ++i) {
+                const int j = offset[(srcKey[i] >> shift) & (numRadixBuckets - 1)]++;
+                dstKey[j]   = srcKey[i];
+                dstValue[j] = srcValue[i];
+            }
+        });
+
+        std::swap(srcKey, dstKey);
+        std::swap(srcValue, dstValue);
+    }
+
+    if (srcKey != key.getCArray()) {
+        System::memcpy(key.getCArray(), srcKey, sizeof(uint32) * n);
+        System::memcpy(value.getCArray(), srcValue, sizeof(int) * n);
+    }
+}
+
+
+void NativeTriTree::computeRayOrder
+   (const Array<PrecomputedRay>&       rays,
+    Array<int>&                        order) const {
+
+    const int n = rays.size();
+    order.resize(n);
+
+    // Quantize origins within the tree bounds. Origins outside of the tree
+    // clamp to its faces, which is fine since those rays enter it there.
+    Vector3 low(Vector3::zero()), scale(Vector3::zero());
+    if (m_numFlatNodes > 0) {
+        low = m_flatNode[0].low;
+        const Vector3 extent = m_flatNode[0].high - low;
+        const float cells = float(1 << mortonBitsPerAxis);
+        for (int a = 0; a < 3; ++a) {
+            scale[a] = (extent[a] > 0.0f) ? cells / extent[a] : 0.0f;
+        }
+    }
+
+    Array<uint32> key;
+    Array<uint32> tmpKey;
+    Array<int>    tmpOrder;
+    key.resize(n);
+    tmpKey.resize(n);
+    tmpOrder.resize(n);
+
+    const float maxCell = float((1 << mortonBitsPerAxis) - 1);
+    runConcurrently(0, n, [&](int i) {
+        const PrecomputedRay& ray = rays[i];
+        const Vector3 cell = (ray.origin() - low) * scale;
+        const Vector3& d = ray.direction();
+        const uint32 octant = uint32(d.x < 0.0f) | (uint32(d.y < 0.0f) << 1) | (uint32(d.z < 0.0f) << 2);
+
+        key[i] = (((spreadBits3(uint32(clamp(cell.x, 0.0f, maxCell))) << 2) |
+                   (spreadBits3(uint32(clamp(cell.y, 0.0f, maxCell))) << 1) |
+                    spreadBits3(uint32(clamp(cell.z, 0.0f, maxCell)))) << 3) | octant;
+        order[i] = i;
+    });
+
+    parallelRadixSort(key, order, tmpKey, tmpOrder, numRadixPasses);
+}
+
+}
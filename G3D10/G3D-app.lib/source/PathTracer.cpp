@@ -6,6 +6,7 @@
   All rights reserved
   Available under the BSD License
 */
+#include <algorithm>
 #include "G3D-app/PathTracer.h"
 #include "G3D-base/Image.h"
 #include "G3D-base/CubeMap.h"
@@ -13,6 +14,8 @@
 #include "G3D-app/Camera.h"
 #include "G3D-app/Scene.h"
 #include "G3D-app/UniversalSurfel.h"
+#include "G3D-app/SurfelArena.h"
+#include "G3D-app/ATrousDenoiser.h"
 #include "G3D-gfx/GLPixelTransferBuffer.h"
 
 namespace G3D {
@@ -23,6 +26,7 @@ const Ray PathTracer::s_degenerateRay = Ray(Point3(5000, 5000, 5000), Vector3::u
 
 PathTracer::PathTracer(const shared_ptr<TriTree>& t) {
     m_triTree = isNull(t) ? TriTree::create(true) : t;
+    m_surfelArena = SurfelArena::create();
 }
 
 
@@ -50,11 +54,34 @@ Radiance3 PathTracer::skyRadiance(const Vector3& direction) const {
 // is likely to be too low to matter.
 static const float minModulation = 0.02f;
 
+// Lens samples per pixel averaged into the feature images when the camera has depth of field
+static const int numFeatureLensSamples = 8;
+
 void PathTracer::traceImage
    (const shared_ptr<Image>&            radianceImage,
     const shared_ptr<Camera>&           camera,
     const Options&                      options,
-    const std::function<void(const String&, float)>& statusCallback) const {
+    const std::function<void(const String&, float)>& statusCallback,
+    const shared_ptr<Image>&            albedoImage,
+    const shared_ptr<Image>&            normalImage,
+    const shared_ptr<Image>&            depthImage) const {
+    
+    if (options.denoise) {
+        // The denoiser needs all of the feature images
+        const int w = radianceImage->width();
+        const int h = radianceImage->height();
+        const shared_ptr<Image>& albedo = notNull(albedoImage) ? albedoImage : Image::create(w, h, ImageFormat::RGB32F());
+        const shared_ptr<Image>& normal = notNull(normalImage) ? normalImage : Image::create(w, h, ImageFormat::RGB32F());
+        const shared_ptr<Image>& depth  = notNull(depthImage)  ? depthImage  : Image::create(w, h, ImageFormat::R32F());
+
+        Options undenoised = options;
+        undenoised.denoise = false;
+        traceImage(radianceImage, camera, undenoised, statusCallback, albedo, normal, depth);
+
+        if (statusCallback) { statusCallback("Denoising", 1.0f); }
+        ATrousDenoiser::create()->apply(radianceImage, albedo, normal, depth, radianceImage, ATrousDenoiser::Settings(), ! options.multithreaded);
+        return;
+    }
     
     // Visible area lights are handled by indirect rays during
     // recursive ray importance sampling. Point lights and invisible
@@ -63,6 +90,13 @@ void PathTracer::traceImage
     Array<shared_ptr<Light>> directLightArray, indirectLightArray;
     prepare(options, directLightArray, indirectLightArray);
 
+    traceFeatureImages(camera, albedoImage, normalImage, depthImage);
+
+    if (options.adaptiveSampling) {
+        traceImageAdaptive(radianceImage, camera, directLightArray, indirectLightArray, statusCallback);
+        return;
+    }
+
     // Resize all buffers for one sample per pixel
     const int numPixels = radianceImage->width() * radianceImage->height();
 
@@ -97,6 +131,266 @@ void PathTracer::traceImage
 }
 
 
+Ray PathTracer::eyeRay
+(const shared_ptr<Camera>&           camera,
+ const Rect2D&                       viewport,
+ const Point2int32&                  pixel,
+ const Point2&                       P,
+ bool                                depthOfField,
+ int                                 rayIndex,
+ int                                 raysPerPixel) const {
+
+    if (depthOfField) {
+        // Hammersley sequence remapped from a square to a disk
+        const uint32_t hash = superFastHash(&pixel, sizeof(pixel));
+        const Point2 pixelShift((hash >> 16) / float(0xFFFF), (hash & 0xFFFF) / float(0xFFFF));
+        const Point2& h = (Point2::hammersleySequence2D(rayIndex, raysPerPixel) + pixelShift).mod1();
+        const float angle = 2.0f * h.x * pif();
+        const float radius = sqrt(h.y);
+        const Point2 lens(cos(angle) * radius, sin(angle) * radius);
+        return camera->worldRay(P.x, P.y, lens.x, lens.y, viewport);
+    } else {
+        return camera->worldRay(P.x, P.y, viewport);
+    }
+}
+
+
+void PathTracer::traceFeatureImages
+   (const shared_ptr<Camera>&           camera,
+    const shared_ptr<Image>&            albedoImage,
+    const shared_ptr<Image>&            normalImage,
+    const shared_ptr<Image>&            depthImage) const {
+
+    const shared_ptr<Image>& any = notNull(albedoImage) ? albedoImage : (notNull(normalImage) ? normalImage : depthImage);
+    if (isNull(any)) { return; }
+
+    const int width  = any->width();
+    const int height = any->height();
+    const Rect2D viewport = Rect2D::xywh(0.0f, 0.0f, float(width), float(height));
+    const bool depthOfField = camera->depthOfFieldSettings().enabled() && (camera->depthOfFieldSettings().model() == DepthOfFieldModel::PHYSICAL);
+
+    // With depth of field, a single lens sample would give sharp features where the
+    // radiance is blurred, so average several
+    const int numSamples = depthOfField ? numFeatureLensSamples : 1;
+
+    // Per-pixel sums over the samples. Misses add one to the albedo and nothing to the others.
+    Array<Color3>  albedoSum;
+    Array<Vector3> normalSum;
+    Array<float>   depthSum;
+    Array<int>     hitCount;
+    albedoSum.resize(width * height);
+    normalSum.resize(width * height);
+    depthSum.resize(width * height);
+    hitCount.resize(width * height);
+    albedoSum.setAll(Color3::zero());
+    normalSum.setAll(Vector3::zero());
+    depthSum.setAll(0.0f);
+    hitCount.setAll(0);
+
+    const CoordinateFrame& cameraFrame = camera->frame();
+    Array<Ray> rays;
+    rays.resize(width * height);
+    Array<shared_ptr<Surfel>> surfels;
+    for (int s = 0; s < numSamples; ++s) {
+        runConcurrently(Point2int32(0, 0), Point2int32(width, height), [&](Point2int32 pixel) {
+            rays[pixel.x + pixel.y * width] = eyeRay(camera, viewport, pixel, Point2(float(pixel.x) + 0.5f, float(pixel.y) + 0.5f), depthOfField, s, numSamples);
+        }, ! m_options.multithreaded);
+
+        m_triTree->intersectRays(rays, *m_surfelArena, surfels, TriTree::COHERENT_RAY_HINT);
+
+        runConcurrently(0, width * height, [&](int i) {
+            const shared_ptr<Surfel>& surfel = surfels[i];
+            if (isNull(surfel)) {
+                albedoSum[i] += Color3::one();
+                return;
+            }
+            if (notNull(albedoImage)) {
+                albedoSum[i] += surfel->reflectivity(Random::threadCommon());
+            }
+            normalSum[i] += surfel->shadingNormal;
+            depthSum[i]  += -cameraFrame.pointToObjectSpace(surfel->position).z;
+            ++hitCount[i];
+        }, ! m_options.multithreaded);
+    }
+
+    runConcurrently(Point2int32(0, 0), Point2int32(width, height), [&](Point2int32 pixel) {
+        const int i = pixel.x + pixel.y * width;
+        if (notNull(albedoImage)) {
+            albedoImage->set(pixel, albedoSum[i] / float(numSamples));
+        }
+        if (notNull(normalImage)) {
+            const Vector3& n = normalSum[i].directionOrZero();
+            normalImage->set(pixel, Color3(n.x, n.y, n.z));
+        }
+        if (notNull(depthImage)) {
+            depthImage->set(pixel, Color1((hitCount[i] > 0) ? depthSum[i] / float(hitCount[i]) : finf()));
+        }
+    }, ! m_options.multithreaded);
+}
+
+
+class PathTracer::PixelEstimate {
+public:
+    Radiance3   sum;
+    float       luminanceSum = 0.0f;
+    float       luminanceSquaredSum = 0.0f;
+    int         count = 0;
+
+    /** True once the pixel has converged or received every ray */
+    bool        done = false;
+
+    void add(const Radiance3& L) {
+        const float y = L.average();
+        sum += L;
+        luminanceSum += y;
+        luminanceSquaredSum += y * y;
+        ++count;
+    }
+
+    /** Standard error of the mean luminance relative to the mean */
+    bool converged(float threshold) const {
+        const float n = float(count);
+        const float mean = luminanceSum / n;
+        const float variance = max(0.0f, luminanceSquaredSum / n - square(mean)) * n / (n - 1.0f);
+        return sqrt(variance / n) <= threshold * max(mean, 0.05f);
+    }
+};
+
+
+void PathTracer::traceImageAdaptive
+   (const shared_ptr<Image>&            radianceImage,
+    const shared_ptr<Camera>&           camera,
+    const Array<shared_ptr<Light>>&     directLightArray,
+    const Array<shared_ptr<Light>>&     indirectLightArray,
+    const std::function<void(const String&, float)>& statusCallback) const {
+
+    const int width     = radianceImage->width();
+    const int height    = radianceImage->height();
+    const int numPixels = width * height;
+    const int tileSize  = max(1, m_options.adaptiveTileSize);
+    const int tilesWide = iCeil(float(width) / float(tileSize));
+    const int numTiles  = tilesWide * iCeil(float(height) / float(tileSize));
+    const int maxRays   = max(1, m_options.raysPerPixel);
+    const int minRays   = clamp(m_options.minRaysPerPixel, 2, maxRays);
+
+    const Rect2D viewport = Rect2D::xywh(0.0f, 0.0f, float(width), float(height));
+    const bool depthOfField = camera->depthOfFieldSettings().enabled() && (camera->depthOfFieldSettings().model() == DepthOfFieldModel::PHYSICAL);
+
+    const auto tileBounds = [&](int t, Point2int32& low, Point2int32& high) {
+        low  = Point2int32((t % tilesWide) * tileSize, (t / tilesWide) * tileSize);
+        high = Point2int32(min(width, low.x + tileSize), min(height, low.y + tileSize));
+    };
+
+    Array<PixelEstimate> estimate;
+    estimate.resize(numPixels);
+
+    // Tiles with at least one pixel still sampling
+    Array<bool> tileActive;
+    tileActive.resize(numTiles);
+    tileActive.setAll(true);
+
+    Array<int> tileOffset;
+    tileOffset.resize(numTiles + 1);
+
+    // Pixel index for each ray of the current pass, in tile order
+    Array<int> pixelForRay;
+    Array<Radiance3> output;
+    BufferSet buffers;
+
+    radianceImage->setAll(Radiance3::zero());
+    int numDone = 0;
+    for (int rayIndex = 0; (rayIndex < maxRays) && (numDone < numPixels); ++rayIndex) {
+
+        // Count the active pixels of each tile and retire tiles that have none
+        runConcurrently(0, numTiles, [&](int t) {
+            int count = 0;
+            if (tileActive[t]) {
+                Point2int32 low, high;
+                tileBounds(t, low, high);
+                for (int y = low.y; y < high.y; ++y) {
+                    for (int x = low.x; x < high.x; ++x) {
+                        count += estimate[x + y * width].done ? 0 : 1;
+                    }
+                }
+                tileActive[t] = (count > 0);
+            }
+            tileOffset[t + 1] = count;
+        }, ! m_options.multithreaded);
+
+        tileOffset[0] = 0;
+        for (int t = 0; t < numTiles; ++t) {
+            tileOffset[t + 1] += tileOffset[t];
+        }
+        const int numRays = tileOffset[numTiles];
+
+        buffers.resize(numRays);
+        buffers.modulation.setAll(Color3::one());
+        buffers.impulseRay.setAll(true);
+        buffers.outputIndex.resize(numRays);
+        buffers.outputCoord.resize(numRays);
+        pixelForRay.resize(numRays);
+        output.resize(numRays);
+        System::memset(output.getCArray(), 0, sizeof(Radiance3) * numRays);
+
+        // Each tile generates the rays for its active pixels
+        runConcurrently(0, numTiles, [&](int t) {
+            if (! tileActive[t]) { return; }
+            Random& rng = Random::threadCommon();
+            Point2int32 low, high;
+            tileBounds(t, low, high);
+            int r = tileOffset[t];
+            for (int y = low.y; y < high.y; ++y) {
+                for (int x = low.x; x < high.x; ++x) {
+                    const int p = x + y * width;
+                    if (estimate[p].done) { continue; }
+
+                    // The first ray passes through the pixel center
+                    const Vector2 offset = (rayIndex == 0) ? Vector2(0.5f, 0.5f) : Vector2(rng.uniform(), rng.uniform());
+                    const Point2int32 pixel(x, y);
+                    buffers.ray[r] = eyeRay(camera, viewport, pixel, Point2(float(x) + offset.x, float(y) + offset.y), depthOfField, rayIndex, maxRays);
+                    buffers.outputIndex[r] = r;
+                    buffers.outputCoord[r] = Point2(float(x), float(y)) + offset - Point2(0.5f, 0.5f);
+                    pixelForRay[r] = p;
+                    ++r;
+                }
+            }
+        }, ! m_options.multithreaded);
+
+        // pixelForRay is indexed by outputIndex, which compaction preserves
+        traceBufferInternal(buffers, output.getCArray(), radianceImage, nullptr, directLightArray, indirectLightArray, rayIndex);
+
+        // Each ray belongs to a distinct pixel, so this needs no synchronization
+        runConcurrently(0, numRays, [&](int r) {
+            PixelEstimate& e = estimate[pixelForRay[r]];
+            e.add(output[r]);
+            e.done = (e.count >= maxRays) || ((e.count >= minRays) && e.converged(m_options.adaptiveSamplingThreshold));
+        }, ! m_options.multithreaded);
+
+        numDone = 0;
+        for (const PixelEstimate& e : estimate) {
+            numDone += e.done ? 1 : 0;
+        }
+
+        if (statusCallback) {
+            // Box-filtered estimate so far
+            runConcurrently(Point2int32(0, 0), Point2int32(width, height), [&](Point2int32 pix) {
+                const PixelEstimate& e = estimate[pix.x + pix.y * width];
+                radianceImage->set(pix, (e.count > 0) ? e.sum / float(e.count) : Radiance3::zero());
+            }, ! m_options.multithreaded);
+
+            statusCallback(format("%d/%d rays/pixel, %d%% of pixels converged", rayIndex + 1, maxRays, (100 * numDone) / numPixels),
+                max(float(rayIndex + 1) / float(maxRays), float(numDone) / float(numPixels)));
+        }
+    } // for each pass
+
+    runConcurrently(Point2int32(0, 0), Point2int32(width, height), [&](Point2int32 pix) {
+        const PixelEstimate& e = estimate[pix.x + pix.y * width];
+        radianceImage->set(pix, (e.count > 0) ? e.sum / float(e.count) : Radiance3::zero());
+        debugAssertM(radianceImage->get<Color3>(pix).isFinite(), "Infinite/NaN radiance");
+    }, ! m_options.multithreaded);
+}
+
+
 void PathTracer::generateEyeRays
 (int                                 width, 
  int                                 height,
@@ -121,20 +415,7 @@ void PathTracer::generateEyeRays
         const int i = point.x + point.y * width;
 
         const Point2 P(float(point.x) + offset.x, float(point.y) + offset.y);
-
-        if (depthOfField) {
-            // Hammersley sequence remapped from a square to a disk
-            const uint32_t hash = superFastHash(&point, sizeof(point));
-            const Point2 pixelShift((hash >> 16) / float(0xFFFF), (hash & 0xFFFF) / float(0xFFFF));
-            const Point2& h = (Point2::hammersleySequence2D(rayIndex, raysPerPixel) + pixelShift).mod1();
-            const float angle = 2.0f * h.x * pif();
-            const float radius = sqrt(h.y);
-            const Point2 lens(cos(angle) * radius, sin(angle) * radius);
-            rayBuffer[i] = camera->worldRay(P.x, P.y, lens.x, lens.y, viewport);
-        }
-        else {
-            rayBuffer[i] = camera->worldRay(P.x, P.y, viewport);
-        }
+        rayBuffer[i] = eyeRay(camera, viewport, point, P, depthOfField, rayIndex, raysPerPixel);
 
         // Camera coords put integers at top left, but image coords put them at pixel centers
         const PixelCoord& pixelCoord = Point2(point) + offset - Point2(0.5f, 0.5f);
@@ -208,6 +489,146 @@ Point3 PathTracer::sampleOneLight(const shared_ptr<Light>& light, const Point3&
 }
 
 
+static float lightRadius(const shared_ptr<Light>& light) {
+    return (light->type() == Light::Type::AREA) ? light->extent().length() * 0.5f : 0.0f;
+}
+
+
+void PathTracer::LightTree::build(const Array<shared_ptr<Light>>& lightArray) {
+    clear();
+
+    Array<int> local;
+    for (int i = 0; i < lightArray.size(); ++i) {
+        if (lightArray[i]->type() == Light::Type::DIRECTIONAL) {
+            m_directional.append(i);
+        } else {
+            local.append(i);
+        }
+    }
+
+    if (local.size() > 0) {
+        m_node.reserve(2 * local.size() - 1);
+        m_node.resize(1);
+        build(lightArray, local, 0, local.size(), 0);
+    }
+}
+
+
+void PathTracer::LightTree::build(const Array<shared_ptr<Light>>& lightArray, Array<int>& lightIndex, int begin, int end, int n) {
+    Point3 low(finf(), finf(), finf());
+    Point3 high = -low;
+    Point3 centerLow = low;
+    Point3 centerHigh = high;
+    float power = 0.0f;
+    for (int i = begin; i < end; ++i) {
+        const shared_ptr<Light>& light = lightArray[lightIndex[i]];
+        const Point3& c = light->position().xyz();
+        const Vector3 r(lightRadius(light), lightRadius(light), lightRadius(light));
+        low  = low.min(c - r);
+        high = high.max(c + r);
+        centerLow  = centerLow.min(c);
+        centerHigh = centerHigh.max(c);
+
+        const float p = light->bulbPower().sum();
+        power += isFinite(p) ? max(p, 0.0f) : 0.0f;
+    }
+
+    Node& node = m_node[n];
+    node.center        = (low + high) * 0.5f;
+    node.radiusSquared = (high - low).squaredLength() * 0.25f;
+    node.power         = power;
+
+    if (end - begin == 1) {
+        node.firstChild = -1;
+        node.lightIndex = lightIndex[begin];
+        return;
+    }
+
+    // Split at the median light along the longest axis of the light centers
+    const Vector3& extent = centerHigh - centerLow;
+    const int axis = ((extent.x >= extent.y) && (extent.x >= extent.z)) ? 0 : ((extent.y >= extent.z) ? 1 : 2);
+    const int mid = (begin + end) / 2;
+    std::nth_element(lightIndex.getCArray() + begin, lightIndex.getCArray() + mid, lightIndex.getCArray() + end, [&](int a, int b) {
+        return lightArray[a]->position()[axis] < lightArray[b]->position()[axis];
+    });
+
+    // The recursion appends to m_node, so node may be invalid after it
+    const int child = m_node.size();
+    node.firstChild = child;
+    node.lightIndex = -1;
+    m_node.resize(child + 2);
+    build(lightArray, lightIndex, begin, mid, child);
+    build(lightArray, lightIndex, mid, end, child + 1);
+}
+
+
+float PathTracer::LightTree::importance(const Node& node, const Point3& X) const {
+    // The bound on distance keeps points inside a cluster from preferring its nearest light without limit
+    return node.power / (4.0f * pif() * max((X - node.center).squaredLength(), node.radiusSquared, 1e-6f));
+}
+
+
+int PathTracer::LightTree::sample(const Array<shared_ptr<Light>>& lightArray, const Point3& X, float u, float& probability) const {
+    debugAssert(! empty());
+    u = clamp(u, 0.0f, 0.9999999f);
+    probability = 1.0f;
+
+    if (m_directional.size() > 0) {
+        // Choose between the tree (choice 0, if it exists) and each directional light
+        const int offset = (m_node.size() > 0) ? 1 : 0;
+        SmallArray<float, 8> weight;
+        weight.resize(m_directional.size() + offset);
+        float total = 0.0f;
+        for (int k = 0; k < weight.size(); ++k) {
+            weight[k] = (k < offset) ? importance(m_node[0], X) : lightArray[m_directional[k - offset]]->biradiance(X).sum();
+            total += weight[k];
+        }
+
+        if (total <= 0.0f) {
+            // Nothing reaches X, so any choice is equally good
+            for (int k = 0; k < weight.size(); ++k) {
+                weight[k] = 1.0f;
+            }
+            total = float(weight.size());
+        }
+
+        float r = u * total;
+        int k = 0;
+        while ((k < weight.size() - 1) && (r >= weight[k])) {
+            r -= weight[k];
+            ++k;
+        }
+
+        probability = weight[k] / total;
+        if (k >= offset) {
+            return m_directional[k - offset];
+        }
+        u = clamp(r / weight[k], 0.0f, 0.9999999f);
+    }
+
+    // Descend, reusing the remainder of u at each level
+    int n = 0;
+    while (m_node[n].firstChild != -1) {
+        const int first = m_node[n].firstChild;
+        const float a = importance(m_node[first], X);
+        const float b = importance(m_node[first + 1], X);
+        const float p = (a + b > 0.0f) ? a / (a + b) : 0.5f;
+        if (u < p) {
+            u /= p;
+            probability *= p;
+            n = first;
+        } else {
+            u = (u - p) / (1.0f - p);
+            probability *= 1.0f - p;
+            n = first + 1;
+        }
+        u = min(u, 0.9999999f);
+    }
+
+    return m_node[n].lightIndex;
+}
+
+
 const shared_ptr<Light>& PathTracer::importanceSampleLight
 (const Array<shared_ptr<Light>>&             lightArray,
  const Vector3&                              w_o,
@@ -222,16 +643,25 @@ const shared_ptr<Light>& PathTracer::importanceSampleLight
     const Point3&  X = surfel->position;
     const Vector3& n = surfel->shadingNormal;
     
-    const shared_ptr<Light>& light0 = lightArray[0];
-    if (lightArray.size() == 1) {
-        // There is only one light, so of course we will sample it
+    const bool useLightTree = (lightArray.size() > m_options.maxExhaustiveLights) && ! m_lightTree.empty();
+    if ((lightArray.size() == 1) || useLightTree) {
+        // Either there is only one light, so of course we will sample it, or there are
+        // too many to evaluate them all and the light tree chooses one
+        int   lightIndex = 0;
+        float selectionProbability = 1.0f;
+        if (useLightTree) {
+            debugAssertM(lightArray.size() > 1, "Light tree built for a single light");
+            lightIndex = m_lightTree.sample(lightArray, X, Random::threadCommon().uniform(), selectionProbability);
+        }
+        const shared_ptr<Light>& light = lightArray[lightIndex];
+
         float areaTimesPDFValue;
 
-        const Point3& Y = sampleOneLight(light0, X, n, sequenceIndex, 0, rayIndex, raysPerPixel, areaTimesPDFValue).xyz();
+        const Point3& Y = sampleOneLight(light, X, n, sequenceIndex, lightIndex, rayIndex, raysPerPixel, areaTimesPDFValue).xyz();
 
         lightPosition = Y;
         const Vector3& w_i = (lightPosition - X).direction();  
-        biradiance = light0->biradiance(X, lightPosition);
+        biradiance = light->biradiance(X, lightPosition);
 
         // To get correct brightness, we need to divide by the light area and the pdf with which we sampled.
         // However, if and only if biradiance is 0, the pdfValue is allowed to be 0, so don't divide by it 
@@ -248,12 +678,12 @@ const shared_ptr<Light>& PathTracer::importanceSampleLight
         debugAssertM(biradiance.min() >= 0.0f, "Negative biradiance for light");
         debugAssertM(f.min() >= 0.0f, "Negative finiteScatteringDensity");
 
-        if (visibleAreaLight(light0)) {
+        if (visibleAreaLight(light)) {
             biradiance *= m_options.areaLightDirectFraction;
         }
 
-        cosBSDFDivPDF = f * fabsf(w_i.dot(n));
-        return light0;
+        cosBSDFDivPDF = f * (fabsf(w_i.dot(n)) / selectionProbability);
+        return light;
 
     } else {
 
@@ -564,6 +994,86 @@ void PathTracer::traceBuffer
 }
 
 
+/** Paths per task when compacting a BufferSet */
+static const int compactChunkSize = 4096;
+
+/** Replaces \a array with the elements at the indices in \a survivor, in order,
+    staging them in \a scratch */
+template<class T>
+static void gather(Array<T>& array, const Array<int>& survivor, Array<T>& scratch) {
+    const int n = survivor.size();
+    scratch.resize(n, false);
+    runConcurrently(0, n, [&](int i) { scratch[i] = std::move(array[survivor[i]]); });
+    runConcurrently(0, n, [&](int i) { array[i] = std::move(scratch[i]); });
+    array.resize(n, false);
+}
+
+
+void PathTracer::BufferSet::compact(const Array<bool>& keep) {
+    const int numPaths  = keep.size();
+    const int numChunks = iCeil(float(numPaths) / float(compactChunkSize));
+
+    // Count the survivors in each chunk
+    Array<int> chunkOffset;
+    chunkOffset.resize(numChunks + 1);
+    runConcurrently(0, numChunks, [&](int c) {
+        const int end = min(numPaths, (c + 1) * compactChunkSize);
+        int count = 0;
+        for (int i = c * compactChunkSize; i < end; ++i) {
+            count += keep[i] ? 1 : 0;
+        }
+        chunkOffset[c + 1] = count;
+    });
+
+    // Exclusive prefix sum gives each chunk the start of its output
+    chunkOffset[0] = 0;
+    for (int c = 0; c < numChunks; ++c) {
+        chunkOffset[c + 1] += chunkOffset[c];
+    }
+
+    const int numSurvivors = chunkOffset[numChunks];
+    if (numSurvivors == numPaths) {
+        return;
+    }
+
+    // Each chunk scatters the indices of its survivors
+    Array<int> survivor;
+    survivor.resize(numSurvivors);
+    runConcurrently(0, numChunks, [&](int c) {
+        const int end = min(numPaths, (c + 1) * compactChunkSize);
+        int j = chunkOffset[c];
+        for (int i = c * compactChunkSize; i < end; ++i) {
+            if (keep[i]) {
+                survivor[j] = i;
+                ++j;
+            }
+        }
+    });
+
+    // Reused across bounces to avoid reallocating at every compaction, and
+    // freed with this BufferSet when the trace ends
+    if (isNull(m_compactScratch)) {
+        m_compactScratch = createShared<BufferSet>();
+    }
+    BufferSet& scratch = *m_compactScratch;
+
+    gather(ray, survivor, scratch.ray);
+    gather(modulation, survivor, scratch.modulation);
+    gather(surfel, survivor, scratch.surfel);
+    gather(direct, survivor, scratch.direct);
+    gather(shadowRay, survivor, scratch.shadowRay);
+    gather(lightShadowed, survivor, scratch.lightShadowed);
+    gather(impulseRay, survivor, scratch.impulseRay);
+
+    if (outputIndex.size() > 0) {
+        gather(outputIndex, survivor, scratch.outputIndex);
+    }
+    if (outputCoord.size() > 0) {
+        gather(outputCoord, survivor, scratch.outputCoord);
+    }
+}
+
+
 void PathTracer::prepare
    (const Options&                      options,
     Array<shared_ptr<Light>>&           directLightArray,
@@ -598,6 +1108,12 @@ void PathTracer::prepare
         }
     }
 
+    if (directLightArray.size() > m_options.maxExhaustiveLights) {
+        m_lightTree.build(directLightArray);
+    } else {
+        m_lightTree.clear();
+    }
+
     if (m_options.useEnvironmentMapForLastScatteringEvent && isNull(m_environmentMap)) {
         m_environmentMap = m_scene->environmentMapAsCubeMap();
     }
@@ -627,7 +1143,7 @@ void PathTracer::traceBufferInternal
 
     for (int scatteringEvents = 0; (scatteringEvents < numTraceIterations) && (buffers.surfel.size() > 0); ++scatteringEvents) {
 
-        m_triTree->intersectRays(buffers.ray, buffers.surfel, (scatteringEvents == 0) ? TriTree::COHERENT_RAY_HINT : 0);
+        m_triTree->intersectRays(buffers.ray, *m_surfelArena, buffers.surfel, (scatteringEvents == 0) ? TriTree::COHERENT_RAY_HINT : 0);
 
         if (notNull(distance) && (scatteringEvents == 0)) {
             // Write to the distance buffer.
@@ -641,13 +1157,14 @@ void PathTracer::traceBufferInternal
         addEmissive(buffers.ray, buffers.surfel, buffers.impulseRay, buffers.modulation, output, buffers.outputIndex, radianceImage, buffers.outputCoord);
 
         // Compact buffers by removing paths that terminated (missed the entire scene)
-        // This must be done serially.
-        for (int i = 0; i < buffers.surfel.size(); ++i) {
-            if (isNull(buffers.surfel[i]) || (buffers.modulation[i].sum() < minModulation)) {
-                buffers.fastRemove(i);
-                --i;
-            }
-        } // for i
+        {
+            Array<bool> keep;
+            keep.resize(buffers.surfel.size());
+            runConcurrently(0, keep.size(), [&](int i) {
+                keep[i] = notNull(buffers.surfel[i]) && (buffers.modulation[i].sum() >= minModulation);
+            });
+            buffers.compact(keep);
+        }
 
         // Direct lighting
         if (directLightArray.size() > 0) {
@@ -0,0 +1,126 @@
+/**
+  \file G3D-app.lib/source/PostProcessChain.cpp
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#include "G3D-gfx/Framebuffer.h"
+#include "G3D-gfx/Profiler.h"
+#include "G3D-gfx/RenderDevice.h"
+#include "G3D-gfx/Texture.h"
+#include "G3D-app/PostProcessChain.h"
+#include "G3D-app/Camera.h"
+#include "G3D-app/DepthOfField.h"
+#include "G3D-app/MotionBlur.h"
+#include "G3D-app/UniversalBlur.h"
+
+namespace G3D {
+
+PostProcessChain::PostProcessChain
+   (const Array<Effect>&               effects,
+    const shared_ptr<DepthOfField>&    depthOfField,
+    const shared_ptr<MotionBlur>&      motionBlur,
+    const shared_ptr<UniversalBlur>&   universalBlur) :
+    m_effects(effects),
+    m_depthOfField(notNull(depthOfField) ? depthOfField : DepthOfField::create()),
+    m_motionBlur(notNull(motionBlur) ? motionBlur : MotionBlur::create()),
+    m_universalBlur(notNull(universalBlur) ? universalBlur : UniversalBlur::create()) {
+
+    m_target = Framebuffer::create("G3D::PostProcessChain::m_target");
+}
+
+
+shared_ptr<PostProcessChain> PostProcessChain::create
+   (const Array<Effect>&               effects,
+    const shared_ptr<DepthOfField>&    depthOfField,
+    const shared_ptr<MotionBlur>&      motionBlur,
+    const shared_ptr<UniversalBlur>&   universalBlur) {
+
+    return createShared<PostProcessChain>(effects, depthOfField, motionBlur, universalBlur);
+}
+
+
+const shared_ptr<Texture>& PostProcessChain::temp(int i, const shared_ptr<Texture>& color) {
+    shared_ptr<Texture>& texture = m_temp[i];
+
+    if (isNull(texture) || (texture->encoding() != color->encoding())) {
+        const bool generateMipMaps = false;
+        texture = Texture::createEmpty(format("G3D::PostProcessChain::m_temp[%d]", i), color->width(), color->height(), color->encoding(), Texture::DIM_2D, generateMipMaps);
+        texture->visualization = color->visualization;
+    } else if ((texture->width() != color->width()) || (texture->height() != color->height())) {
+        texture->resize(color->width(), color->height());
+    }
+
+    return texture;
+}
+
+
+void PostProcessChain::apply
+   (RenderDevice*                      rd,
+    const shared_ptr<Framebuffer>&     framebuffer,
+    const shared_ptr<Texture>&         depth,
+    const shared_ptr<Texture>&         velocity,
+    const shared_ptr<Camera>&          camera,
+    Vector2int16                       trimBandThickness) {
+
+    alwaysAssertM(notNull(framebuffer) && notNull(framebuffer->texture(Framebuffer::COLOR0)),
+        "PostProcessChain requires a framebuffer with a COLOR0 texture");
+
+    // Universal blur replaces the separate effects, whose enabled() methods account for it
+    Array<Effect> enabledEffects;
+    for (const Effect effect : m_effects) {
+        if (((effect == DEPTH_OF_FIELD) && DepthOfField::enabled(camera)) ||
+            ((effect == MOTION_BLUR)    && MotionBlur::enabled(camera)) ||
+            ((effect == UNIVERSAL_BLUR) && camera->universalBlurSettings().enabled())) {
+            enabledEffects.append(effect);
+        }
+    }
+
+    if (enabledEffects.size() == 0) {
+        return;
+    }
+
+    BEGIN_PROFILER_EVENT("G3D::PostProcessChain::apply");
+
+    const shared_ptr<Texture>& original = framebuffer->texture(Framebuffer::COLOR0);
+    shared_ptr<Texture> input = original;
+
+    for (int e = 0; e < enabledEffects.size(); ++e) {
+        const bool last = (e == enabledEffects.size() - 1);
+
+        // Every target but the caller's differs from its input, so the effects read the
+        // input directly instead of copying it. The last effect reads m_temp and writes
+        // the caller's texture, so it does not copy either unless it is the only one.
+        shared_ptr<Framebuffer> target = framebuffer;
+        if (! last) {
+            m_target->set(Framebuffer::COLOR0, temp(e & 1, original));
+            target = m_target;
+        }
+
+        rd->pushState(target); {
+            switch (enabledEffects[e]) {
+            case DEPTH_OF_FIELD:
+                m_depthOfField->apply(rd, input, depth, camera, trimBandThickness);
+                break;
+
+            case MOTION_BLUR:
+                m_motionBlur->apply(rd, input, velocity, depth, camera, trimBandThickness);
+                break;
+
+            case UNIVERSAL_BLUR:
+                m_universalBlur->apply(rd, input, depth, velocity, camera, trimBandThickness);
+                break;
+            }
+        } rd->popState();
+
+        if (! last) {
+            input = m_temp[e & 1];
+        }
+    }
+
+    END_PROFILER_EVENT();
+}
+
+} // namespace G3D
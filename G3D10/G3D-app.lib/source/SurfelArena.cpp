@@ -0,0 +1,24 @@
+/**
+  \file G3D-app.lib/source/SurfelArena.cpp
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#include "G3D-app/SurfelArena.h"
+
+namespace G3D {
+
+shared_ptr<SurfelArena> SurfelArena::create() {
+    return createShared<SurfelArena>();
+}
+
+
+void SurfelArena::reserve(int n) {
+    while (capacity() < n) {
+        m_block.append(shared_ptr<UniversalSurfel>(new UniversalSurfel[BLOCK_SIZE], std::default_delete<UniversalSurfel[]>()));
+    }
+}
+
+} // namespace G3D
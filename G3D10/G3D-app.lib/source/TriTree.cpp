@@ -13,6 +13,7 @@
 #include "G3D-gfx/RenderDevice.h"
 #include "G3D-app/TriTree.h"
 #include "G3D-app/Surface.h"
+#include "G3D-app/SurfelArena.h"
 #include "G3D-app/UniversalSurfel.h"
 #include "G3D-app/GBuffer.h"
 #include "G3D-app/Camera.h"
@@ -55,13 +56,37 @@ shared_ptr<Surfel> TriTree::intersectRay(const Ray& ray) const {
     
 void TriTree::sample(const Hit& hit, shared_ptr<Surfel>& surfel) const {
     if (hit.triIndex != Hit::NONE) {
-        m_triArray[hit.triIndex].sample(hit.u, hit.v, hit.triIndex, m_vertexArray, hit.backface, surfel);
+        const Tri& tri = m_triArray[hit.triIndex];
+        tri.sample(hit.u, hit.v, hit.triIndex, m_vertexArray, hit.backface, surfel, 0, 0, tri.twoSided());
     } else {
         surfel = nullptr;
     }
 }
 
 
+void TriTree::intersectRays
+   (const Array<Ray>&                   rays,
+    SurfelArena&                        arena,
+    Array<shared_ptr<Surfel>>&          results,
+    IntersectRayOptions                 options) const {
+
+    Array<Hit> hits;
+    intersectRays(rays, hits, options);
+
+    arena.reserve(rays.size());
+    results.resize(rays.size());
+    runConcurrently(0, hits.size(), [&](int i) {
+        if (hits[i].triIndex == Hit::NONE) {
+            results[i] = nullptr;
+        } else {
+            // Material::sample() reuses the surfel in place
+            arena.assign(i, results[i]);
+            sample(hits[i], results[i]);
+        }
+    });
+}
+
+
 shared_ptr<TriTree> TriTree::create(bool gpuData, bool preferVulkan) {
 #   if defined(G3D_X86) && (defined(G3D_WINDOWS) || defined(G3D_LINUX) || defined(G3D_MACOS)) 
         if (gpuData) {
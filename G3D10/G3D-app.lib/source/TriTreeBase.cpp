@@ -7,6 +7,7 @@
   Available under the BSD License
 */
 #include "G3D-base/AABox.h"
+#include "G3D-base/Capsule.h"
 #include "G3D-base/CollisionDetection.h"
 #include "G3D-gfx/GLPixelTransferBuffer.h"
 #include "G3D-app/TriTreeBase.h"
@@ -94,23 +95,189 @@ void TriTreeBase::intersectRays
 }
 
 
-void TriTreeBase::intersectBox
-   (const AABox&           box,
-    Array<Tri>&            results) const {
+/** Triangles tested by each task of a brute-force overlap query */
+static const int overlapBlockSize = 4096;
+
+/** Appends every Tri with nonzero area whose triangle passes \a test to \a results.
+    When \a parallel, blocks of triangles are tested concurrently into their
+    own arrays, which are then concatenated in order without any locking. */
+template<class Test>
+static void intersectAllTris
+   (const Array<Tri>&                  triArray,
+    const CPUVertexArray&              vertexArray,
+    const Test&                        test,
+    bool                               parallel,
+    Array<Tri>&                        results) {
 
     results.fastClear();
-    Spinlock resultLock;
-    runConcurrently(0, m_triArray.size(), [&](int t) {
-        const Tri& tri = m_triArray[t];
-        if ((tri.area() > 0.0f) &&
-            CollisionDetection::fixedSolidBoxIntersectsFixedTriangle(box, Triangle(tri.position(m_vertexArray, 0), 
-                                                                                   tri.position(m_vertexArray, 1), 
-                                                                                   tri.position(m_vertexArray, 2)))) {
-            resultLock.lock();
-            results.append(tri);
-            resultLock.unlock();
+
+    const auto& testBlock = [&](int begin, int end, Array<Tri>& blockResults) {
+        for (int t = begin; t < end; ++t) {
+            const Tri& tri = triArray[t];
+            if ((tri.area() > 0.0f) && test(tri.position(vertexArray, 0), tri.position(vertexArray, 1), tri.position(vertexArray, 2))) {
+                blockResults.append(tri);
+            }
         }
+    };
+
+    if (! parallel || (triArray.size() <= overlapBlockSize)) {
+        testBlock(0, triArray.size(), results);
+        return;
+    }
+
+    const int numBlocks = (triArray.size() + overlapBlockSize - 1) / overlapBlockSize;
+    Array<Array<Tri>> blockResults;
+    blockResults.resize(numBlocks);
+    runConcurrently(0, numBlocks, [&](int b) {
+        testBlock(b * overlapBlockSize, min(triArray.size(), (b + 1) * overlapBlockSize), blockResults[b]);
     });
+
+    for (const Array<Tri>& block : blockResults) {
+        results.append(block);
+    }
+}
+
+
+/** Closest point to \a p on triangle \a a \a b \a c, from Ericson's
+    <i>Real-Time Collision Detection</i>, section 5.1.5 */
+static Point3 closestPointOnTriangle(const Point3& p, const Point3& a, const Point3& b, const Point3& c) {
+    const Vector3& ab = b - a;
+    const Vector3& ac = c - a;
+    const Vector3& ap = p - a;
+    const float d1 = ab.dot(ap);
+    const float d2 = ac.dot(ap);
+    if ((d1 <= 0.0f) && (d2 <= 0.0f)) {
+        return a;
+    }
+
+    const Vector3& bp = p - b;
+    const float d3 = ab.dot(bp);
+    const float d4 = ac.dot(bp);
+    if ((d3 >= 0.0f) && (d4 <= d3)) {
+        return b;
+    }
+
+    const float vc = d1 * d4 - d3 * d2;
+    if ((vc <= 0.0f) && (d1 >= 0.0f) && (d3 <= 0.0f)) {
+        return a + ab * (d1 / (d1 - d3));
+    }
+
+    const Vector3& cp = p - c;
+    const float d5 = ab.dot(cp);
+    const float d6 = ac.dot(cp);
+    if ((d6 >= 0.0f) && (d5 <= d6)) {
+        return c;
+    }
+
+    const float vb = d5 * d2 - d1 * d6;
+    if ((vb <= 0.0f) && (d2 >= 0.0f) && (d6 <= 0.0f)) {
+        return a + ac * (d2 / (d2 - d6));
+    }
+
+    const float va = d3 * d6 - d5 * d4;
+    if ((va <= 0.0f) && ((d4 - d3) >= 0.0f) && ((d5 - d6) >= 0.0f)) {
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    }
+
+    const float denom = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+
+/** Squared distance between segments \a p1 \a q1 and \a p2 \a q2, from
+    Ericson's <i>Real-Time Collision Detection</i>, section 5.1.9 */
+static float segmentSegmentDistanceSquared(const Point3& p1, const Point3& q1, const Point3& p2, const Point3& q2) {
+    const Vector3& d1 = q1 - p1;
+    const Vector3& d2 = q2 - p2;
+    const Vector3& r  = p1 - p2;
+    const float a = d1.squaredLength();
+    const float e = d2.squaredLength();
+    const float f = d2.dot(r);
+
+    float s = 0.0f, t = 0.0f;
+    if ((a <= 0.0f) && (e <= 0.0f)) {
+        return r.squaredLength();
+    } else if (a <= 0.0f) {
+        t = clamp(f / e, 0.0f, 1.0f);
+    } else {
+        const float c = d1.dot(r);
+        if (e <= 0.0f) {
+            s = clamp(-c / a, 0.0f, 1.0f);
+        } else {
+            const float b = d1.dot(d2);
+            const float denom = a * e - b * b;
+            s = (denom != 0.0f) ? clamp((b * f - c * e) / denom, 0.0f, 1.0f) : 0.0f;
+            t = (b * s + f) / e;
+            if (t < 0.0f) {
+                t = 0.0f;
+                s = clamp(-c / a, 0.0f, 1.0f);
+            } else if (t > 1.0f) {
+                t = 1.0f;
+                s = clamp((b - c) / a, 0.0f, 1.0f);
+            }
+        }
+    }
+
+    return ((p1 + d1 * s) - (p2 + d2 * t)).squaredLength();
+}
+
+
+bool TriTreeBase::capsuleIntersectsTriangle
+   (const Capsule&                     capsule,
+    const Point3&                      v0,
+    const Point3&                      v1,
+    const Point3&                      v2) {
+
+    const Point3& p = capsule.point(0);
+    const Point3& q = capsule.point(1);
+    const float r2 = square(capsule.radius());
+
+    // Segment crossing the triangle
+    const Vector3& e1 = v1 - v0;
+    const Vector3& e2 = v2 - v0;
+    const Vector3& d  = q - p;
+    const Vector3& h  = d.cross(e2);
+    const float det = e1.dot(h);
+    if (abs(det) > 1e-12f) {
+        const float inv = 1.0f / det;
+        const Vector3& s = p - v0;
+        const float u = s.dot(h) * inv;
+        const Vector3& qv = s.cross(e1);
+        const float v = d.dot(qv) * inv;
+        const float t = e2.dot(qv) * inv;
+        if ((u >= 0.0f) && (v >= 0.0f) && (u + v <= 1.0f) && (t >= 0.0f) && (t <= 1.0f)) {
+            return true;
+        }
+    }
+
+    // Otherwise the closest points are on the segment's endpoints or the triangle's edges
+    return
+        ((closestPointOnTriangle(p, v0, v1, v2) - p).squaredLength() <= r2) ||
+        ((closestPointOnTriangle(q, v0, v1, v2) - q).squaredLength() <= r2) ||
+        (segmentSegmentDistanceSquared(p, q, v0, v1) <= r2) ||
+        (segmentSegmentDistanceSquared(p, q, v1, v2) <= r2) ||
+        (segmentSegmentDistanceSquared(p, q, v2, v0) <= r2);
+}
+
+
+/** The triangle tests used by the overlap queries */
+static bool boxTest(const AABox& box, const Point3& v0, const Point3& v1, const Point3& v2) {
+    return CollisionDetection::fixedSolidBoxIntersectsFixedTriangle(box, Triangle(v0, v1, v2));
+}
+
+
+static bool sphereTest(const Sphere& sphere, const Point3& v0, const Point3& v1, const Point3& v2) {
+    return CollisionDetection::fixedSolidSphereIntersectsFixedTriangle(sphere, Triangle(v0, v1, v2));
+}
+
+
+void TriTreeBase::intersectBox
+   (const AABox&           box,
+    Array<Tri>&            results) const {
+
+    intersectAllTris(m_triArray, m_vertexArray, [&](const Point3& v0, const Point3& v1, const Point3& v2) {
+        return boxTest(box, v0, v1, v2);
+    }, true, results);
 }
 
 
@@ -118,17 +285,62 @@ void TriTreeBase::intersectSphere
    (const Sphere&                      sphere,
     Array<Tri>&                        triArray) const {
 
-    AABox box;
-    sphere.getBounds(box);
-    intersectBox(box, triArray);
+    intersectAllTris(m_triArray, m_vertexArray, [&](const Point3& v0, const Point3& v1, const Point3& v2) {
+        return sphereTest(sphere, v0, v1, v2);
+    }, true, triArray);
+}
 
-    // Iterate backwards because we're removing
-    for (int i = triArray.size() - 1; i >= 0; --i) {
-        const Tri& tri = triArray[i];
-        if (! CollisionDetection::fixedSolidSphereIntersectsFixedTriangle(sphere, Triangle(tri.position(m_vertexArray, 0), tri.position(m_vertexArray, 1), tri.position(m_vertexArray, 2)))) {
-            triArray.fastRemove(i);
-        }
-    }
+
+void TriTreeBase::intersectCapsule
+   (const Capsule&                     capsule,
+    Array<Tri>&                        triArray) const {
+
+    intersectAllTris(m_triArray, m_vertexArray, [&](const Point3& v0, const Point3& v1, const Point3& v2) {
+        return capsuleIntersectsTriangle(capsule, v0, v1, v2);
+    }, true, triArray);
+}
+
+
+void TriTreeBase::intersectBoxes
+   (const Array<AABox>&                boxArray,
+    Array<Array<Tri>>&                 results) const {
+
+    // Parallelize over the queries instead of within them
+    results.resize(boxArray.size());
+    runConcurrently(0, boxArray.size(), [&](int q) {
+        const AABox& box = boxArray[q];
+        intersectAllTris(m_triArray, m_vertexArray, [&](const Point3& v0, const Point3& v1, const Point3& v2) {
+            return boxTest(box, v0, v1, v2);
+        }, false, results[q]);
+    });
+}
+
+
+void TriTreeBase::intersectSpheres
+   (const Array<Sphere>&               sphereArray,
+    Array<Array<Tri>>&                 results) const {
+
+    results.resize(sphereArray.size());
+    runConcurrently(0, sphereArray.size(), [&](int q) {
+        const Sphere& sphere = sphereArray[q];
+        intersectAllTris(m_triArray, m_vertexArray, [&](const Point3& v0, const Point3& v1, const Point3& v2) {
+            return sphereTest(sphere, v0, v1, v2);
+        }, false, results[q]);
+    });
+}
+
+
+void TriTreeBase::intersectCapsules
+   (const Array<Capsule>&              capsuleArray,
+    Array<Array<Tri>>&                 results) const {
+
+    results.resize(capsuleArray.size());
+    runConcurrently(0, capsuleArray.size(), [&](int q) {
+        const Capsule& capsule = capsuleArray[q];
+        intersectAllTris(m_triArray, m_vertexArray, [&](const Point3& v0, const Point3& v1, const Point3& v2) {
+            return capsuleIntersectsTriangle(capsule, v0, v1, v2);
+        }, false, results[q]);
+    });
 }
 
 
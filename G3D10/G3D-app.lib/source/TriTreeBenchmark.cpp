@@ -0,0 +1,399 @@
+/**
+  \file G3D-app.lib/source/TriTreeBenchmark.cpp
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#include "G3D-base/AABox.h"
+#include "G3D-base/BinaryInput.h"
+#include "G3D-base/BinaryOutput.h"
+#include "G3D-base/FileSystem.h"
+#include "G3D-base/Random.h"
+#include "G3D-base/Rect2D.h"
+#include "G3D-base/System.h"
+#include "G3D-base/TextOutput.h"
+#include "G3D-app/TriTreeBenchmark.h"
+#include "G3D-app/Camera.h"
+#include "G3D-app/Scene.h"
+#include "G3D-app/Surfel.h"
+#include "G3D-app/EmbreeTriTree.h"
+#include "G3D-app/NativeTriTree.h"
+#include "G3D-app/OptiXTriTree.h"
+#include "G3D-app/VulkanTriTree.h"
+
+namespace G3D {
+
+TriTreeBenchmark::Settings::Settings() :
+    resolution(640, 360),
+    numRandomRays(250000),
+    seed(1234567),
+    warmupRuns(1),
+    timedRuns(5),
+    cacheRays(true) {
+
+    implementations.append("NativeTriTree", "EmbreeTriTree", "OptiXTriTree", "VulkanTriTree");
+}
+
+
+shared_ptr<TriTreeBenchmark> TriTreeBenchmark::create() {
+    return createShared<TriTreeBenchmark>();
+}
+
+
+/** Quotes \a s as a JSON string. Scene filenames may contain backslashes. */
+static String jsonString(const String& s) {
+    String result = "\"";
+    for (int i = 0; i < int(s.size()); ++i) {
+        const char c = s[i];
+        if ((c == '"') || (c == '\\')) {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result + "\"";
+}
+
+
+/** Average seconds per call of \a f over \a timedRuns calls, after \a warmupRuns untimed calls */
+template<class Function>
+static RealTime averageTime(int warmupRuns, int timedRuns, const Function& f) {
+    for (int i = 0; i < warmupRuns; ++i) {
+        f();
+    }
+
+    const RealTime start = System::time();
+    for (int i = 0; i < timedRuns; ++i) {
+        f();
+    }
+    return (System::time() - start) / timedRuns;
+}
+
+
+shared_ptr<TriTree> TriTreeBenchmark::createTree(const String& className) {
+    if (className == "NativeTriTree") {
+        return NativeTriTree::create();
+    }
+
+    // Matches the availability tests in TriTree::create()
+#   if defined(G3D_X86) && (defined(G3D_WINDOWS) || defined(G3D_LINUX) || defined(G3D_MACOS))
+        if (className == "EmbreeTriTree") {
+            return EmbreeTriTree::create();
+        }
+#   endif
+
+#   ifdef G3D_WINDOWS
+        if (className == "OptiXTriTree") {
+            const shared_ptr<OptiXTriTree>& tree = OptiXTriTree::create();
+            return tree->supported() ? tree : nullptr;
+        } else if (className == "VulkanTriTree") {
+            const shared_ptr<VulkanTriTree>& tree = VulkanTriTree::create();
+            return tree->supported() ? tree : nullptr;
+        }
+#   endif
+
+    return nullptr;
+}
+
+
+void TriTreeBenchmark::makeRayBatches(const shared_ptr<Scene>& scene, const shared_ptr<TriTree>& tree, const Settings& settings, Array<RayBatch>& batches) const {
+    Random rng(settings.seed, false);
+
+    const CPUVertexArray& vertexArray = tree->vertexArray();
+    Point3 low  = vertexArray.vertex.size() > 0 ? vertexArray.vertex[0].position : Point3::zero();
+    Point3 high = low;
+    for (int i = 1; i < vertexArray.vertex.size(); ++i) {
+        low  = low.min(vertexArray.vertex[i].position);
+        high = high.max(vertexArray.vertex[i].position);
+    }
+    const AABox bounds(low, high);
+
+    const float sceneSize = bounds.extent().length();
+    const float epsilon   = 1e-4f * sceneSize;
+
+    // A small area light above the middle of the scene
+    const Point3 lightCenter(bounds.center().x, bounds.high().y + 0.25f * sceneSize, bounds.center().z);
+    const float  lightRadius = 0.05f * sceneSize;
+
+    batches.resize(4);
+    RayBatch& primary = batches[0];
+    RayBatch& shadow  = batches[1];
+    RayBatch& diffuse = batches[2];
+    RayBatch& random  = batches[3];
+
+    primary.name    = "primary";
+    primary.options = TriTree::COHERENT_RAY_HINT;
+    shadow.name     = "shadow";
+    shadow.options  = TriTree::OCCLUSION_TEST_ONLY;
+    diffuse.name    = "diffuse";
+    diffuse.options = TriTree::IntersectRayOptions(0);
+    random.name     = "random";
+    random.options  = TriTree::IntersectRayOptions(0);
+
+    const shared_ptr<Camera>& camera = scene->defaultCamera();
+    const Rect2D& viewport = Rect2D::xywh(0.0f, 0.0f, float(settings.resolution.x), float(settings.resolution.y));
+    primary.rays.resize(settings.resolution.x * settings.resolution.y);
+    for (int y = 0; y < settings.resolution.y; ++y) {
+        for (int x = 0; x < settings.resolution.x; ++x) {
+            primary.rays[x + y * settings.resolution.x] = camera->worldRay(x + 0.5f, y + 0.5f, viewport);
+        }
+    }
+
+    // The shadow and diffuse rays leave the primary hits. sample() resolves
+    // instanced hits, so this works for every tree configuration.
+    Array<TriTree::Hit> hits;
+    tree->intersectRays(primary.rays, hits);
+
+    shadow.rays.fastClear();
+    diffuse.rays.fastClear();
+    shared_ptr<Surfel> surfel;
+    for (int i = 0; i < hits.size(); ++i) {
+        if (hits[i].triIndex == TriTree::Hit::NONE) {
+            continue;
+        }
+
+        tree->sample(hits[i], surfel);
+        if (isNull(surfel)) {
+            continue;
+        }
+
+        // Face the normal toward the viewer so that the rays leave the visible side
+        Vector3 n = surfel->geometricNormal;
+        if (n.dot(primary.rays[i].direction()) > 0.0f) {
+            n = -n;
+        }
+        const Point3& origin = surfel->position + n * epsilon;
+
+        const Point3& lightPoint = lightCenter + Vector3(rng.uniform(-1.0f, 1.0f), 0.0f, rng.uniform(-1.0f, 1.0f)) * lightRadius;
+        const Vector3& delta = lightPoint - origin;
+        const float distance = delta.length();
+        if (distance > epsilon * 2.0f) {
+            shadow.rays.append(Ray::fromOriginAndDirection(origin, delta / distance, 0.0f, distance - epsilon));
+        }
+
+        diffuse.rays.append(Ray::fromOriginAndDirection(origin, Vector3::cosHemiRandom(n, rng)));
+    }
+
+    // AABox::randomInteriorPoint() uses the unseeded Random::common()
+    const auto randomPoint = [&]() {
+        return Point3(rng.uniform(low.x, high.x), rng.uniform(low.y, high.y), rng.uniform(low.z, high.z));
+    };
+
+    random.rays.resize(settings.numRandomRays);
+    for (int i = 0; i < random.rays.size(); ++i) {
+        const Point3& a = randomPoint();
+        Vector3 direction = randomPoint() - a;
+        if (direction.squaredLength() < 1e-10f) {
+            direction = Vector3::unitY();
+        }
+        random.rays[i] = Ray::fromOriginAndDirection(a, direction.direction());
+    }
+}
+
+
+/** Identifies files written by TriTreeBenchmark::saveRayBatches() */
+static const int32 RAY_CACHE_VERSION = 1;
+
+
+String TriTreeBenchmark::rayCacheFilename(const String& sceneName, const Settings& settings, const String& jsonFilename) {
+    // Every Setting that changes the generated rays is part of the name
+    const String& base = format("%s-%u-%dx%d-%d.rays", FilePath::makeLegalFilename(sceneName).c_str(),
+        settings.seed, settings.resolution.x, settings.resolution.y, settings.numRandomRays);
+    const String& directory = FilePath::parent(jsonFilename);
+    return directory.empty() ? base : FilePath::concat(directory, base);
+}
+
+
+bool TriTreeBenchmark::loadRayBatches(const String& filename, int numTris, Array<RayBatch>& batches) const {
+    if (! FileSystem::exists(filename)) {
+        return false;
+    }
+
+    BinaryInput b(filename, G3D_LITTLE_ENDIAN);
+    if ((b.readInt32() != RAY_CACHE_VERSION) || (b.readInt32() != numTris)) {
+        return false;
+    }
+
+    batches.resize(b.readInt32());
+    for (int i = 0; i < batches.size(); ++i) {
+        RayBatch& batch = batches[i];
+        batch.name    = b.readString32();
+        batch.options = TriTree::IntersectRayOptions(b.readInt32());
+        batch.rays.resize(b.readInt32());
+        for (int r = 0; r < batch.rays.size(); ++r) {
+            Point3  origin;
+            Vector3 direction;
+            origin.deserialize(b);
+            direction.deserialize(b);
+            const float minDistance = b.readFloat32();
+            const float maxDistance = b.readFloat32();
+            batch.rays[r] = Ray::fromOriginAndDirection(origin, direction, minDistance, maxDistance);
+        }
+    }
+    return true;
+}
+
+
+void TriTreeBenchmark::saveRayBatches(const String& filename, int numTris, const Array<RayBatch>& batches) const {
+    BinaryOutput b(filename, G3D_LITTLE_ENDIAN);
+    b.writeInt32(RAY_CACHE_VERSION);
+    b.writeInt32(numTris);
+    b.writeInt32(batches.size());
+    for (const RayBatch& batch : batches) {
+        b.writeString32(batch.name);
+        b.writeInt32(int32(batch.options));
+        b.writeInt32(batch.rays.size());
+        for (const Ray& ray : batch.rays) {
+            ray.origin().serialize(b);
+            ray.direction().serialize(b);
+            b.writeFloat32(ray.minDistance());
+            b.writeFloat32(ray.maxDistance());
+        }
+    }
+    b.commit();
+}
+
+
+void TriTreeBenchmark::writeStats(const shared_ptr<TriTree>& tree, TextOutput& json) const {
+    const shared_ptr<NativeTriTree>& native = dynamic_pointer_cast<NativeTriTree>(tree);
+    if (isNull(native)) {
+        return;
+    }
+
+    const NativeTriTree::Stats& s = native->stats(native->settings().valuesPerLeaf);
+    json.printf(",\n          \"stats\": {\"numNodes\": %d, \"numLeaves\": %d, \"numTris\": %d, \"depth\": %d, "
+        "\"shallowestLeaf\": %d, \"largestNode\": %d, \"averageValuesPerLeaf\": %.3f, \"sahCost\": %.4f, \"buildSeconds\": %.6f}",
+        s.numNodes, s.numLeaves, s.numTris, s.depth, s.shallowestLeaf, s.largestNode,
+        s.averageValuesPerLeaf, s.sahCost, s.buildTime);
+}
+
+
+void TriTreeBenchmark::runBatch(const shared_ptr<TriTree>& tree, const RayBatch& batch, const Settings& settings, TextOutput& json) const {
+    Array<TriTree::Hit>         hitResults;
+    Array<bool>                 boolResults;
+    Array<shared_ptr<Surfel>>   surfelResults;
+
+    const RealTime hitTime = averageTime(settings.warmupRuns, settings.timedRuns, [&]() {
+        tree->intersectRays(batch.rays, hitResults, batch.options);
+    });
+
+    const RealTime boolTime = averageTime(settings.warmupRuns, settings.timedRuns, [&]() {
+        tree->intersectRays(batch.rays, boolResults, batch.options | TriTree::OCCLUSION_TEST_ONLY);
+    });
+
+    // Occlusion rays never need surfels
+    const bool timeSurfels = (batch.options & TriTree::OCCLUSION_TEST_ONLY) == 0;
+    const RealTime surfelTime = timeSurfels ? averageTime(settings.warmupRuns, settings.timedRuns, [&]() {
+        tree->intersectRays(batch.rays, surfelResults, batch.options);
+    }) : 0.0;
+
+    // One thread, to isolate traversal from the batch overloads' threading
+    const RealTime singleTime = averageTime(settings.warmupRuns, settings.timedRuns, [&]() {
+        TriTree::Hit hit;
+        for (const Ray& ray : batch.rays) {
+            tree->intersectRay(ray, hit, batch.options);
+        }
+    });
+
+    // Hit counts let regressions in correctness show up next to regressions in speed
+    int numHits = 0;
+    for (const bool b : boolResults) {
+        numHits += b ? 1 : 0;
+    }
+
+    const float numRays = float(batch.rays.size());
+    const auto mraysPerSecond = [&](RealTime t) { return (t > 0.0) ? numRays / (1e6 * t) : 0.0; };
+
+    json.printf("            {\"name\": %s, \"numRays\": %d, \"numHits\": %d, \"queries\": [\n",
+        jsonString(batch.name).c_str(), batch.rays.size(), numHits);
+    json.printf("              {\"query\": \"intersectRays(Hit)\", \"seconds\": %.6f, \"mraysPerSecond\": %.3f},\n",
+        hitTime, mraysPerSecond(hitTime));
+    json.printf("              {\"query\": \"intersectRays(bool)\", \"seconds\": %.6f, \"mraysPerSecond\": %.3f},\n",
+        boolTime, mraysPerSecond(boolTime));
+    if (timeSurfels) {
+        json.printf("              {\"query\": \"intersectRays(Surfel)\", \"seconds\": %.6f, \"mraysPerSecond\": %.3f},\n",
+            surfelTime, mraysPerSecond(surfelTime));
+    }
+    json.printf("              {\"query\": \"intersectRay\", \"seconds\": %.6f, \"mraysPerSecond\": %.3f}]}",
+        singleTime, mraysPerSecond(singleTime));
+}
+
+
+void TriTreeBenchmark::runImplementation(const shared_ptr<Scene>& scene, const String& className, const Array<RayBatch>& batches, const Settings& settings, TextOutput& json) const {
+    const shared_ptr<TriTree>& tree = createTree(className);
+
+    json.printf("        {\"name\": %s, \"available\": %s", jsonString(className).c_str(), isNull(tree) ? "false" : "true");
+    if (isNull(tree)) {
+        json.printf("}");
+        return;
+    }
+
+    // setContents() includes extracting the triangles from the scene
+    RealTime start = System::time();
+    tree->setContents(scene);
+    const RealTime setContentsTime = System::time() - start;
+
+    const RealTime rebuildTime = averageTime(0, settings.timedRuns, [&]() { tree->rebuild(); });
+
+    json.printf(",\n          \"setContentsSeconds\": %.6f, \"rebuildSeconds\": %.6f", setContentsTime, rebuildTime);
+    writeStats(tree, json);
+    json.printf(",\n          \"batches\": [\n");
+    for (int b = 0; b < batches.size(); ++b) {
+        if (b > 0) {
+            json.printf(",\n");
+        }
+        runBatch(tree, batches[b], settings, json);
+    }
+    json.printf("]}");
+}
+
+
+void TriTreeBenchmark::run(const Settings& settings, const String& jsonFilename) {
+    alwaysAssertM(settings.timedRuns > 0, "Must time at least one run");
+
+    TextOutput::Settings opt;
+    opt.wordWrap = TextOutput::Settings::WRAP_NONE;
+    TextOutput json(jsonFilename, opt);
+
+    json.printf("{\"label\": %s, \"seed\": %u, \"resolution\": [%d, %d], \"warmupRuns\": %d, \"timedRuns\": %d,\n",
+        jsonString(settings.label).c_str(), settings.seed, settings.resolution.x, settings.resolution.y,
+        settings.warmupRuns, settings.timedRuns);
+    json.printf("  \"scenes\": [\n");
+
+    for (int s = 0; s < settings.sceneNames.size(); ++s) {
+        const shared_ptr<Scene>& scene = Scene::create(nullptr);
+        scene->load(settings.sceneNames[s]);
+
+        // Every implementation traces the same rays. They are generated with a default
+        // native tree only when there is no cached copy, so that later builds trace the
+        // same rays even if NativeTriTree changes.
+        const shared_ptr<NativeTriTree>& reference = NativeTriTree::create();
+        reference->setContents(scene);
+        const String& cacheFilename = rayCacheFilename(settings.sceneNames[s], settings, jsonFilename);
+        Array<RayBatch> batches;
+        if (! settings.cacheRays || ! loadRayBatches(cacheFilename, reference->size(), batches)) {
+            makeRayBatches(scene, reference, settings, batches);
+            if (settings.cacheRays) {
+                saveRayBatches(cacheFilename, reference->size(), batches);
+            }
+        }
+
+        json.printf("    {\"name\": %s, \"numTris\": %d, \"implementations\": [\n",
+            jsonString(settings.sceneNames[s]).c_str(), reference->size());
+        // Close the arrays after the loop so that the output is valid even if it is empty
+        for (int i = 0; i < settings.implementations.size(); ++i) {
+            if (i > 0) {
+                json.printf(",\n");
+            }
+            runImplementation(scene, settings.implementations[i], batches, settings, json);
+        }
+        json.printf("]}");
+        json.printf((s < settings.sceneNames.size() - 1) ? ",\n" : "");
+    }
+
+    json.printf("]}\n");
+    json.commit();
+}
+
+} // namespace G3D
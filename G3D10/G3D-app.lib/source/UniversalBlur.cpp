@@ -3,15 +3,48 @@
 */
 
 #include "G3D-app/UniversalBlur.h"
+#include "G3D-base/Image.h"
+#include "G3D-base/units.h"
 #include "G3D-gfx/Texture.h"
+#include "G3D-gfx/GLPixelTransferBuffer.h"
+#include "G3D-gfx/Profiler.h"
 //#include "G3D-gfx/RenderDevice.h"
 #include "G3D-gfx/Shader.h"
+#include "G3D-gfx/GLCaps.h"
+#include "G3D-gfx/glcalls.h"
 #include "G3D-app/Camera.h"
 #include "G3D-app/Draw.h"
 #include "G3D-app/SlowMesh.h"
 
 
 namespace G3D {
+
+    /** Frames that updateQualityTier() measures a tier before changing it again */
+    static const int MIN_FRAMES_AT_QUALITY_TIER = 30;
+
+    /** Longest wait before updateQualityTier() retries a better tier that exceeded the budget */
+    static const int MAX_UPGRADE_BACKOFF_FRAMES = 64 * MIN_FRAMES_AT_QUALITY_TIER;
+
+    /** Must match GROUP_SIZE in UniversalBlur_universalGather.glc */
+    static const int COMPUTE_GATHER_GROUP_SIZE = 16;
+
+    /** Shared memory per cached texel in UniversalBlur_universalGather.glc */
+    static const int COMPUTE_GATHER_BYTES_PER_TEXEL = 20;
+
+    /** GLSL image format qualifier for \a format, or nullptr if the compute gather cannot write it */
+    static const char* imageFormatQualifier(const ImageFormat* format) {
+        if (format == ImageFormat::RGBA16F()) {
+            return "rgba16f";
+        } else if (format == ImageFormat::RGBA32F()) {
+            return "rgba32f";
+        } else if (format == ImageFormat::R11G11B10F()) {
+            return "r11f_g11f_b10f";
+        } else if (format == ImageFormat::RGBA8()) {
+            return "rgba8";
+        } else {
+            return nullptr;
+        }
+    }
     
     void UniversalBlur::apply
     (RenderDevice* rd,
@@ -23,6 +56,8 @@ namespace G3D {
         DebugOption debugOption)
     {
 
+        updateQualityTier(camera->universalBlurSettings());
+
         // DoF Part of the function starts here ---------------------------------------------
         
         {
@@ -40,7 +75,9 @@ namespace G3D {
             const bool diskFramebuffer = camera->depthOfFieldSettings().diskFramebuffer();
 
             debugAssert(maxCoCRadiusPixels >= 0.0f);
+            BEGIN_PROFILER_EVENT("G3D::UniversalBlur::computeCoC");
             computeCoC(rd, color, depth, camera, trimBandThickness, farRadiusRescale, maxCoCRadiusPixels);
+            END_PROFILER_EVENT();
             //universalBlurPass(rd,velocity, m_packedBuffer, m_packedBuffer, m_neighborMinMaxFramebuffer->texture(0), m_horizontalFramebuffer, true, camera, viewport, maxCoCRadiusPixels, trimBandThickness, exposureTimeFraction, maxBlurRadiusPixels, diskFramebuffer);
             //universalBlurPass(rd, velocity, m_tempBlurBuffer, m_tempNearBuffer, m_neighborMinMaxFramebuffer->texture(0), m_verticalFramebuffer, false, camera, viewport, maxCoCRadiusPixels, trimBandThickness, exposureTimeFraction, maxBlurRadiusPixels, diskFramebuffer);
             //blurPass(rd, m_packedBuffer, m_packedBuffer, m_horizontalFramebuffer, true, camera, viewport, maxCoCRadiusPixels, diskFramebuffer);
@@ -58,24 +95,33 @@ namespace G3D {
 
         const int   dimension = (camera->fieldOfViewDirection() == FOVDirection::HORIZONTAL) ? color->width() : color->height();
 
-        const int   maxBlurRadiusPixels = max(4, iCeil(float(dimension) * camera->motionBlurSettings().maxBlurDiameterFraction() / 2.0f));
-        const int   numSamplesOdd = nextOdd(camera->motionBlurSettings().numSamples());
+        const UniversalBlurSettings& settings = camera->universalBlurSettings();
+        const int   maxBlurRadiusPixels = max(4, iCeil(float(dimension) * settings.effectiveMaxBlurDiameterFraction(camera->motionBlurSettings()) / 2.0f));
+        const bool  temporal = settings.temporalAccumulation();
+        const int   numSamplesOdd = nextOdd(settings.effectiveNumSamples(camera->motionBlurSettings()));
         const float exposureTimeFraction = camera->motionBlurSettings().exposureFraction();
+        const int   reducedResolutionFactor = settings.effectiveReducedResolutionFactor();
 
-        updateBuffers(velocity, maxBlurRadiusPixels, trimBandThickness);
+        const Rect2D& viewport = color->rect2DBounds();
+        const float maxCoCRadiusPixels = ceil(camera->maxCircleOfConfusionRadiusPixels(viewport));
+        const int   maxCoCTileRadius = iCeil(maxCoCRadiusPixels / float(maxBlurRadiusPixels));
+
+        static const bool supportsComputeShaders = GLCaps::supports("GL_ARB_compute_shader");
+        const bool computeTiles = m_computeShaderTileMinMax && supportsComputeShaders;
+
+        updateBuffers(velocity, maxBlurRadiusPixels, trimBandThickness, reducedResolutionFactor, ! computeTiles);
 
         shared_ptr<Texture> src;
 
-        // Copy the input to another buffer
+        // Position of the trimmed image within src
+        Vector2int16 colorBufferOffset(0, 0);
 
-        if (((notNull(rd->framebuffer()) &&
-            (color == rd->framebuffer()->get(Framebuffer::COLOR0)->texture())) ||
-            !trimBandThickness.isZero())) {
+        if (notNull(rd->framebuffer()) &&
+            (color == rd->framebuffer()->get(Framebuffer::COLOR0)->texture())) {
             // The input color buffer is the current framebuffer's draw target.
             // Make a copy so that we can read from it during the final gatherBlur pass.
-            // Note that if we knew that we were performing multiple effects at the same time
-            // (e.g., Film, DepthOfField, and MotionBlur), we could avoid this copy by 
-            // connecting the output of one to the input of the next.
+            // PostProcessChain avoids this copy by connecting the output of one
+            // effect to the input of the next.
 
             if (isNull(m_cachedSrc) || (m_cachedSrc->format() != color->format())) {
                 // Reallocate the underlying texture
@@ -93,16 +139,55 @@ namespace G3D {
 
         }
         else {
+            // Read around the trim band in place instead of stripping it
             src = color;
+            colorBufferOffset = trimBandThickness;
         }
 
-        computeTileMinMax(rd, velocity, maxBlurRadiusPixels, trimBandThickness);
-        computeNeighborMinMax(rd, m_tileMinMaxFramebuffer->texture(0));
-        
-        const Rect2D& viewport = color->rect2DBounds();
-        const float maxCoCRadiusPixels = ceil(camera->maxCircleOfConfusionRadiusPixels(viewport));
-        universalGatherBlur(rd, src, m_neighborMinMaxFramebuffer->texture(0), velocity, depth, m_packedBuffer, camera, true, numSamplesOdd, maxBlurRadiusPixels, maxCoCRadiusPixels, exposureTimeFraction, trimBandThickness);
-        universalGatherBlur(rd, m_speedDirectionPassColorBuffer->texture(0), m_neighborMinMaxFramebuffer->texture(0), velocity, depth, m_packedBuffer, camera, false, numSamplesOdd, maxBlurRadiusPixels, maxCoCRadiusPixels, exposureTimeFraction, trimBandThickness);
+        BEGIN_PROFILER_EVENT("G3D::UniversalBlur::computeTileMinMax");
+        if (computeTiles) {
+            computeTileMinMaxWithComputeShader(rd, velocity, maxBlurRadiusPixels, trimBandThickness);
+        } else {
+            computeTileMinMax(rd, velocity, maxBlurRadiusPixels, trimBandThickness);
+        }
+        END_PROFILER_EVENT();
+
+        BEGIN_PROFILER_EVENT("G3D::UniversalBlur::computeNeighborMinMax");
+        computeNeighborMinMax(rd, m_tileMinMaxFramebuffer->texture(0), maxCoCTileRadius);
+        END_PROFILER_EVENT();
+
+        shared_ptr<Texture> gatherSrc = src;
+        Vector2int16 gatherSrcOffset = colorBufferOffset;
+        if (reducedResolutionFactor > 1) {
+            BEGIN_PROFILER_EVENT("G3D::UniversalBlur::downsample");
+            downsample(rd, src, reducedResolutionFactor, colorBufferOffset);
+            END_PROFILER_EVENT();
+            gatherSrc = m_reducedColorFramebuffer->texture(0);
+            gatherSrcOffset = Vector2int16(0, 0);
+        }
+
+        BEGIN_PROFILER_EVENT("G3D::UniversalBlur::universalGatherBlur (speed direction)");
+        universalGatherBlur(rd, gatherSrc, m_neighborMinMaxFramebuffer->texture(0), velocity, depth, m_packedBuffer, camera, true, numSamplesOdd, maxBlurRadiusPixels, maxCoCRadiusPixels, exposureTimeFraction, trimBandThickness, reducedResolutionFactor, gatherSrcOffset);
+        END_PROFILER_EVENT();
+
+        const shared_ptr<Framebuffer>& speedDirectionPass = (reducedResolutionFactor > 1) ? m_reducedSpeedDirectionFramebuffer : m_speedDirectionPassColorBuffer;
+        BEGIN_PROFILER_EVENT("G3D::UniversalBlur::universalGatherBlur (perpendicular)");
+        universalGatherBlur(rd, speedDirectionPass->texture(0), m_neighborMinMaxFramebuffer->texture(0), velocity, depth, m_packedBuffer, camera, false, numSamplesOdd, maxBlurRadiusPixels, maxCoCRadiusPixels, exposureTimeFraction, trimBandThickness, reducedResolutionFactor);
+        END_PROFILER_EVENT();
+
+        if (reducedResolutionFactor > 1) {
+            BEGIN_PROFILER_EVENT("G3D::UniversalBlur::upsample");
+            upsample(rd, src, depth, velocity, camera, maxCoCRadiusPixels, exposureTimeFraction, trimBandThickness, reducedResolutionFactor, colorBufferOffset);
+            END_PROFILER_EVENT();
+        }
+
+        if (temporal) {
+            BEGIN_PROFILER_EVENT("G3D::UniversalBlur::temporalAccumulate");
+            temporalAccumulate(rd, depth, velocity, camera, maxBlurRadiusPixels, maxCoCRadiusPixels, exposureTimeFraction, trimBandThickness);
+            END_PROFILER_EVENT();
+        } else {
+            m_historyValid = false;
+        }
         
         
 
@@ -114,6 +199,15 @@ namespace G3D {
         }
 
         END_PROFILER_EVENT();
+
+        // Outside of the profiled events so that it does not count toward the blur's own time
+        if (Profiler::enabled()) {
+            computeAverageSamplesPerPixel(camera, numSamplesOdd, maxBlurRadiusPixels, maxCoCRadiusPixels, exposureTimeFraction,
+                Vector2int16(velocity->width() - trimBandThickness.x * 2, velocity->height() - trimBandThickness.y * 2));
+        } else {
+            releaseSamplesPerPixelFence();
+            m_averageSamplesPerPixel = -1.0f;
+        }
     }
 
 
@@ -136,6 +230,10 @@ namespace G3D {
 
         args.setMacro("maxBlurRadius", maxBlurRadiusPixels);
 
+        // Also find the largest circle of confusion in each tile, for classifying tiles
+        args.setMacro("TILE_MAX_COC", 1);
+        args.setUniform("packedBuffer", m_packedBuffer, Sampler::buffer());
+
         // Horizontal pass
         rd->push2D(m_tileMinMaxTempFramebuffer); {
             rd->clear();
@@ -163,7 +261,8 @@ namespace G3D {
 
     void UniversalBlur::computeNeighborMinMax
     (RenderDevice* rd,
-        const shared_ptr<Texture>& tileMax) {
+        const shared_ptr<Texture>& tileMax,
+        int                        maxCoCTileRadius) {
 
         rd->push2D(m_neighborMinMaxFramebuffer); {
 
@@ -181,6 +280,8 @@ namespace G3D {
                 GBuffer::Field::SS_POSITION_CHANGE,
                 tileMax->encoding());
 
+            args.setMacro("NEIGHBOR_MAX_COC", 1);
+            args.setUniform("maxCoCTileRadius", maxCoCTileRadius);
             args.setRect(rd->viewport());
             LAUNCH_SHADER("MotionBlur_neighborMinMax.*", args);
 
@@ -224,6 +325,7 @@ namespace G3D {
             args.setUniform("depthBuffer", depth, Sampler::buffer());
 
             args.setUniform("trimBandThickness", trimBandThickness);
+            args.setUniform("colorBufferOffset", Vector2int16(0, 0));
 
             args.setRect(rd->viewport());
             LAUNCH_SHADER("MotionBlur_gather.*", args);
@@ -231,6 +333,45 @@ namespace G3D {
         } rd->pop2D();
     }
 
+    void UniversalBlur::computeTileMinMaxWithComputeShader
+    (RenderDevice* rd,
+        const shared_ptr<Texture>& velocity,
+        int                        maxBlurRadiusPixels,
+        Vector2int16               trimBandThickness) {
+
+        const shared_ptr<Texture>& tileMinMax = m_tileMinMaxFramebuffer->texture(0);
+
+        Args args;
+        GBuffer::bindReadArgs
+        (args,
+            GBuffer::Field::SS_POSITION_CHANGE,
+            velocity);
+
+        GBuffer::bindWriteUniform
+        (args,
+            GBuffer::Field::SS_POSITION_CHANGE,
+            velocity->encoding());
+
+        args.setUniform("packedBuffer", m_packedBuffer, Sampler::buffer());
+        args.setUniform("trimBandThickness", trimBandThickness);
+
+        args.setMacro("maxBlurRadius", maxBlurRadiusPixels);
+        args.setMacro("TILE_IMAGE_FORMAT", (tileMinMax->format()->numberFormat == ImageFormat::FLOATING_POINT_FORMAT) ? "rgba16f" : "rgba8");
+
+        args.setImageUniform("tileMinMaxImage", tileMinMax, Access::WRITE);
+
+        // One work group per tile. Must match GROUP_SIDE in the shader.
+        const int groupSide = 8;
+        args.setComputeGroupSize(Vector3int32(groupSide, groupSide, 1));
+        args.setComputeGridDim(Vector3int32(tileMinMax->width(), tileMinMax->height(), 1));
+
+        LAUNCH_SHADER("UniversalBlur_tileMinMax.glc", args);
+
+        // computeNeighborMinMax() reads the result as a texture
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+    }
+
+
     void UniversalBlur::universalGatherBlur
     (RenderDevice* rd,
         const shared_ptr<Texture>& color,
@@ -244,16 +385,29 @@ namespace G3D {
         int                               maxBlurRadiusPixels,
         float                             maxCoCRadiusPixels,
         float                             exposureTimeFraction,
-        Vector2int16                      trimBandThickness)
+        Vector2int16                      trimBandThickness,
+        int                               reducedResolutionFactor,
+        Vector2int16                      colorBufferOffset)
     {
-        // Select temp buffer or draw buffer as output depending if it's the first or second pass
-        std::shared_ptr<G3D::Framebuffer> output = isSpeedDirection ? m_speedDirectionPassColorBuffer : rd->drawFramebuffer();
+        // Select temp buffer or draw buffer as output depending if it's the first or second pass.
+        // At reduced resolution, both passes write to temp buffers that upsample() composites.
+        std::shared_ptr<G3D::Framebuffer> output;
+        if (reducedResolutionFactor > 1) {
+            output = isSpeedDirection ? m_reducedSpeedDirectionFramebuffer : m_reducedResultFramebuffer;
+        } else {
+            output = isSpeedDirection ? m_speedDirectionPassColorBuffer : rd->drawFramebuffer();
+        }
         //std::shared_ptr<G3D::Framebuffer> output = isSpeedDirection ? m_colorBuffer : rd->drawFramebuffer();
 
+        // Bounds of the full-resolution trimmed color, which color is reduced from
+        const Rect2D& colorBounds = Rect2D::xywh(0.0f, 0.0f,
+            float((color->width() - colorBufferOffset.x * 2) * reducedResolutionFactor),
+            float((color->height() - colorBufferOffset.y * 2) * reducedResolutionFactor));
+
         // Dimension along which the blur fraction is measured
         const float dimension =
             float((camera->fieldOfViewDirection() == FOVDirection::HORIZONTAL) ?
-                color->rect2DBounds().width() : color->rect2DBounds().height());
+                colorBounds.width() : colorBounds.height());
         
         // Compute the worst-case near plane blur
         int nearBlurRadiusPixels;
@@ -266,11 +420,11 @@ namespace G3D {
                 n = -camera->circleOfConfusionRadiusPixels(
                     min(camera->m_closestNearPlaneZForDepthOfField,
                         camera->projection().nearPlaneZ()),
-                    color->rect2DBounds());
+                    colorBounds);
             }
 
             // Clamp to the maximum permitted radius for this camera
-            nearBlurRadiusPixels = iCeil(min(camera->m_viewportFractionMaxCircleOfConfusion * color->rect2DBounds().width(), n));
+            nearBlurRadiusPixels = iCeil(min(camera->m_viewportFractionMaxCircleOfConfusion * colorBounds.width(), n));
 
             if (nearBlurRadiusPixels < camera->depthOfFieldSettings().reducedResolutionFactor() - 1) {
                 // Avoid ever showing the downsampled buffer without blur
@@ -283,7 +437,10 @@ namespace G3D {
         //rd->push2D(); {
         rd->push2D(output); { // HUGO ------------
             rd->clear(true, false, false);
-            rd->setGuardBandClip2D(trimBandThickness);
+            if (reducedResolutionFactor == 1) {
+                // The reduced-resolution buffers have no trim band
+                rd->setGuardBandClip2D(trimBandThickness);
+            }
 
             Args args;
 
@@ -309,21 +466,183 @@ namespace G3D {
             //args.setUniform("isSpeedDirection", isSpeedDirection);
             args.setMacro("MODEL", camera->depthOfFieldSettings().model().toString());
             args.setMacro("SPEED_DIRECTION", isSpeedDirection ? 1 : 0);
+            args.setMacro("GATHER_SCALE", reducedResolutionFactor);
+
+            const UniversalBlurSettings& settings = camera->universalBlurSettings();
+            const int minNumSamples = nextOdd(settings.minNumSamples());
+            args.setMacro("ADAPTIVE_SAMPLE_COUNT", settings.adaptiveSampleCount() ? 1 : 0);
+            args.setUniform("minNumSamples", minNumSamples);
+            args.setUniform("maxNumSamples", max(minNumSamples, nextOdd(settings.maxNumSamples())));
+
+            // Under temporal accumulation, shift the sample pattern every frame by a
+            // base-2 van der Corput offset on [-0.5, 0.5) so that history averages it out
+            float temporalJitter = 0.0f;
+            if (settings.temporalAccumulation()) {
+                uint32 bits = uint32(m_temporalFrameIndex & 0xFF);
+                float  radicalInverse = 0.0f;
+                for (float scale = 0.5f; bits != 0; bits >>= 1, scale *= 0.5f) {
+                    radicalInverse += float(bits & 1) * scale;
+                }
+                temporalJitter = radicalInverse - 0.5f;
+            }
+            args.setUniform("temporalJitter", temporalJitter);
+
+            args.setUniform("depthBuffer", depth, Sampler::buffer());
+
+            args.setUniform("trimBandThickness", trimBandThickness);
+            args.setUniform("colorBufferOffset", colorBufferOffset);
+
+            // The compute gather caches the samples within maxCoCRadiusPixels of each work group
+            // in shared memory, so it only runs at full resolution and when that cache fits
+            static const bool supportsComputeShaders = GLCaps::supports("GL_ARB_compute_shader");
+            static GLint maxSharedMemoryBytes = 0;
+            if (supportsComputeShaders && (maxSharedMemoryBytes == 0)) {
+                glGetIntegerv(GL_MAX_COMPUTE_SHARED_MEMORY_SIZE, &maxSharedMemoryBytes);
+            }
+
+            const int padding = int(maxCoCRadiusPixels);
+            const int cacheSide = COMPUTE_GATHER_GROUP_SIZE + 2 * padding;
+
+            // The compute gather also needs an output texture with an image format. A window or
+            // renderbuffer target has no COLOR0 texture, so it falls back to the raster gather.
+            shared_ptr<Texture> outputTexture;
+            const char* resultFormat = nullptr;
+            if (m_computeShaderGather && supportsComputeShaders && (reducedResolutionFactor == 1) &&
+                (camera->depthOfFieldSettings().reducedResolutionFactor() == 1) &&
+                (cacheSide * cacheSide * COMPUTE_GATHER_BYTES_PER_TEXEL <= maxSharedMemoryBytes)) {
+                outputTexture = output->texture(0);
+                if (notNull(outputTexture)) {
+                    resultFormat = imageFormatQualifier(outputTexture->format());
+                }
+            }
+
+            if (notNull(resultFormat)) {
+
+                args.setMacro("MOTION_BLUR", camera->universalBlurSettings().MbAlgorithm() ? 1 : 0);
+                args.setMacro("DEPTH_OF_FIELD", camera->universalBlurSettings().DofAlgorithm() ? 1 : 0);
+                args.setMacro("PADDING", padding);
+                args.setMacro("RESULT_IMAGE_FORMAT", resultFormat);
+                args.setImageUniform("resultImage", outputTexture, Access::WRITE);
+
+                args.setComputeGroupSize(Vector3int32(COMPUTE_GATHER_GROUP_SIZE, COMPUTE_GATHER_GROUP_SIZE, 1));
+                args.setComputeGridDim(Vector3int32
+                   (iCeil((outputTexture->width() - trimBandThickness.x * 2) / float(COMPUTE_GATHER_GROUP_SIZE)),
+                    iCeil((outputTexture->height() - trimBandThickness.y * 2) / float(COMPUTE_GATHER_GROUP_SIZE)), 1));
+
+                LAUNCH_SHADER("UniversalBlur_universalGather.glc", args);
+
+                // The next pass reads the result as a texture or a framebuffer
+                glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+            } else if (m_tileClassification) {
+                drawClassifiedTiles(rd, args, camera, neighborMax);
+            } else {
+                args.setMacro("MOTION_BLUR", camera->universalBlurSettings().MbAlgorithm());
+                args.setMacro("DEPTH_OF_FIELD", camera->universalBlurSettings().DofAlgorithm());
+                args.setRect(rd->viewport());
+                LAUNCH_SHADER("MotionBlur_universalGather.*", args);
+            }
+
+        } rd->pop2D();
+    }
+
+
+    void UniversalBlur::drawClassifiedTiles
+    (RenderDevice* rd,
+        Args& args,
+        const shared_ptr<Camera>& camera,
+        const shared_ptr<Texture>& neighborMax)
+    {
+        if (! m_tileQuadVertices.valid()) {
+            Array<Vector2> position;
+            position.append(Vector2(0, 0), Vector2(1, 0), Vector2(1, 1), Vector2(0, 1));
+            Array<int> index;
+            index.append(0, 1, 2, 0, 2, 3);
+
+            const shared_ptr<VertexBuffer>& area = VertexBuffer::create(position.size() * sizeof(Vector2) + index.size() * sizeof(int), VertexBuffer::WRITE_ONCE);
+            m_tileQuadVertices = AttributeArray(position, area);
+            m_tileQuadIndices = IndexStream(index, area);
+        }
+
+        const int enabledClassMask =
+            (camera->universalBlurSettings().MbAlgorithm() ? MOTION_BLUR_TILE : 0) |
+            (camera->universalBlurSettings().DofAlgorithm() ? DEPTH_OF_FIELD_TILE : 0);
+
+        // One quad per tile; the vertex shader culls the tiles of other classes
+        args.setAttributeArray("g3d_Vertex", m_tileQuadVertices);
+        args.setIndexStream(m_tileQuadIndices);
+        args.setPrimitiveType(PrimitiveType::TRIANGLES);
+        args.setNumInstances(neighborMax->width() * neighborMax->height());
+        args.setUniform("enabledClassMask", enabledClassMask);
+
+        rd->setCullFace(CullFace::NONE);
+        for (int tileClass = SHARP_TILE; tileClass <= COMBINED_TILE; ++tileClass) {
+            if ((tileClass & enabledClassMask) != tileClass) {
+                // Cannot occur with the effects that are enabled
+                continue;
+            }
+
+            // Sharp tiles compile to a straight copy of the input
+            args.setMacro("TILE_CLASS", tileClass);
+            args.setMacro("MOTION_BLUR", (tileClass & MOTION_BLUR_TILE) ? 1 : 0);
+            args.setMacro("DEPTH_OF_FIELD", (tileClass & DEPTH_OF_FIELD_TILE) ? 1 : 0);
+            LAUNCH_SHADER("UniversalBlur_tileClassify.*", args);
+        }
+    }
+
+
+    void UniversalBlur::downsample(RenderDevice* rd, const shared_ptr<Texture>& color, int reducedResolutionFactor, Vector2int16 colorBufferOffset) {
+        rd->push2D(m_reducedColorFramebuffer); {
+            Args args;
+            args.setMacro("GATHER_SCALE", reducedResolutionFactor);
+            args.setUniform("colorBuffer", color, Sampler::buffer());
+            args.setUniform("colorBufferOffset", colorBufferOffset);
+            args.setRect(rd->viewport());
+            LAUNCH_SHADER("UniversalBlur_downsample.*", args);
+        } rd->pop2D();
+    }
+
+
+    void UniversalBlur::upsample
+    (RenderDevice* rd,
+        const shared_ptr<Texture>& color,
+        const shared_ptr<Texture>& depth,
+        const shared_ptr<Texture>& velocity,
+        const shared_ptr<Camera>& camera,
+        float                      maxCoCRadiusPixels,
+        float                      exposureTimeFraction,
+        Vector2int16               trimBandThickness,
+        int                        reducedResolutionFactor,
+        Vector2int16               colorBufferOffset) {
+
+        rd->push2D(rd->drawFramebuffer()); {
+            rd->clear(true, false, false);
+            rd->setGuardBandClip2D(trimBandThickness);
+
+            Args args;
+            GBuffer::bindReadArgs(args, GBuffer::Field::SS_POSITION_CHANGE, velocity);
+
+            args.setMacro("GATHER_SCALE", reducedResolutionFactor);
             args.setMacro("MOTION_BLUR", camera->universalBlurSettings().MbAlgorithm());
             args.setMacro("DEPTH_OF_FIELD", camera->universalBlurSettings().DofAlgorithm());
 
+            args.setUniform("reducedBuffer", m_reducedResultFramebuffer->texture(0), Sampler::buffer());
+            args.setUniform("reducedColorBuffer", m_reducedColorFramebuffer->texture(0), Sampler::buffer());
+            args.setUniform("colorBuffer", color, Sampler::buffer());
+            args.setUniform("colorBufferOffset", colorBufferOffset);
+            args.setUniform("packedBuffer", m_packedBuffer, Sampler::buffer());
             args.setUniform("depthBuffer", depth, Sampler::buffer());
 
+            args.setUniform("exposureTime", exposureTimeFraction);
+            args.setUniform("maxCoCRadiusPixels", int(maxCoCRadiusPixels));
             args.setUniform("trimBandThickness", trimBandThickness);
 
             args.setRect(rd->viewport());
-            LAUNCH_SHADER("MotionBlur_universalGather.*", args);
-
+            LAUNCH_SHADER("UniversalBlur_upsample.*", args);
         } rd->pop2D();
     }
 
 
-    void UniversalBlur::updateBuffers(const shared_ptr<Texture>& velocityTexture, int maxBlurRadiusPixels, Vector2int16 inputGuardBandThickness) {
+    void UniversalBlur::updateBuffers(const shared_ptr<Texture>& velocityTexture, int maxBlurRadiusPixels, Vector2int16 inputGuardBandThickness, int reducedResolutionFactor, bool needTempBuffer) {
         const int w = (velocityTexture->width() - inputGuardBandThickness.x * 2);
         const int h = (velocityTexture->height() - inputGuardBandThickness.y * 2);
 
@@ -331,24 +650,29 @@ namespace G3D {
         const int smallWidth = iCeil(w / float(maxBlurRadiusPixels));
         const int smallHeight = iCeil(h / float(maxBlurRadiusPixels));
 
-        if (isNull(m_tileMinMaxFramebuffer)) {
-            const bool generateMipMaps = false;
-            Texture::Encoding encoding = velocityTexture->encoding();
-
-            // Add a "G" channel
-            if (encoding.format->numberFormat == ImageFormat::FLOATING_POINT_FORMAT) {
-                encoding.format = ImageFormat::RGB16F();
-            }
-            else {
-                encoding.format = ImageFormat::RGB8();
-            }
-            // Ensure consistent mapping across the new G channel
-            encoding.readMultiplyFirst.g = encoding.readMultiplyFirst.r;
-            encoding.readAddSecond.g = encoding.readAddSecond.r;
+        const bool generateMipMaps = false;
+        Texture::Encoding encoding = velocityTexture->encoding();
 
+        // Add a "G" channel, and an "A" channel for the maximum circle of confusion
+        if (encoding.format->numberFormat == ImageFormat::FLOATING_POINT_FORMAT) {
+            encoding.format = ImageFormat::RGBA16F();
+        }
+        else {
+            encoding.format = ImageFormat::RGBA8();
+        }
+        // Ensure consistent mapping across the new G channel
+        encoding.readMultiplyFirst.g = encoding.readMultiplyFirst.r;
+        encoding.readAddSecond.g = encoding.readAddSecond.r;
+
+        if (! needTempBuffer) {
+            // The compute path does not use the transposed buffer
+            m_tileMinMaxTempFramebuffer.reset();
+        } else if (isNull(m_tileMinMaxTempFramebuffer)) {
             m_tileMinMaxTempFramebuffer = Framebuffer::create(Texture::createEmpty("G3D::MotionBlur::m_tileMinMaxTempFramebuffer", h, smallWidth, encoding, Texture::DIM_2D, generateMipMaps));
             m_tileMinMaxTempFramebuffer->texture(0)->visualization = Texture::Visualization::unitVector();
+        }
 
+        if (isNull(m_tileMinMaxFramebuffer)) {
             m_tileMinMaxFramebuffer = Framebuffer::create(Texture::createEmpty("G3D::MotionBlur::m_tileMinMaxFramebuffer", smallWidth, smallHeight, encoding, Texture::DIM_2D, generateMipMaps));
             m_tileMinMaxFramebuffer->texture(0)->visualization = Texture::Visualization::unitVector();
 
@@ -373,19 +697,43 @@ namespace G3D {
 
         // Resize if needed
         m_tileMinMaxFramebuffer->resize(smallWidth, smallHeight);
-        m_tileMinMaxTempFramebuffer->resize(h, smallWidth);
+        if (needTempBuffer) {
+            m_tileMinMaxTempFramebuffer->resize(h, smallWidth);
+        }
         m_neighborMinMaxFramebuffer->resize(smallWidth, smallHeight);
 
         m_speedDirectionPassColorBuffer->resize(w, h);
         //m_colorBuffer->resize(w, h);
+
+        if (reducedResolutionFactor > 1) {
+            const int reducedWidth = iCeil(w / float(reducedResolutionFactor));
+            const int reducedHeight = iCeil(h / float(reducedResolutionFactor));
+
+            if (isNull(m_reducedColorFramebuffer)) {
+                m_reducedColorFramebuffer = Framebuffer::create(Texture::createEmpty("G3D::UniversalBlur::m_reducedColorFramebuffer", reducedWidth, reducedHeight, ImageFormat::RGBA16F(), Texture::DIM_2D, false));
+                m_reducedSpeedDirectionFramebuffer = Framebuffer::create(Texture::createEmpty("G3D::UniversalBlur::m_reducedSpeedDirectionFramebuffer", reducedWidth, reducedHeight, ImageFormat::RGBA16F(), Texture::DIM_2D, false));
+                m_reducedResultFramebuffer = Framebuffer::create(Texture::createEmpty("G3D::UniversalBlur::m_reducedResultFramebuffer", reducedWidth, reducedHeight, ImageFormat::RGBA16F(), Texture::DIM_2D, false));
+            }
+
+            m_reducedColorFramebuffer->resize(reducedWidth, reducedHeight);
+            m_reducedSpeedDirectionFramebuffer->resize(reducedWidth, reducedHeight);
+            m_reducedResultFramebuffer->resize(reducedWidth, reducedHeight);
+        }
     }
     
 
     
-    UniversalBlur::UniversalBlur() : m_debugShowTiles(false) 
+    UniversalBlur::UniversalBlur() : m_debugShowTiles(false), m_tileClassification(true), m_computeShaderTileMinMax(true), m_computeShaderGather(true), m_averageSamplesPerPixel(-1.0f),
+        m_historyIndex(0), m_historyValid(false), m_temporalFrameIndex(0), m_smoothedBlurTime(-1.0f), m_framesAtQualityTier(0),
+        m_upgradeBackoffFrames(MIN_FRAMES_AT_QUALITY_TIER), m_enteredQualityTierByUpgrade(false), m_samplesPerPixelFence(nullptr)
     {
 
     }
+
+
+    UniversalBlur::~UniversalBlur() {
+        releaseSamplesPerPixelFence();
+    }
     
 
     
@@ -395,6 +743,231 @@ namespace G3D {
         //return createShared<UniversalBlur>(debugName);
     }
 
+    void UniversalBlur::updateQualityTier(UniversalBlurSettings& settings) {
+        // Weight of each new measurement in m_smoothedBlurTime
+        const float SMOOTHING = 0.1f;
+
+
+        ++m_framesAtQualityTier;
+        if (! settings.automaticQuality() || ! Profiler::enabled()) {
+            m_smoothedBlurTime = -1.0f;
+            return;
+        }
+
+        // Total GPU time of the top-level events of the previous frame's apply() calls
+        float blurTime = 0.0f;
+        bool  found = false;
+        Array<const Array<Profiler::Event>*> eventTreeArray;
+        Profiler::getEvents(eventTreeArray);
+        for (const Array<Profiler::Event>* tree : eventTreeArray) {
+            for (const Profiler::Event& event : *tree) {
+                if ((event.name() == "G3D::UniversalBlur::DepthOfField::apply") ||
+                    (event.name() == "G3D::UniversalBlur::MotionBlur::apply")) {
+                    blurTime += float(event.gfxDuration());
+                    found = true;
+                }
+            }
+        }
+
+        if (! found) {
+            return;
+        }
+
+        m_smoothedBlurTime = (m_smoothedBlurTime < 0.0f) ? blurTime : lerp(m_smoothedBlurTime, blurTime, SMOOTHING);
+
+        if (m_framesAtQualityTier < MIN_FRAMES_AT_QUALITY_TIER) {
+            return;
+        }
+
+        if (m_rejectedTierTime.size() != settings.qualityTiers().size()) {
+            m_rejectedTierTime.resize(settings.qualityTiers().size());
+            m_rejectedTierTime.setAll(-1.0f);
+        }
+
+        const float budget = settings.frameBudgetMilliseconds() * float(units::milliseconds());
+        const int   tier = settings.qualityTier();
+        if ((m_smoothedBlurTime > budget) && (tier < settings.qualityTiers().size() - 1)) {
+            // Remember why this tier was abandoned so that it is not immediately retried
+            m_rejectedTierTime[tier] = m_smoothedBlurTime;
+            if (m_enteredQualityTierByUpgrade) {
+                // A failed upgrade. Wait twice as long before the next attempt.
+                m_upgradeBackoffFrames = min(m_upgradeBackoffFrames * 2, MAX_UPGRADE_BACKOFF_FRAMES);
+            }
+            settings.setQualityTier(tier + 1);
+            m_enteredQualityTierByUpgrade = false;
+        } else if ((m_smoothedBlurTime < budget * (1.0f - settings.qualityHysteresis())) && (tier > 0)) {
+            // The hysteresis band cannot prevent oscillation when the better tier alone exceeds
+            // the budget, so a better tier that was measured over budget is only retried after
+            // the backoff, in case the scene has become cheaper since
+            if ((m_rejectedTierTime[tier - 1] > budget) && (m_framesAtQualityTier < m_upgradeBackoffFrames)) {
+                return;
+            }
+            settings.setQualityTier(tier - 1);
+            m_enteredQualityTierByUpgrade = true;
+        } else {
+            if (m_enteredQualityTierByUpgrade && (m_framesAtQualityTier >= m_upgradeBackoffFrames)) {
+                // The upgrade held, so the budget is no longer known to be exceeded here
+                m_rejectedTierTime[tier] = -1.0f;
+                m_upgradeBackoffFrames = MIN_FRAMES_AT_QUALITY_TIER;
+            }
+            return;
+        }
+
+        // Measure the new tier from scratch
+        m_smoothedBlurTime = -1.0f;
+        m_framesAtQualityTier = 0;
+    }
+
+
+    void UniversalBlur::temporalAccumulate
+    (RenderDevice* rd,
+        const shared_ptr<Texture>& depth,
+        const shared_ptr<Texture>& velocity,
+        const shared_ptr<Camera>& camera,
+        int                        maxBlurRadiusPixels,
+        float                      maxCoCRadiusPixels,
+        float                      exposureTimeFraction,
+        Vector2int16               trimBandThickness)
+    {
+        // The gather result, which is also the final destination
+        const shared_ptr<Framebuffer> output = rd->drawFramebuffer();
+        const shared_ptr<Texture>     current = notNull(output) ? output->texture(0) : nullptr;
+
+        if (isNull(current)) {
+            // A window or renderbuffer target cannot be read back as a texture, so there
+            // is nothing to accumulate. The history no longer follows the output.
+            m_historyValid = false;
+            return;
+        }
+
+        for (int i = 0; i < 2; ++i) {
+            if (isNull(m_historyFramebuffer[i])) {
+                m_historyFramebuffer[i] = Framebuffer::create
+                   (Texture::createEmpty(format("G3D::UniversalBlur::m_historyFramebuffer[%d]", i), depth->width(), depth->height(), ImageFormat::RGBA16F(), Texture::DIM_2D, false),
+                    Texture::createEmpty(format("G3D::UniversalBlur::m_historyFramebuffer[%d] depth", i), depth->width(), depth->height(), ImageFormat::RG32F(), Texture::DIM_2D, false));
+                m_historyValid = false;
+            } else if ((m_historyFramebuffer[i]->width() != depth->width()) || (m_historyFramebuffer[i]->height() != depth->height())) {
+                m_historyFramebuffer[i]->resize(depth->width(), depth->height());
+                m_historyValid = false;
+            }
+        }
+
+        const shared_ptr<Framebuffer>& previous = m_historyFramebuffer[m_historyIndex];
+        const shared_ptr<Framebuffer>& next     = m_historyFramebuffer[1 - m_historyIndex];
+
+        rd->push2D(next); {
+            rd->setGuardBandClip2D(trimBandThickness);
+
+            Args args;
+            GBuffer::bindReadArgs
+            (args,
+                GBuffer::Field::SS_POSITION_CHANGE,
+                velocity);
+
+            args.setUniform("currentBuffer", current, Sampler::buffer());
+            args.setUniform("packedBuffer", m_packedBuffer, Sampler::buffer());
+            m_neighborMinMaxFramebuffer->texture(0)->setShaderArgs(args, "neighborMinMax_", Sampler::buffer());
+            args.setUniform("depthBuffer", depth, Sampler::buffer());
+            args.setUniform("previousBuffer", previous->texture(0), Sampler::video());
+            args.setUniform("previousDepthBuffer", previous->texture(1), Sampler::video());
+
+            args.setUniform("cameraToWorld", camera->frame());
+            args.setUniform("cameraToWorldPrevious", camera->previousFrame());
+            args.setUniform("clipInfo", camera->projection().reconstructFromDepthClipInfo());
+            args.setUniform("projInfo", camera->projection().reconstructFromDepthProjInfo(depth->width(), depth->height()));
+
+            args.setUniform("hysteresis", m_historyValid ? camera->universalBlurSettings().temporalHysteresis() : 0.0f);
+            args.setUniform("exposureTime", exposureTimeFraction);
+            args.setUniform("maxCoCRadiusPixels", int(maxCoCRadiusPixels));
+            args.setUniform("trimBandThickness", trimBandThickness);
+            args.setMacro("maxBlurRadius", maxBlurRadiusPixels);
+
+            args.setRect(rd->viewport());
+            LAUNCH_SHADER("UniversalBlur_temporal.*", args);
+        } rd->pop2D();
+
+        // Write the accumulated result back. The history itself is ping-ponged rather than copied.
+        rd->push2D(output); {
+            rd->setGuardBandClip2D(trimBandThickness);
+            Draw::rect2D(rd->viewport(), rd, Color3::white(), next->texture(0), Sampler::buffer());
+        } rd->pop2D();
+
+        m_historyIndex = 1 - m_historyIndex;
+        m_historyValid = true;
+        ++m_temporalFrameIndex;
+    }
+
+
+    void UniversalBlur::computeAverageSamplesPerPixel
+    (const shared_ptr<Camera>& camera,
+        int                        numSamplesOdd,
+        int                        maxBlurRadiusPixels,
+        float                      maxCoCRadiusPixels,
+        float                      exposureTimeFraction,
+        Vector2int16               trimmedSize) {
+
+        if (notNull(m_samplesPerPixelFence)) {
+            // Collect the result of an earlier frame only once the GPU has finished it, so
+            // that mapping the buffer does not stall. Flush so that the fence can signal.
+            const GLenum status = glClientWaitSync(m_samplesPerPixelFence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+            if ((status != GL_ALREADY_SIGNALED) && (status != GL_CONDITION_SATISFIED)) {
+                // Still in flight; measure a later frame instead
+                return;
+            }
+            releaseSamplesPerPixelFence();
+
+            m_averageSamplesPerPixel = *static_cast<const float*>(m_samplesPerPixelReadback->mapRead());
+            m_samplesPerPixelReadback->unmap();
+        }
+
+        if (isNull(m_samplesPerPixelTexture)) {
+            m_samplesPerPixelTexture = Texture::createEmpty("G3D::UniversalBlur::m_samplesPerPixelTexture", 1, 1, ImageFormat::R32F(), Texture::DIM_2D, false);
+            m_samplesPerPixelReadback = GLPixelTransferBuffer::create(1, 1, ImageFormat::R32F());
+        }
+
+        const shared_ptr<Texture>& neighborMax = m_neighborMinMaxFramebuffer->texture(0);
+        const Texture::Encoding& encoding = neighborMax->encoding();
+        const UniversalBlurSettings& settings = camera->universalBlurSettings();
+        const int minNumSamples = nextOdd(settings.minNumSamples());
+
+        Args args;
+        args.setUniform("neighborMinMax_buffer", neighborMax, Sampler::buffer());
+        args.setUniform("neighborMinMax_readMultiplyFirst", encoding.readMultiplyFirst);
+        args.setUniform("neighborMinMax_readAddSecond", encoding.readAddSecond);
+        args.setUniform("exposureTime", exposureTimeFraction);
+        args.setUniform("maxCoCRadiusPixels", maxCoCRadiusPixels);
+        args.setUniform("enabledClassMask",
+            (settings.MbAlgorithm() ? MOTION_BLUR_TILE : 0) |
+            (settings.DofAlgorithm() ? DEPTH_OF_FIELD_TILE : 0));
+        args.setUniform("numSamplesOdd", numSamplesOdd);
+        args.setUniform("minNumSamples", minNumSamples);
+        args.setUniform("maxNumSamples", max(minNumSamples, nextOdd(settings.maxNumSamples())));
+        args.setUniform("trimmedSize", trimmedSize);
+        args.setMacro("maxBlurRadius", maxBlurRadiusPixels);
+        args.setMacro("TILE_CLASSIFICATION", m_tileClassification ? 1 : 0);
+        args.setMacro("ADAPTIVE_SAMPLE_COUNT", settings.adaptiveSampleCount() ? 1 : 0);
+        args.setImageUniform("resultImage", m_samplesPerPixelTexture, Access::WRITE);
+
+        // A single work group. Must match GROUP_SIZE in the shader.
+        args.setComputeGroupSize(Vector3int32(256, 1, 1));
+        args.setComputeGridDim(Vector3int32(1, 1, 1));
+        LAUNCH_SHADER("UniversalBlur_samplesPerPixel.glc", args);
+
+        // Start an asynchronous copy into the pixel buffer, which a later frame maps
+        glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT | GL_PIXEL_BUFFER_BARRIER_BIT);
+        m_samplesPerPixelTexture->toPixelTransferBuffer(m_samplesPerPixelReadback);
+        m_samplesPerPixelFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+
+    void UniversalBlur::releaseSamplesPerPixelFence() {
+        if (notNull(m_samplesPerPixelFence)) {
+            glDeleteSync(m_samplesPerPixelFence);
+            m_samplesPerPixelFence = nullptr;
+        }
+    }
+
+
     void UniversalBlur::makeRandomBuffer() {
         static const int N = 32;
         Color3unorm8 buf[N * N];
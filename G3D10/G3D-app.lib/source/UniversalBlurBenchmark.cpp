@@ -0,0 +1,271 @@
+/**
+  \file G3D-app.lib/source/UniversalBlurBenchmark.cpp
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#include <stdlib.h>
+#include "G3D-base/Image.h"
+#include "G3D-base/TextOutput.h"
+#include "G3D-base/units.h"
+#include "G3D-gfx/Profiler.h"
+#include "G3D-gfx/RenderDevice.h"
+#include "G3D-gfx/Texture.h"
+#include "G3D-gfx/glcalls.h"
+#include "G3D-app/UniversalBlurBenchmark.h"
+#include "G3D-app/UniversalBlur.h"
+#include "G3D-app/UniversalBlurCPU.h"
+#include "G3D-app/MotionBlur.h"
+#include "G3D-app/DepthOfField.h"
+#include "G3D-app/Camera.h"
+
+namespace G3D {
+
+UniversalBlurBenchmark::Settings::Settings() : warmupFrames(3), timedFrames(20) {
+    resolutions.append(Vector2int32(1280, 720), Vector2int32(1920, 1080), Vector2int32(2560, 1440));
+    numSamples.append(7, 15, 27);
+    maxBlurDiameterFractions.append(0.05f, 0.10f);
+}
+
+
+UniversalBlurBenchmark::UniversalBlurBenchmark() {
+    m_universalBlur = UniversalBlur::create();
+    m_reference     = UniversalBlurCPU::create();
+    m_motionBlur    = MotionBlur::create();
+    m_depthOfField  = DepthOfField::create();
+
+    m_camera = Camera::create("G3D::UniversalBlurBenchmark::m_camera");
+
+    DepthOfFieldSettings& dof = m_camera->depthOfFieldSettings();
+    dof.setEnabled(true);
+    dof.setModel(DepthOfFieldModel::PHYSICAL);
+    dof.setFocusPlaneZ(-5.0f);
+    dof.setLensRadius(0.05f);
+
+    m_camera->motionBlurSettings().setEnabled(true);
+    m_camera->universalBlurSettings().setMbAlgorithm(true);
+    m_camera->universalBlurSettings().setDofAlgorithm(true);
+}
+
+
+shared_ptr<UniversalBlurBenchmark> UniversalBlurBenchmark::create() {
+    return createShared<UniversalBlurBenchmark>();
+}
+
+
+void UniversalBlurBenchmark::requestSoftwareRenderer() {
+#   ifdef G3D_WINDOWS
+        _putenv_s("LIBGL_ALWAYS_SOFTWARE", "1");
+        _putenv_s("GALLIUM_DRIVER", "llvmpipe");
+#   else
+        setenv("LIBGL_ALWAYS_SOFTWARE", "1", 1);
+        setenv("GALLIUM_DRIVER", "llvmpipe", 1);
+#   endif
+}
+
+
+void UniversalBlurBenchmark::makeFixtures(const Vector2int32& resolution) {
+    const int w = resolution.x;
+    const int h = resolution.y;
+
+    m_colorImage    = Image::create(w, h, ImageFormat::RGBA16F());
+    m_depthImage    = Image::create(w, h, ImageFormat::R32F());
+    m_velocityImage = Image::create(w, h, ImageFormat::RG16F());
+    const shared_ptr<Image>& color    = m_colorImage;
+    const shared_ptr<Image>& depth    = m_depthImage;
+    const shared_ptr<Image>& velocity = m_velocityImage;
+
+    const Vector3& clipInfo = m_camera->projection().reconstructFromDepthClipInfo();
+
+    // A ground plane receding from z = -3 at the bottom of the screen to z = -40 at the top,
+    // an in-focus block at the focus plane, and a fast foreground disk close to the camera.
+    // The camera pans slowly, so everything has some velocity.
+    const Point2 diskCenter(0.3f * w, 0.55f * h);
+    const float  diskRadius = 0.18f * h;
+    const Rect2D& block = Rect2D::xywh(0.55f * w, 0.3f * h, 0.2f * w, 0.35f * h);
+    const Vector2 panVelocity(-0.004f * w, 0.001f * h);
+    const Vector2 diskVelocity(0.03f * w, 0.0f);
+
+    runConcurrently(Point2int32(0, 0), Point2int32(w, h), [&](const Point2int32& P) {
+        const Point2 p(float(P.x) + 0.5f, float(P.y) + 0.5f);
+        const bool checker = (((P.x / 16) + (P.y / 16)) & 1) == 1;
+
+        float   z;
+        Color3  c;
+        Vector2 v;
+        if ((p - diskCenter).length() < diskRadius) {
+            z = -1.2f;
+            c = ((P.x / 4) & 1) ? Color3(4.0f, 3.5f, 2.0f) : Color3(0.1f, 0.05f, 0.02f);
+            v = diskVelocity;
+        } else if (block.contains(p)) {
+            z = -5.0f;
+            c = checker ? Color3(0.9f, 0.2f, 0.2f) : Color3(0.2f, 0.2f, 0.9f);
+            v = panVelocity;
+        } else {
+            const float a = p.y / float(h);
+            z = -1.0f / lerp(1.0f / 40.0f, 1.0f / 3.0f, a);
+            c = checker ? Color3(a, 0.8f, 1.0f - a) : Color3(0.05f, 0.05f, 0.05f);
+            v = panVelocity * (1.0f + a);
+        }
+
+        color->set(P, Color4(c, 1.0f));
+        depth->set(P, Color1((clipInfo.x / z - clipInfo.z) / clipInfo.y));
+        velocity->set(P, Color3(v.x, v.y, 0.0f));
+    });
+
+    const bool generateMipMaps = false;
+    m_color    = Texture::fromImage("G3D::UniversalBlurBenchmark::m_color",    color,    ImageFormat::RGBA16F(), Texture::DIM_2D, generateMipMaps);
+    m_depth    = Texture::fromImage("G3D::UniversalBlurBenchmark::m_depth",    depth,    ImageFormat::R32F(),    Texture::DIM_2D, generateMipMaps);
+    m_velocity = Texture::fromImage("G3D::UniversalBlurBenchmark::m_velocity", velocity, ImageFormat::RG16F(),   Texture::DIM_2D, generateMipMaps);
+
+    if (isNull(m_framebuffer)) {
+        m_framebuffer = Framebuffer::create(Texture::createEmpty("G3D::UniversalBlurBenchmark::m_framebuffer", w, h, ImageFormat::RGBA16F(), Texture::DIM_2D, generateMipMaps));
+    } else {
+        m_framebuffer->resize(w, h);
+    }
+}
+
+
+void UniversalBlurBenchmark::renderFrame(RenderDevice* rd, bool universal) {
+    const shared_ptr<Texture>& target = m_framebuffer->texture(0);
+    Texture::copy(m_color, target, 0, 0, 1.0f, Vector2int16(0, 0), CubeFace::POS_X, CubeFace::POS_X, rd, false);
+
+    m_camera->universalBlurSettings().setEnabled(universal);
+
+    rd->push2D(m_framebuffer); {
+        // Each profiler event needs its own call site
+        if (universal) {
+            BEGIN_PROFILER_EVENT("UniversalBlur");
+            m_universalBlur->apply(rd, target, m_depth, m_velocity, m_camera, Vector2int16(0, 0));
+            END_PROFILER_EVENT();
+        } else {
+            BEGIN_PROFILER_EVENT("DepthOfField+MotionBlur");
+            m_depthOfField->apply(rd, target, m_depth, m_camera, Vector2int16(0, 0));
+            m_motionBlur->apply(rd, target, m_velocity, m_depth, m_camera, Vector2int16(0, 0));
+            END_PROFILER_EVENT();
+        }
+    } rd->pop2D();
+
+    // Make the GPU timer queries for this frame available before the profiler collects them
+    glFinish();
+    Profiler::nextFrame();
+}
+
+
+bool UniversalBlurBenchmark::matchesReference() const {
+    // The fixtures use neither temporal accumulation nor reduced resolution, which the reference ignores
+    m_reference->setTileClassification(m_universalBlur->tileClassification());
+
+    const shared_ptr<Image>& expected = Image::create(m_colorImage->width(), m_colorImage->height(), ImageFormat::RGB32F());
+    m_reference->apply(m_colorImage, m_depthImage, m_velocityImage, m_camera, expected);
+
+    return UniversalBlurCPU::matches(expected, m_framebuffer->texture(0)->toImage(ImageFormat::RGB32F()));
+}
+
+
+void UniversalBlurBenchmark::runConfiguration
+   (RenderDevice*       rd,
+    bool                universal,
+    const Settings&     settings,
+    int                 numSamples,
+    float               maxBlurDiameterFraction,
+    TextOutput&         csv) {
+
+    const String pipelineName = universal ? "UniversalBlur" : "DepthOfField+MotionBlur";
+
+    m_camera->motionBlurSettings().setNumSamples(numSamples);
+    m_camera->motionBlurSettings().setMaxBlurDiameterFraction(maxBlurDiameterFraction);
+
+    for (int f = 0; f < settings.warmupFrames; ++f) {
+        renderFrame(rd, universal);
+    }
+
+    // Total times per pass, in the order first seen. The pipeline event itself is the first entry.
+    Array<String> passName;
+    Array<double> cpuTime;
+    Array<double> gfxTime;
+    double samplesPerPixel = 0.0;
+    int    samplesPerPixelCount = 0;
+
+    for (int f = 0; f < settings.timedFrames; ++f) {
+        renderFrame(rd, universal);
+        if (universal) {
+            // Read back asynchronously, so it may not be available every frame
+            const float s = m_universalBlur->averageSamplesPerPixel();
+            if (s >= 0.0f) {
+                samplesPerPixel += s;
+                ++samplesPerPixelCount;
+            }
+        }
+
+        Array<const Array<Profiler::Event>*> eventTreeArray;
+        Profiler::getEvents(eventTreeArray);
+        for (int t = 0; t < eventTreeArray.size(); ++t) {
+            const Array<Profiler::Event>& tree = *(eventTreeArray[t]);
+            for (int e = 0; e < tree.size(); ++e) {
+                if (tree[e].name() != pipelineName) {
+                    continue;
+                }
+
+                // Record the pipeline event and everything nested under it
+                const int rootLevel = tree[e].level();
+                for (int c = e; (c < tree.size()) && ((c == e) || (tree[c].level() > rootLevel)); ++c) {
+                    const Profiler::Event& event = tree[c];
+                    int i = passName.findIndex(event.name());
+                    if (i == -1) {
+                        i = passName.size();
+                        passName.append(event.name());
+                        cpuTime.append(0.0);
+                        gfxTime.append(0.0);
+                    }
+                    cpuTime[i] += event.cpuDuration();
+                    gfxTime[i] += event.gfxDuration();
+                }
+            }
+        }
+    }
+
+    // The separate effects do not report their sample counts and have no reference
+    const String& samplesPerPixelColumn = (universal && (samplesPerPixelCount > 0)) ? format("%.2f", samplesPerPixel / samplesPerPixelCount) : "";
+    const String& matchesColumn = universal ? (matchesReference() ? "yes" : "no") : "";
+
+    const Vector2int32 resolution(m_color->width(), m_color->height());
+    for (int i = 0; i < passName.size(); ++i) {
+        csv.printf("%s,%d,%d,%d,%g,%s,%.4f,%.4f,%s,%s\n",
+            pipelineName.c_str(), resolution.x, resolution.y, numSamples, maxBlurDiameterFraction,
+            (i == 0) ? "total" : passName[i].c_str(),
+            cpuTime[i] / (settings.timedFrames * units::milliseconds()),
+            gfxTime[i] / (settings.timedFrames * units::milliseconds()),
+            samplesPerPixelColumn.c_str(), matchesColumn.c_str());
+    }
+}
+
+
+void UniversalBlurBenchmark::run(RenderDevice* rd, const Settings& settings, const String& csvFilename) {
+    alwaysAssertM(settings.timedFrames > 0, "Must time at least one frame");
+
+    const bool wasEnabled = Profiler::enabled();
+    Profiler::setEnabled(true);
+
+    TextOutput::Settings opt;
+    opt.wordWrap = TextOutput::Settings::WRAP_NONE;
+    TextOutput csv(csvFilename, opt);
+    csv.printf("pipeline,width,height,numSamples,maxBlurDiameterFraction,pass,cpuMs,gpuMs,samplesPerPixel,matchesCPU\n");
+
+    for (const Vector2int32& resolution : settings.resolutions) {
+        makeFixtures(resolution);
+        for (const int numSamples : settings.numSamples) {
+            for (const float maxBlurDiameterFraction : settings.maxBlurDiameterFractions) {
+                runConfiguration(rd, true,  settings, numSamples, maxBlurDiameterFraction, csv);
+                runConfiguration(rd, false, settings, numSamples, maxBlurDiameterFraction, csv);
+            }
+        }
+    }
+
+    csv.commit();
+    Profiler::setEnabled(wasEnabled);
+}
+
+} // namespace G3D
@@ -0,0 +1,703 @@
+/**
+  \file G3D-app.lib/source/UniversalBlurCPU.cpp
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#include "G3D-base/platform.h"
+#ifdef G3D_X86
+#   include <xmmintrin.h>
+#endif
+#include "G3D-base/Image.h"
+#include "G3D-base/Random.h"
+#include "G3D-base/Rect2D.h"
+#include "G3D-base/Thread.h"
+#include "G3D-app/UniversalBlurCPU.h"
+#include "G3D-app/UniversalBlur.h"
+#include "G3D-app/Camera.h"
+
+namespace G3D {
+
+struct UniversalBlurCPU::Constants {
+    /** Size of the inputs, including the trim band */
+    int             width;
+    int             height;
+
+    /** Size with the trim band stripped, which is the size of the GPU's packed and cached source buffers */
+    int             trimmedWidth;
+    int             trimmedHeight;
+
+    Vector2int16    trimBandThickness;
+
+    int             maxBlurRadiusPixels;
+    int             tileWidth;
+    int             tileHeight;
+    int             numSamplesOdd;
+    float           exposureTimeFraction;
+
+    /** The GPU passes this as an int uniform */
+    int             maxCoCRadiusPixels;
+    float           invNearBlurRadiusPixels;
+    float           lowResolutionFactor;
+
+    /** The MOTION_BLUR and DEPTH_OF_FIELD macros */
+    bool            motionBlur;
+    bool            depthOfField;
+
+    /** UniversalBlur::tileClassification() */
+    bool            tileClassification;
+
+    /** Neighborhood radius of the circle of confusion maximum, in tiles */
+    int             maxCoCTileRadius;
+
+    /** UniversalBlurSettings::adaptiveSampleCount() and its odd sample count bounds */
+    bool            adaptiveSampleCount;
+    int             minNumSamples;
+    int             maxNumSamples;
+};
+
+
+UniversalBlurCPU::UniversalBlurCPU() : m_tileClassification(true) {
+    // Same sequence as UniversalBlur::makeRandomBuffer(), read back from an R8 texture
+    static const int N = 32;
+    Random rnd;
+    for (int i = N * N - 1; i >= 0; --i) {
+        m_random[i] = float(rnd.integer(0, 255)) / 255.0f;
+    }
+}
+
+
+shared_ptr<UniversalBlurCPU> UniversalBlurCPU::create() {
+    return createShared<UniversalBlurCPU>();
+}
+
+
+float UniversalBlurCPU::packedCoC(const Constants& k, int x, int y) const {
+    if ((x < 0) || (y < 0) || (x >= k.trimmedWidth) || (y >= k.trimmedHeight)) {
+        return -1.0f;
+    }
+    return m_packedCoC[x + y * k.trimmedWidth];
+}
+
+
+void UniversalBlurCPU::readInputs
+   (const shared_ptr<Image>&    color,
+    const shared_ptr<Image>&    depth,
+    const shared_ptr<Image>&    velocity,
+    const Constants&            k,
+    bool                        singleThreaded) {
+
+    m_color.resize(k.trimmedWidth * k.trimmedHeight, false);
+    m_depth.resize(k.width * k.height, false);
+    m_velocity.resize(notNull(velocity) ? k.width * k.height : 0, false);
+
+    runConcurrently(0, k.height, [&](int y) {
+        for (int x = 0; x < k.width; ++x) {
+            m_depth[x + y * k.width] = depth->get<Color1>(x, y).value;
+        }
+
+        if (notNull(velocity)) {
+            for (int x = 0; x < k.width; ++x) {
+                const Color3& v = velocity->get<Color3>(x, y);
+                m_velocity[x + y * k.width] = Vector2(v.r, v.g);
+            }
+        }
+
+        // Copy and strip the trim band
+        const int ty = y - k.trimBandThickness.y;
+        if ((ty >= 0) && (ty < k.trimmedHeight)) {
+            for (int tx = 0; tx < k.trimmedWidth; ++tx) {
+                m_color[tx + ty * k.trimmedWidth] = color->get<Color4>(tx + k.trimBandThickness.x, y);
+            }
+        }
+    }, singleThreaded);
+}
+
+
+/** Mirrors circleOfConfusionRadiusPixels() in DepthOfField.glsl for the non-chromablur case */
+static float circleOfConfusionRadius
+   (float                       z,
+    const DepthOfFieldModel&    model,
+    float                       focusPlaneZ,
+    float                       scale,
+    float                       nearBlurryPlaneZ,
+    float                       nearSharpPlaneZ,
+    float                       farSharpPlaneZ,
+    float                       farBlurryPlaneZ,
+    float                       nearScale,
+    float                       farScale) {
+
+    float radius = 0.0f;
+    if (model == DepthOfFieldModel::PHYSICAL) {
+        radius = (z - focusPlaneZ) * scale / z;
+        if (radius < 0.0f) {
+            // Far field compensation, as on the GPU
+            radius *= 0.6f;
+        }
+    } else if (model == DepthOfFieldModel::ARTIST) {
+        if (z > nearSharpPlaneZ) {
+            radius = square(min(z, nearBlurryPlaneZ) - nearSharpPlaneZ) * nearScale;
+        } else if (z > farSharpPlaneZ) {
+            radius = 0.0f;
+        } else {
+            radius = (max(z, farBlurryPlaneZ) - farSharpPlaneZ) * farScale;
+        }
+
+        if (radius > 0.0f) { radius *= 1.5f; }
+    }
+    return radius;
+}
+
+
+void UniversalBlurCPU::computeCoC(const shared_ptr<Camera>& camera, const Constants& k, bool singleThreaded) {
+    m_packedCoC.resize(k.trimmedWidth * k.trimmedHeight, false);
+
+    const DepthOfFieldSettings& settings = camera->depthOfFieldSettings();
+    const DepthOfFieldModel model = settings.model();
+    const float maxCoCRadiusPixels = float(k.maxCoCRadiusPixels);
+
+    if ((model == DepthOfFieldModel::NONE) || (maxCoCRadiusPixels <= 0.0f)) {
+        // The shader writes a zero alpha for MODEL == NONE. A zero maximum radius would
+        // make the GPU scale factors infinite; treat the whole frame as far field there too.
+        m_packedCoC.setAll(-1.0f);
+        return;
+    }
+
+    const Vector3& clipInfo = camera->projection().reconstructFromDepthClipInfo();
+    const float axisSize = (camera->fieldOfViewDirection() == FOVDirection::HORIZONTAL) ? float(k.width) : float(k.height);
+
+    float focusPlaneZ = 0.0f, scale = 0.0f, nearScale = 0.0f, farScale = 0.0f;
+    if (model == DepthOfFieldModel::ARTIST) {
+        nearScale = settings.nearBlurRadiusFraction() / (settings.nearBlurryPlaneZ() - settings.nearSharpPlaneZ()) * axisSize / maxCoCRadiusPixels;
+        farScale  = settings.farBlurRadiusFraction()  / (settings.farSharpPlaneZ() - settings.farBlurryPlaneZ())   * axisSize / maxCoCRadiusPixels;
+        alwaysAssertM(nearScale >= 0.0f, "Near normalization must be a non-negative factor");
+        alwaysAssertM(farScale >= 0.0f, "Far normalization must be a non-negative factor");
+    } else {
+        // The GPU computes this from the packed framebuffer's viewport, which excludes the trim band
+        const float screenSize = (camera->fieldOfViewDirection() == FOVDirection::VERTICAL) ? float(k.trimmedHeight) : float(k.trimmedWidth);
+        focusPlaneZ = settings.focusPlaneZ();
+        scale = (screenSize * 0.5f / tan(camera->projection().fieldOfViewAngle() * 0.5f)) * settings.lensRadius() /
+            (focusPlaneZ * maxCoCRadiusPixels);
+    }
+
+    // COMPUTE_PERCENT = 100 when rendering to a disk
+    const bool  diskFramebuffer = settings.diskFramebuffer();
+    const float diskRadius2 = square(0.5f * float(max(k.trimmedWidth, k.trimmedHeight)));
+
+    runConcurrently(0, k.trimmedHeight, [&](int y) {
+        for (int x = 0; x < k.trimmedWidth; ++x) {
+            float& coc = m_packedCoC[x + y * k.trimmedWidth];
+
+            if (diskFramebuffer &&
+                (square(float(x) + 0.5f - float(k.trimmedWidth) * 0.5f) + square(float(y) + 0.5f - float(k.trimmedHeight) * 0.5f) > diskRadius2)) {
+                // The shader writes 0.5, which unpacks to zero
+                coc = 0.0f;
+                continue;
+            }
+
+            const float d = m_depth[(x + k.trimBandThickness.x) + (y + k.trimBandThickness.y) * k.width];
+            const float z = clipInfo[0] / (clipInfo[1] * d + clipInfo[2]);
+            coc = clamp(circleOfConfusionRadius(z, model, focusPlaneZ, scale,
+                settings.nearBlurryPlaneZ(), settings.nearSharpPlaneZ(), settings.farSharpPlaneZ(), settings.farBlurryPlaneZ(),
+                nearScale, farScale), -1.0f, 1.0f);
+        }
+    }, singleThreaded);
+}
+
+
+void UniversalBlurCPU::computeTileMinMax(const Constants& k, bool singleThreaded) {
+    const int R = k.maxBlurRadiusPixels;
+    const Vector2int16 shift = k.trimBandThickness;
+
+    // The temp buffer is transposed: it is h x tileWidth
+    m_tileMinMaxTemp.resize(k.trimmedHeight * k.tileWidth, false);
+    m_tileMaxCoCTemp.resize(k.trimmedHeight * k.tileWidth, false);
+    m_tileMinMax.resize(k.tileWidth * k.tileHeight, false);
+    m_tileMaxCoC.resize(k.tileWidth * k.tileHeight, false);
+
+    // Horizontal pass. Like the shader, this applies inputShift transposed relative to the output.
+    const int maxCoordX = k.width - 1 - shift.x;
+    runConcurrently(0, k.tileWidth, [&](int tileX) {
+        for (int row = 0; row < k.trimmedHeight; ++row) {
+            const int tileCornerX = tileX * R + shift.y;
+            const int tileRowY = row + shift.x;
+
+            Vector2 m = Vector2::zero();
+            float largestMagnitude2 = 0.0f;
+            if (! m_velocity.empty() && (tileRowY < k.height)) {
+                for (int offset = 0; offset < R; ++offset) {
+                    const Vector2& v = m_velocity[clamp(tileCornerX + offset, int(shift.x), maxCoordX) + tileRowY * k.width];
+                    const float thisMagnitude2 = v.squaredLength();
+                    if (thisMagnitude2 > largestMagnitude2) {
+                        m = v;
+                        largestMagnitude2 = thisMagnitude2;
+                    }
+                }
+            }
+            m_tileMinMaxTemp[row + tileX * k.trimmedHeight] = m;
+
+            // The packed buffer has no trim band, so this is not shifted
+            float maxCoC = 0.0f;
+            for (int offset = 0; offset < R; ++offset) {
+                maxCoC = max(maxCoC, fabs(packedCoC(k, min(tileX * R + offset, k.trimmedWidth - 1), row)));
+            }
+            m_tileMaxCoCTemp[row + tileX * k.trimmedHeight] = maxCoC;
+        }
+    }, singleThreaded);
+
+    // Vertical pass, transposing back
+    runConcurrently(0, k.tileHeight, [&](int tileY) {
+        for (int tileX = 0; tileX < k.tileWidth; ++tileX) {
+            Vector2 m = Vector2::zero();
+            float largestMagnitude2 = 0.0f;
+            float maxCoC = 0.0f;
+            for (int offset = 0; offset < R; ++offset) {
+                const int i = min(tileY * R + offset, k.trimmedHeight - 1) + tileX * k.trimmedHeight;
+                const Vector2& v = m_tileMinMaxTemp[i];
+                const float thisMagnitude2 = v.squaredLength();
+                if (thisMagnitude2 > largestMagnitude2) {
+                    m = v;
+                    largestMagnitude2 = thisMagnitude2;
+                }
+                maxCoC = max(maxCoC, m_tileMaxCoCTemp[i]);
+            }
+            m_tileMinMax[tileX + tileY * k.tileWidth] = m;
+            m_tileMaxCoC[tileX + tileY * k.tileWidth] = maxCoC;
+        }
+    }, singleThreaded);
+}
+
+
+void UniversalBlurCPU::computeNeighborMinMax(const Constants& k, bool singleThreaded) {
+    m_neighborMinMax.resize(k.tileWidth * k.tileHeight, false);
+    m_neighborMaxCoC.resize(k.tileWidth * k.tileHeight, false);
+
+    runConcurrently(0, k.tileHeight, [&](int tileY) {
+        for (int tileX = 0; tileX < k.tileWidth; ++tileX) {
+            Vector2 maxVelocity = Vector2::zero();
+            float largestMagnitude2 = -1.0f;
+
+            for (int dy = -1; dy <= 1; ++dy) {
+                for (int dx = -1; dx <= 1; ++dx) {
+                    const Vector2& v = m_tileMinMax[clamp(tileX + dx, 0, k.tileWidth - 1) + clamp(tileY + dy, 0, k.tileHeight - 1) * k.tileWidth];
+                    const float magnitude2 = v.squaredLength();
+
+                    if (magnitude2 > largestMagnitude2) {
+                        // Only tiles whose velocity points toward the center tile can affect it
+                        const float displacement = float(abs(dx) + abs(dy));
+                        const float distance = sign(float(dx) * v.x) + sign(float(dy) * v.y);
+                        if (fabs(distance) == displacement) {
+                            maxVelocity = v;
+                            largestMagnitude2 = magnitude2;
+                        }
+                    }
+                }
+            }
+            m_neighborMinMax[tileX + tileY * k.tileWidth] = maxVelocity;
+
+            // Unlike velocity, a circle of confusion spreads in every direction
+            float maxCoC = 0.0f;
+            for (int dy = -k.maxCoCTileRadius; dy <= k.maxCoCTileRadius; ++dy) {
+                for (int dx = -k.maxCoCTileRadius; dx <= k.maxCoCTileRadius; ++dx) {
+                    maxCoC = max(maxCoC, m_tileMaxCoC[clamp(tileX + dx, 0, k.tileWidth - 1) + clamp(tileY + dy, 0, k.tileHeight - 1) * k.tileWidth]);
+                }
+            }
+            m_neighborMaxCoC[tileX + tileY * k.tileWidth] = maxCoC;
+        }
+    }, singleThreaded);
+}
+
+
+
+
+/** 0 if depth_A << depth_B, 1 if depth_A >> depth_B, fades between when they are close */
+static inline float softDepthCompare(float depth_A, float depth_B) {
+    const float SOFT_DEPTH_EXTENT = 0.01f;
+    return clamp(1.0f - (depth_B - depth_A) / SOFT_DEPTH_EXTENT, 0.0f, 1.0f);
+}
+
+
+static inline float cone(float dist, float r) {
+    return clamp(1.0f - fabs(dist) / r, 0.0f, 1.0f);
+}
+
+
+static inline float fastCone(float dist, float invR) {
+    return clamp(1.0f - fabs(dist) * invR, 0.0f, 1.0f);
+}
+
+
+static inline float cylinder(float dist, float r) {
+    return sign(r - fabs(dist)) * 0.5f + 0.5f;
+}
+
+
+void UniversalBlurCPU::universalGatherBlur
+   (const Constants&            k,
+    bool                        isSpeedDirection,
+    const Array<Color4>&        color,
+    int                         outputWidth,
+    int                         outputHeight,
+    Array<Color4>&              output,
+    bool                        singleThreaded) const {
+
+    // Constant indicating locations where we clamp against the minimum PSF, 1/2 pixel
+    static const float HALF_PIX = 0.5f;
+    static const float centerOverrideThresholdPixels = 5.0f;
+    static const float varianceThreshold = 1.5f;
+    static const float nearFieldBorder = 0.25f;
+    static const float superNearFieldBorder = 0.5f;
+    static const float initialCoverage = 2.0f;
+
+    const Vector2int16 trim = k.trimBandThickness;
+    const int   N = k.numSamplesOdd;
+    const float maxCoC = float(k.maxCoCRadiusPixels);
+
+    // Both gather passes read a color buffer without the trim band
+    const int   colorWidth = k.trimmedWidth;
+    const int   colorHeight = k.trimmedHeight;
+    const Point2int32 screenMax(colorWidth + trim.x * 2 - 1, colorHeight + trim.y * 2 - 1);
+
+    // Mirrors readAdjustedVelocity() in MotionBlur_universalGather.glsl. raw is the decoded
+    // velocity and CoC the signed circle of confusion read at the same location. motionBlur and
+    // depthOfField are the macros that the gather was compiled with for this pixel's tile.
+    const auto readAdjustedVelocity = [&](bool motionBlur, bool depthOfField, const Vector2& raw, float CoC, float& r, float& CoC_ratio) {
+        Vector2 q(1.0f, 0.0f);
+        if (motionBlur) {
+            const float lenq = raw.length();
+
+            // Convert the velocity to be a radius instead of a diameter, and scale by the exposure time
+            r = lenq * 0.5f * k.exposureTimeFraction;
+            const bool rMuchLargerThanZero = (r >= 0.1f);
+            r = clamp(r, HALF_PIX, float(k.maxBlurRadiusPixels));
+            if (rMuchLargerThanZero) {
+                q = raw * (r / lenq);
+            }
+        } else {
+            r = 0.01f;
+        }
+
+        if (! isSpeedDirection) {
+            q = Vector2(-q.y, q.x);
+            r = 0.01f;
+        }
+
+        if (depthOfField) {
+            r += maxCoC * fabs(CoC);
+            CoC_ratio = CoC / r;
+        } else {
+            CoC_ratio = 0.0f;
+        }
+
+        return q;
+    };
+
+    const auto velocityAt = [&](int x, int y) {
+        return m_velocity.empty() ? Vector2::zero() : m_velocity[x + y * k.width];
+    };
+
+    // Pseudo-random number on [0, 1] from the pixel position
+    const auto hash = [&](int x, int y) {
+        if (N <= 5) {
+            return float((x + y) & 1) * 0.5f + 0.25f;
+        } else {
+            return m_random[(x & 31) + (y & 31) * 32];
+        }
+    };
+
+    output.resize(outputWidth * outputHeight, false);
+
+    runConcurrently(0, outputHeight, [&](int y) {
+        Color4* row = output.getCArray() + y * outputWidth;
+
+        if ((y < trim.y) || (y >= outputHeight - trim.y)) {
+            // Outside of the guard band clip region
+            for (int x = 0; x < outputWidth; ++x) {
+                row[x] = Color4::zero();
+            }
+            return;
+        }
+
+        for (int x = 0; x < trim.x; ++x) {
+            row[x] = Color4::zero();
+            row[outputWidth - 1 - x] = Color4::zero();
+        }
+
+        for (int x = trim.x; x < outputWidth - trim.x; ++x) {
+            const Point2 fragCoord(float(x) + 0.5f, float(y) + 0.5f);
+            const Color4& centerColor = color[(x - trim.x) + (y - trim.y) * colorWidth];
+            const int tileIndex = (x - trim.x) / k.maxBlurRadiusPixels + ((y - trim.y) / k.maxBlurRadiusPixels) * k.tileWidth;
+
+            bool motionBlur = k.motionBlur;
+            bool depthOfField = k.depthOfField;
+            if (k.tileClassification) {
+                // Mirrors UniversalBlur_tileClassify.vrt
+                const float motionRadius = m_neighborMinMax[tileIndex].length() * 0.5f * k.exposureTimeFraction;
+                const float cocRadius = m_neighborMaxCoC[tileIndex] * maxCoC;
+                motionBlur = motionBlur && (motionRadius >= 0.5f);
+                depthOfField = depthOfField && (cocRadius >= 0.5f);
+            }
+
+            if (! depthOfField && ! motionBlur) {
+                // The speed direction pass reports that no sample reaches this pixel
+                row[x] = Color4(centerColor.rgb(), isSpeedDirection ? 0.0f : 1.0f);
+                continue;
+            }
+
+            // Mirrors tileSampling() in MotionBlur_universalGather.glsl
+            int   numSamples = N;
+            float sampleExtent = maxCoC;
+            if (k.adaptiveSampleCount) {
+                float radius = 0.0f;
+                if (motionBlur) {
+                    radius += min(m_neighborMinMax[tileIndex].length() * 0.5f * k.exposureTimeFraction, float(k.maxBlurRadiusPixels));
+                }
+                if (depthOfField) {
+                    radius += m_neighborMaxCoC[tileIndex] * maxCoC;
+                }
+                sampleExtent = min(radius, maxCoC);
+                numSamples = UniversalBlur::tileSampleCount(N, k.minNumSamples, k.maxNumSamples, sampleExtent, maxCoC);
+            }
+
+            const float CoC_center = packedCoC(k, int(fragCoord.x * k.lowResolutionFactor), int(fragCoord.y * k.lowResolutionFactor));
+            const float DoF_r = maxCoC * fabs(CoC_center);
+            const float depth_center = m_depth[x + y * k.width];
+
+            float r_neighborhood, r_neighborhood_CoC_ratio;
+            const Vector2& v_neighborhood = readAdjustedVelocity
+                (motionBlur, depthOfField, m_neighborMinMax[tileIndex], CoC_center, r_neighborhood, r_neighborhood_CoC_ratio);
+
+            float radius_center, CoC_ratio_center;
+            const Vector2& velocity_center = readAdjustedVelocity(motionBlur, depthOfField, velocityAt(x, y), CoC_center, radius_center, CoC_ratio_center);
+
+            // A pseudo-random number on [-0.5, 0.5]
+            float jitter = hash(x, y) - 0.5f;
+            jitter *= clamp((1.0f - fabs(CoC_ratio_center)) * radius_center * 0.03f, 0.0f, 1.0f);
+
+            const Vector2& w_neighborhood = ((radius_center >= centerOverrideThresholdPixels + DoF_r) ? velocity_center : v_neighborhood).direction();
+            const Vector2& w_center = (radius_center < varianceThreshold + DoF_r) ? w_neighborhood : velocity_center.direction();
+
+            const float invRadius_center = 1.0f / radius_center;
+            float totalCoverage = initialCoverage;
+            float resultAlpha = -1.0f;
+
+#           ifdef G3D_X86
+                __m128 result = _mm_mul_ps(_mm_loadu_ps(&centerColor.r), _mm_set1_ps(initialCoverage));
+#           else
+                Color3 result = centerColor.rgb() * initialCoverage;
+#           endif
+
+            for (int i = 0; i < numSamples; ++i) {
+                // SMOOTHER
+                if (i == numSamples / 2) { continue; }
+
+                const float t = clamp(2.4f * (float(i) + 1.0f + jitter) / (float(numSamples) + 1.0f) - 1.2f, -1.0f, 1.0f);
+                const float dist = t * sampleExtent;
+                const float absDist = fabs(dist);
+
+                const Point2& P = fragCoord + (((i & 1) == 1) ? w_center : w_neighborhood) * dist;
+
+                // int() truncates toward zero, as in GLSL
+                const int otherX = clamp(int(P.x), int(trim.x), screenMax.x);
+                const int otherY = clamp(int(P.y), int(trim.y), screenMax.y);
+
+                const float CoC_sample = packedCoC(k, int(P.x * k.lowResolutionFactor), int(P.y * k.lowResolutionFactor));
+                float radius_sample, radius_CoC_ratio;
+                readAdjustedVelocity(motionBlur, depthOfField, velocityAt(otherX, otherY), CoC_sample, radius_sample, radius_CoC_ratio);
+
+                const float depth_sample = m_depth[otherX + otherY * k.width];
+                const float inFront = softDepthCompare(depth_center, depth_sample);
+                const float inBack  = softDepthCompare(depth_sample, depth_center);
+
+                const Color4& color_sample = color[clamp(otherX - trim.x, 0, colorWidth - 1) + clamp(otherY - trim.y, 0, colorHeight - 1) * colorWidth];
+
+                float coverage_sample = 0.0f;
+                const float ratioMB = 1.0f - fabs(radius_CoC_ratio);
+
+                if (depthOfField) {
+                    coverage_sample += float((CoC_sample <= superNearFieldBorder) && (CoC_center <= nearFieldBorder));
+                    coverage_sample += float((CoC_sample >  nearFieldBorder)      && (CoC_center <= nearFieldBorder));
+                    coverage_sample += float((CoC_sample >  nearFieldBorder)      && (CoC_center >  nearFieldBorder));
+                }
+
+                const float nearFalloff = exp(-square(dist * k.invNearBlurRadiusPixels));
+                if (isSpeedDirection) {
+                    // Add only half of the speed as increased reach
+                    const float reach = ratioMB * radius_sample * 0.5f + fabs(CoC_sample) * maxCoC;
+                    if (absDist < reach) {
+                        resultAlpha = max(resultAlpha, clamp((reach - absDist) / reach, 0.0f, 1.0f));
+                        coverage_sample *= nearFalloff;
+                    } else {
+                        // The shader's saturate(cornerRad * isInReach) is zero out of reach
+                        resultAlpha = max(resultAlpha, 0.0f);
+                        coverage_sample = 0.0f;
+                    }
+                } else {
+                    const float reach = max(fabs(color_sample.a * maxCoC), fabs(CoC_sample * maxCoC));
+                    coverage_sample *= (absDist * 1.4f < reach) ? nearFalloff : 0.0f;
+                }
+
+                if (motionBlur && isSpeedDirection && (absDist < fabs(radius_sample) * ratioMB)) {
+                    const float mbCoverage =
+                        inBack * fastCone(dist, invRadius_center) +
+                        inFront * cone(dist, radius_sample) +
+                        cylinder(dist, min(radius_center, radius_sample)) * 2.0f;
+                    coverage_sample += 0.33f * mbCoverage;
+                }
+
+#               ifdef G3D_X86
+                    result = _mm_add_ps(result, _mm_mul_ps(_mm_loadu_ps(&color_sample.r), _mm_set1_ps(coverage_sample)));
+#               else
+                    result += color_sample.rgb() * coverage_sample;
+#               endif
+                totalCoverage += coverage_sample;
+            }
+
+#           ifdef G3D_X86
+                _mm_storeu_ps(&row[x].r, _mm_mul_ps(result, _mm_set1_ps(1.0f / totalCoverage)));
+#           else
+                row[x] = Color4(result / totalCoverage);
+#           endif
+            // The speed direction pass stores the reach for the perpendicular pass
+            row[x].a = isSpeedDirection ? resultAlpha : 1.0f;
+        }
+    }, singleThreaded);
+}
+
+
+void UniversalBlurCPU::apply
+   (const shared_ptr<Image>&    color,
+    const shared_ptr<Image>&    depth,
+    const shared_ptr<Image>&    velocity,
+    const shared_ptr<Camera>&   camera,
+    const shared_ptr<Image>&    result,
+    Vector2int16                trimBandThickness,
+    bool                        singleThreaded) {
+
+    alwaysAssertM(notNull(color), "Color buffer may not be nullptr");
+    alwaysAssertM(notNull(depth), "Depth buffer may not be nullptr");
+    alwaysAssertM(notNull(camera), "Camera may not be nullptr");
+    alwaysAssertM(notNull(result), "Result image may not be nullptr");
+    alwaysAssertM((depth->width() == color->width()) && (depth->height() == color->height()), "Depth and color must have the same dimensions");
+    alwaysAssertM(isNull(velocity) || ((velocity->width() == color->width()) && (velocity->height() == color->height())), "Velocity and color must have the same dimensions");
+    alwaysAssertM((result->width() == color->width()) && (result->height() == color->height()), "Result and color must have the same dimensions");
+
+    Constants k;
+    k.width = color->width();
+    k.height = color->height();
+    k.trimBandThickness = trimBandThickness;
+    k.trimmedWidth = k.width - trimBandThickness.x * 2;
+    k.trimmedHeight = k.height - trimBandThickness.y * 2;
+    alwaysAssertM((k.trimmedWidth > 0) && (k.trimmedHeight > 0), "Trim band is larger than the image");
+
+    const Rect2D& viewport = Rect2D::xywh(0.0f, 0.0f, float(k.width), float(k.height));
+    const Rect2D& trimmedViewport = Rect2D::xywh(0.0f, 0.0f, float(k.trimmedWidth), float(k.trimmedHeight));
+    const DepthOfFieldSettings& dofSettings = camera->depthOfFieldSettings();
+    const MotionBlurSettings& mbSettings = camera->motionBlurSettings();
+
+    k.maxCoCRadiusPixels = int(ceil(camera->maxCircleOfConfusionRadiusPixels(viewport)));
+    k.lowResolutionFactor = float(dofSettings.reducedResolutionFactor());
+    k.motionBlur = camera->universalBlurSettings().MbAlgorithm();
+    k.depthOfField = camera->universalBlurSettings().DofAlgorithm();
+    k.tileClassification = m_tileClassification;
+    k.adaptiveSampleCount = camera->universalBlurSettings().adaptiveSampleCount();
+    k.minNumSamples = nextOdd(camera->universalBlurSettings().minNumSamples());
+    k.maxNumSamples = max(k.minNumSamples, nextOdd(camera->universalBlurSettings().maxNumSamples()));
+
+    // Dimension along which the blur fraction is measured. The GPU measures the motion blur
+    // radius on the full input and the near blur on the (trimmed) gather input.
+    const int dimension = (camera->fieldOfViewDirection() == FOVDirection::HORIZONTAL) ? k.width : k.height;
+    k.maxBlurRadiusPixels = max(4, iCeil(float(dimension) * camera->universalBlurSettings().effectiveMaxBlurDiameterFraction(mbSettings) / 2.0f));
+    k.numSamplesOdd = nextOdd(camera->universalBlurSettings().effectiveNumSamples(mbSettings));
+    k.exposureTimeFraction = mbSettings.exposureFraction();
+    k.tileWidth = iCeil(k.trimmedWidth / float(k.maxBlurRadiusPixels));
+    k.tileHeight = iCeil(k.trimmedHeight / float(k.maxBlurRadiusPixels));
+    k.maxCoCTileRadius = iCeil(float(k.maxCoCRadiusPixels) / float(k.maxBlurRadiusPixels));
+
+    // Worst-case near plane blur, as computed in UniversalBlur::universalGatherBlur
+    {
+        const float trimmedDimension = float((camera->fieldOfViewDirection() == FOVDirection::HORIZONTAL) ? k.trimmedWidth : k.trimmedHeight);
+        float n = 0.0f;
+        if (dofSettings.model() == DepthOfFieldModel::ARTIST) {
+            n = dofSettings.nearBlurRadiusFraction() * trimmedDimension;
+        } else {
+            n = -camera->circleOfConfusionRadiusPixels(min(camera->m_closestNearPlaneZForDepthOfField, camera->projection().nearPlaneZ()), trimmedViewport);
+        }
+
+        int nearBlurRadiusPixels = iCeil(min(camera->m_viewportFractionMaxCircleOfConfusion * trimmedViewport.width(), n));
+        if (nearBlurRadiusPixels < dofSettings.reducedResolutionFactor() - 1) {
+            nearBlurRadiusPixels = 0;
+        }
+        k.invNearBlurRadiusPixels = 1.0f / max(float(nearBlurRadiusPixels), 0.0001f);
+    }
+
+    readInputs(color, depth, velocity, k, singleThreaded);
+    computeCoC(camera, k, singleThreaded);
+    computeTileMinMax(k, singleThreaded);
+    computeNeighborMinMax(k, singleThreaded);
+    universalGatherBlur(k, true,  m_color,              k.trimmedWidth, k.trimmedHeight, m_speedDirectionPass, singleThreaded);
+    universalGatherBlur(k, false, m_speedDirectionPass, k.width,        k.height,        m_result,             singleThreaded);
+
+    runConcurrently(0, k.height, [&](int y) {
+        for (int x = 0; x < k.width; ++x) {
+            result->set(x, y, m_result[x + y * k.width]);
+        }
+    }, singleThreaded);
+}
+
+
+bool UniversalBlurCPU::matches
+   (const shared_ptr<Image>&    expected,
+    const shared_ptr<Image>&    actual,
+    float                       meanTolerance,
+    float                       pixelTolerance,
+    float                       outlierFraction) {
+
+    alwaysAssertM(notNull(expected) && notNull(actual), "Images may not be nullptr");
+    if ((expected->width() != actual->width()) || (expected->height() != actual->height())) {
+        return false;
+    }
+
+    const int w = expected->width();
+    const int h = expected->height();
+
+    // Per-row sums so that rows can be processed concurrently without synchronization
+    Array<double> rowError;
+    Array<int>    rowOutliers;
+    rowError.resize(h);
+    rowOutliers.resize(h);
+
+    runConcurrently(0, h, [&](int y) {
+        double error = 0.0;
+        int outliers = 0;
+        for (int x = 0; x < w; ++x) {
+            const Color3& e = expected->get<Color3>(x, y);
+            const Color3& a = actual->get<Color3>(x, y);
+            float maxChannelError = 0.0f;
+            for (int c = 0; c < 3; ++c) {
+                const float channelError = fabs(a[c] - e[c]) / max(1.0f, fabs(e[c]));
+                error += channelError;
+                maxChannelError = max(maxChannelError, channelError);
+            }
+            if (maxChannelError > pixelTolerance) {
+                ++outliers;
+            }
+        }
+        rowError[y] = error;
+        rowOutliers[y] = outliers;
+    });
+
+    double totalError = 0.0;
+    int totalOutliers = 0;
+    for (int y = 0; y < h; ++y) {
+        totalError += rowError[y];
+        totalOutliers += rowOutliers[y];
+    }
+
+    const double numPixels = double(w) * double(h);
+    return (totalError / (numPixels * 3.0) <= meanTolerance) && (double(totalOutliers) <= numPixels * outlierFraction);
+}
+
+} // namespace G3D
@@ -0,0 +1,113 @@
+/**
+  \file G3D-app.lib/source/UniversalBlurSettings.cpp
+
+  G3D Innovation Engine http://casual-effects.com/g3d
+  Copyright 2000-2019, Morgan McGuire
+  All rights reserved
+  Available under the BSD License
+*/
+#include "G3D-app/UniversalBlurSettings.h"
+#include "G3D-base/Any.h"
+
+namespace G3D {
+
+UniversalBlurSettings::QualityTier::QualityTier(const Any& any) {
+    *this = QualityTier();
+
+    AnyTableReader reader("UniversalBlurSettings::QualityTier", any);
+
+    reader.getIfPresent("numSamples",               numSamples);
+    reader.getIfPresent("reducedResolutionFactor",  reducedResolutionFactor);
+    reader.getIfPresent("maxBlurDiameterFraction",  maxBlurDiameterFraction);
+    reader.verifyDone();
+
+    numSamples              = max(1, numSamples);
+    reducedResolutionFactor = max(1, reducedResolutionFactor);
+}
+
+
+Any UniversalBlurSettings::QualityTier::toAny() const {
+    Any any(Any::TABLE, "UniversalBlurSettings::QualityTier");
+
+    any["numSamples"]               = numSamples;
+    any["reducedResolutionFactor"]  = reducedResolutionFactor;
+    any["maxBlurDiameterFraction"]  = maxBlurDiameterFraction;
+
+    return any;
+}
+
+
+UniversalBlurSettings::UniversalBlurSettings() :
+    m_enabled(false),
+    m_MbAlgorithm(true),
+    m_DofAlgorithm(true),
+    m_qualityTiers(QualityTier(63, 1, 0.10f), QualityTier(27, 1, 0.10f), QualityTier(15, 2, 0.08f), QualityTier(9, 4, 0.06f)) {}
+
+
+UniversalBlurSettings::UniversalBlurSettings(const Any& any) {
+    *this = UniversalBlurSettings();
+
+    AnyTableReader reader("UniversalBlurSettings", any);
+
+    reader.getIfPresent("enabled",                  m_enabled);
+    reader.getIfPresent("MbAlgorithm",              m_MbAlgorithm);
+    reader.getIfPresent("DofAlgorithm",             m_DofAlgorithm);
+    reader.getIfPresent("reducedResolutionFactor",  m_reducedResolutionFactor);
+    reader.getIfPresent("adaptiveSampleCount",      m_adaptiveSampleCount);
+    reader.getIfPresent("minNumSamples",            m_minNumSamples);
+    reader.getIfPresent("maxNumSamples",            m_maxNumSamples);
+    reader.getIfPresent("temporalAccumulation",     m_temporalAccumulation);
+    reader.getIfPresent("temporalNumSamples",       m_temporalNumSamples);
+    reader.getIfPresent("temporalHysteresis",       m_temporalHysteresis);
+    reader.getIfPresent("automaticQuality",         m_automaticQuality);
+    reader.getIfPresent("frameBudgetMilliseconds",  m_frameBudgetMilliseconds);
+    reader.getIfPresent("qualityHysteresis",        m_qualityHysteresis);
+
+    Any tiers;
+    if (reader.getIfPresent("qualityTiers", tiers)) {
+        tiers.verifyType(Any::ARRAY);
+        tiers.verify(tiers.size() > 0, "Must have at least one quality tier");
+        m_qualityTiers.fastClear();
+        for (int t = 0; t < tiers.size(); ++t) {
+            m_qualityTiers.append(QualityTier(tiers[t]));
+        }
+    }
+
+    reader.getIfPresent("qualityTier",              m_qualityTier);
+    reader.verifyDone();
+
+    m_reducedResolutionFactor   = max(1, m_reducedResolutionFactor);
+    m_temporalHysteresis        = clamp(m_temporalHysteresis, 0.0f, 0.99f);
+    m_qualityHysteresis         = clamp(m_qualityHysteresis, 0.0f, 0.99f);
+    m_qualityTier               = clamp(m_qualityTier, 0, m_qualityTiers.size() - 1);
+}
+
+
+Any UniversalBlurSettings::toAny() const {
+    Any any(Any::TABLE, "UniversalBlurSettings");
+
+    any["enabled"]                  = m_enabled;
+    any["MbAlgorithm"]              = m_MbAlgorithm;
+    any["DofAlgorithm"]             = m_DofAlgorithm;
+    any["reducedResolutionFactor"]  = m_reducedResolutionFactor;
+    any["adaptiveSampleCount"]      = m_adaptiveSampleCount;
+    any["minNumSamples"]            = m_minNumSamples;
+    any["maxNumSamples"]            = m_maxNumSamples;
+    any["temporalAccumulation"]     = m_temporalAccumulation;
+    any["temporalNumSamples"]       = m_temporalNumSamples;
+    any["temporalHysteresis"]       = m_temporalHysteresis;
+    any["automaticQuality"]         = m_automaticQuality;
+    any["frameBudgetMilliseconds"]  = m_frameBudgetMilliseconds;
+    any["qualityHysteresis"]        = m_qualityHysteresis;
+
+    Any tiers(Any::ARRAY);
+    for (const QualityTier& tier : m_qualityTiers) {
+        tiers.append(tier.toAny());
+    }
+    any["qualityTiers"]             = tiers;
+    any["qualityTier"]              = m_qualityTier;
+
+    return any;
+}
+
+}